@@ -8,18 +8,82 @@
 #include <map>
 #include <random>
 #include <iomanip>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <queue>
+#include <unordered_map>
+#include <type_traits>
+#include <string_view>
+#include <charconv>
+#include <numeric>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <cstdarg>
+#include <cerrno>
+#include <csignal>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
+// Heap allocations made by the current thread, for the benchmarks' allocs/op. The
+// replacements stay out of line so the compiler does not pair malloc() and free() itself.
+thread_local uint64_t threadAllocations = 0;
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    threadAllocations++;
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { free(p); }
+
+// Status effects, in display order
+enum class EffectId {
+    BURN,
+    CURSED,
+    FROZEN,
+    POISONED,
+    COUNT
+};
+
+const char* const effectNames[] = {"Burn", "Cursed", "Frozen", "Poisoned"};
+
 // Status Effect structure
 struct StatusEffect {
-    string name;
-    int duration;
+    EffectId id;
+    int duration;  // in rounds; Creature::getEffect() gives an active effect's turns left
     float damageMultiplier;
     float defenseMultiplier;
     
+    const char* name() const { return effectNames[size_t(id)]; }
+    
     string getDescription() const {
-        string desc = name;
+        string desc = name();
         if (damageMultiplier != 1.0f) {
             desc += " (ATK x" + to_string(damageMultiplier).substr(0, 4) + ")";
         }
@@ -30,23 +94,68 @@ struct StatusEffect {
     }
 };
 
+typedef uint32_t NameId;
+typedef uint32_t MoveId;
+typedef uint32_t ItemId;
+
+// Interned strings: every distinct name is stored once and referred to by a dense id.
+// Lookups go through an open-addressing table of ids, so interning allocates no nodes.
+class NameTable {
+public:
+    static constexpr NameId NONE = UINT32_MAX;
+
+private:
+    deque<string> strings;
+    vector<NameId> slots;  // power-of-two sized, NONE when empty, at most half full
+    
+    size_t slotOf(string_view text) const {
+        size_t mask = slots.size() - 1;
+        size_t i = hash<string_view>()(text) & mask;
+        while (slots[i] != NONE && strings[slots[i]] != text) i = (i + 1) & mask;
+        return i;
+    }
+
+public:
+    NameTable() : slots(64, NONE) {}
+    
+    NameId intern(string_view text) {
+        size_t slot = slotOf(text);
+        if (slots[slot] != NONE) return slots[slot];
+        NameId id = strings.size();
+        strings.emplace_back(text);
+        slots[slot] = id;
+        if (strings.size() * 2 > slots.size()) reserve(strings.size() * 2);
+        return id;
+    }
+    
+    NameId find(string_view text) const {
+        return slots[slotOf(text)];
+    }
+    
+    const string& operator[](NameId id) const { return strings[id]; }
+    size_t size() const { return strings.size(); }
+    
+    void reserve(size_t count) {
+        size_t capacity = slots.size();
+        while (capacity < count * 2) capacity *= 2;
+        if (capacity == slots.size()) return;
+        slots.assign(capacity, NONE);
+        for (NameId id = 0; id < strings.size(); id++) slots[slotOf(strings[id])] = id;
+    }
+};
+
 // Item structure
 struct Item {
-    string name;
-    string description;
+    ItemId id;
+    NameId name;
+    NameId description;
     int duration;  // 0 for instant effects, >0 for over-time effects
     float healAmount;
     float attackBuff;
     float defenseBuff;
-    int quantity;
     
-    string getDescription() const {
-        string desc = name + ": " + description;
-        if (quantity > 0) {
-            desc += " (x" + to_string(quantity) + ")";
-        }
-        return desc;
-    }
+    const string& getName() const;
+    string getDescription(int quantity) const;
 };
 
 // Monster Types
@@ -55,674 +164,7046 @@ enum class MonsterType {
     FIRE,
     ICE,
     POISON,
-    UNDEAD
+    UNDEAD,
+    COUNT
 };
 
-map<MonsterType, string> elementNames = {
-    {MonsterType::NORMAL, "Normal"},
-    {MonsterType::FIRE, "Fire"},
-    {MonsterType::ICE, "Ice"},
-    {MonsterType::POISON, "Poison"},
-    {MonsterType::UNDEAD, "Undead"}
+constexpr size_t ELEMENT_COUNT = size_t(MonsterType::COUNT);
+
+// Element matchups; pairs not listed deal normal damage
+struct ElementMatchup {
+    MonsterType attacker;
+    MonsterType defender;
+    float multiplier;
 };
 
-struct MonsterTemplate {
-    string name;
-    MonsterType type;
-    float baseHP;
-    float baseAttack;
-    vector<pair<string, float>> specialMoves; // name and damage multiplier
+constexpr ElementMatchup elementMatchups[] = {
+    {MonsterType::FIRE, MonsterType::ICE, 1.5f},
+    {MonsterType::ICE, MonsterType::FIRE, 0.5f},
+    {MonsterType::POISON, MonsterType::UNDEAD, 0.5f},
+    {MonsterType::FIRE, MonsterType::UNDEAD, 1.25f},
+    {MonsterType::ICE, MonsterType::POISON, 1.25f}
+};
+
+// Attacker x defender damage multipliers, built at compile time from elementMatchups
+struct EffectivenessTable {
+    float multipliers[ELEMENT_COUNT][ELEMENT_COUNT];
+
+    constexpr float operator()(MonsterType attacker, MonsterType defender) const {
+        return multipliers[size_t(attacker)][size_t(defender)];
+    }
 };
 
-vector<MonsterTemplate> monsterTemplates = {
-    {"Goblin", MonsterType::NORMAL, 20, 4, {{"Sneaky Strike", 1.2f}, {"Rabid Attack", 1.4f}}},
-    {"Fire Drake", MonsterType::FIRE, 25, 5, {{"Flame Breath", 1.5f}, {"Heat Wave", 1.3f}}},
-    {"Frost Giant", MonsterType::ICE, 30, 3, {{"Ice Shard", 1.4f}, {"Freeze", 1.2f}}},
-    {"Poison Spider", MonsterType::POISON, 15, 6, {{"Venom Strike", 1.3f}, {"Web Trap", 1.1f}}},
-    {"Skeleton", MonsterType::UNDEAD, 18, 4, {{"Bone Throw", 1.2f}, {"Death Touch", 1.4f}}},
-    {"Dragon", MonsterType::FIRE, 40, 7, {{"Inferno", 1.8f}, {"Wing Slash", 1.5f}}},
-    {"Ice Witch", MonsterType::ICE, 22, 5, {{"Blizzard", 1.6f}, {"Frost Nova", 1.4f}}},
-    {"Toxic Slime", MonsterType::POISON, 25, 3, {{"Acid Splash", 1.3f}, {"Dissolve", 1.5f}}},
-    {"Lich", MonsterType::UNDEAD, 35, 6, {{"Soul Drain", 1.7f}, {"Curse", 1.4f}}},
-    {"Babayaga", MonsterType::NORMAL, 50, 10, {{"Doggono", 3.0f}, {"Mad gun", 2.5f}}}
+constexpr EffectivenessTable buildEffectivenessTable() {
+    EffectivenessTable table = {};
+    for (size_t a = 0; a < ELEMENT_COUNT; a++) {
+        for (size_t d = 0; d < ELEMENT_COUNT; d++) table.multipliers[a][d] = 1.0f;
+    }
+    for (const auto& matchup : elementMatchups) {
+        table.multipliers[size_t(matchup.attacker)][size_t(matchup.defender)] = matchup.multiplier;
+    }
+    return table;
+}
+
+constexpr bool elementMatchupsValid() {
+    size_t count = sizeof(elementMatchups) / sizeof(elementMatchups[0]);
+    for (size_t i = 0; i < count; i++) {
+        const auto& m = elementMatchups[i];
+        if (m.attacker >= MonsterType::COUNT || m.defender >= MonsterType::COUNT) return false;
+        if (m.multiplier <= 0.0f) return false;
+        for (size_t j = i + 1; j < count; j++) {
+            if (elementMatchups[j].attacker == m.attacker && elementMatchups[j].defender == m.defender) return false;
+        }
+    }
+    return true;
+}
+
+static_assert(elementMatchupsValid(), "element matchups must be unique, in range and positive");
+
+constexpr EffectivenessTable effectiveness = buildEffectivenessTable();
+
+static_assert(effectiveness(MonsterType::FIRE, MonsterType::ICE) == 1.5f, "Fire beats Ice");
+static_assert(effectiveness(MonsterType::NORMAL, MonsterType::NORMAL) == 1.0f, "unlisted pairs are neutral");
+
+// Status effect a monster's special move inflicts, by its element; id COUNT for none
+StatusEffect elementEffect(MonsterType type) {
+    switch (type) {
+        case MonsterType::FIRE: return {EffectId::BURN, 3, 0.9f, 1.0f};
+        case MonsterType::ICE: return {EffectId::FROZEN, 2, 1.0f, 0.8f};
+        case MonsterType::POISON: return {EffectId::POISONED, 4, 0.8f, 0.9f};
+        case MonsterType::UNDEAD: return {EffectId::CURSED, 3, 0.7f, 0.7f};
+        default: return {EffectId::COUNT, 0, 1.0f, 1.0f};
+    }
+}
+
+struct MoveDef {
+    NameId name;
+    float multiplier;  // damage multiplier
 };
 
-vector<Item> itemTemplates = {
-    {"Health Potion", "Instantly restores 15 HP", 0, 15.0f, 0.0f, 0.0f, 1},
-    {"Healing Salve", "Heals 5 HP per turn for 3 turns", 3, 5.0f, 0.0f, 0.0f, 1},
-    {"Warrior's Elixir", "Increases attack by 50% for 3 turns", 3, 0.0f, 1.5f, 1.0f, 1},
-    {"Stone Skin Potion", "Increases defense by 50% for 3 turns", 3, 0.0f, 1.0f, 1.5f, 1},
-    {"Battle Flask", "Increases both attack and defense by 25% for 2 turns", 2, 0.0f, 1.25f, 1.25f, 1}
+struct MonsterTemplate {
+    NameId name;
+    MonsterType type;
+    float baseHP;
+    float baseAttack;
+    vector<MoveId> specialMoves;
+    float speed = 100.0f;  // initiative in --waves encounters; duels alternate turns
 };
 
-// Math challenge functions
-pair<string, int> generateMathProblem() {
-    int num1 = rand() % 10 + 1;
-    int num2 = rand() % 10 + 1;
-    int operation = rand() % 3;
-    string problem;
-    int answer;
+// Monsters, items, moves and element names, loaded from a content pack
+struct ContentPack {
+    NameTable names;
+    NameId elements[ELEMENT_COUNT];
+    vector<MoveDef> moves;
+    vector<MonsterTemplate> monsters;
+    vector<Item> items;          // also the drop table
+    vector<MoveId> heroMoves;    // picked by combo points above 3
+    vector<pair<ItemId, int>> startingItems;
+    float hpPerLevel = 0.5f;     // monster stats grow by these fractions per level
+    float attackPerLevel = 0.3f;
     
-    switch(operation) {
-        case 0:
-            problem = to_string(num1) + " + " + to_string(num2);
-            answer = num1 + num2;
-            break;
-        case 1:
-            if (num1 < num2) swap(num1, num2);
-            problem = to_string(num1) + " - " + to_string(num2);
-            answer = num1 - num2;
-            break;
-        case 2:
-            problem = to_string(num1) + " × " + to_string(num2);
-            answer = num1 * num2;
-            break;
+    // Entry of each kind by name id, -1 if none
+    vector<int32_t> moveByName;
+    vector<int32_t> monsterByName;
+    vector<int32_t> itemByName;
+    
+    const string& elementName(MonsterType type) const { return names[elements[size_t(type)]]; }
+    const string& moveName(MoveId id) const { return names[moves[id].name]; }
+    
+    static int32_t lookup(const vector<int32_t>& byName, NameId id) {
+        return id < byName.size() ? byName[id] : -1;
     }
+    int32_t findMonster(const string& name) const { return lookup(monsterByName, names.find(name)); }
+    int32_t findItem(const string& name) const { return lookup(itemByName, names.find(name)); }
     
-    return {problem, answer};
+    float monsterHP(const MonsterTemplate& templ, int level) const { return templ.baseHP * (1 + (level * hpPerLevel)); }
+    float monsterAttack(const MonsterTemplate& templ, int level) const {
+        return templ.baseAttack * (1 + (level * attackPerLevel));
+    }
+};
+
+// The built-in content pack; --content replaces it with a file of the same format
+const char* const builtinContent = R"(# A-Battle content pack
+# One entry per line, fields separated by '|'. Names must be defined before use.
+#   element|name                              one per element, in MonsterType order
+#   move|name|damage multiplier
+#   monster|name|element|base HP|base attack|move,move...[|speed]   speed defaults to 100
+#   item|name|description|duration|heal|attack buff|defense buff
+#   hero|move,move...                         hero special moves, by combo points from 3
+#   start|item|quantity                       starting inventory
+#   scaling|HP per level|attack per level     monster growth, defaults 0.5|0.3
+element|Normal
+element|Fire
+element|Ice
+element|Poison
+element|Undead
+
+move|Sneaky Strike|1.2
+move|Rabid Attack|1.4
+move|Flame Breath|1.5
+move|Heat Wave|1.3
+move|Ice Shard|1.4
+move|Freeze|1.2
+move|Venom Strike|1.3
+move|Web Trap|1.1
+move|Bone Throw|1.2
+move|Death Touch|1.4
+move|Inferno|1.8
+move|Wing Slash|1.5
+move|Blizzard|1.6
+move|Frost Nova|1.4
+move|Acid Splash|1.3
+move|Dissolve|1.5
+move|Soul Drain|1.7
+move|Curse|1.4
+move|Doggono|3.0
+move|Mad gun|2.5
+move|Triple Strike|1.8
+move|Whirlwind Slash|2.0
+move|Power Attack|2.2
+move|Ultimate Combo|2.5
+
+monster|Goblin|Normal|20|4|Sneaky Strike,Rabid Attack|120
+monster|Fire Drake|Fire|25|5|Flame Breath,Heat Wave|100
+monster|Frost Giant|Ice|30|3|Ice Shard,Freeze|70
+monster|Poison Spider|Poison|15|6|Venom Strike,Web Trap|130
+monster|Skeleton|Undead|18|4|Bone Throw,Death Touch|90
+monster|Dragon|Fire|40|7|Inferno,Wing Slash|80
+monster|Ice Witch|Ice|22|5|Blizzard,Frost Nova|110
+monster|Toxic Slime|Poison|25|3|Acid Splash,Dissolve|60
+monster|Lich|Undead|35|6|Soul Drain,Curse|100
+monster|Babayaga|Normal|50|10|Doggono,Mad gun|100
+
+item|Health Potion|Instantly restores 15 HP|0|15|0|0
+item|Healing Salve|Heals 6 HP per turn for 4 turns|4|6|0|0
+item|Warrior's Elixir|Increases attack by 50% for 3 turns|3|0|1.5|1
+item|Stone Skin Potion|Increases defense by 50% for 3 turns|3|0|1|1.5
+item|Battle Flask|Increases both attack and defense by 25% for 2 turns|2|0|1.25|1.25
+
+hero|Triple Strike,Whirlwind Slash,Power Attack,Ultimate Combo
+start|Health Potion|8
+start|Healing Salve|8
+scaling|0.5|0.3
+)";
+
+string_view trimField(string_view text) {
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) text.remove_prefix(1);
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r')) text.remove_suffix(1);
+    return text;
 }
 
-bool getAnswerWithTimeout(int& answer, int timeoutSeconds) {
-    auto start = chrono::steady_clock::now();
-    string input;
+template <typename T>
+bool parseField(string_view text, T& value) {
+    auto [end, ec] = from_chars(text.data(), text.data() + text.size(), value);
+    return ec == errc() && end == text.data() + text.size();
+}
+
+// Parses a content pack (format in builtinContent); on failure error names the line
+bool loadContent(string_view text, ContentPack& pack, string& error) {
+    pack = ContentPack();
+    pack.names.reserve(text.size() / 32);
+    size_t elementCount = 0;
+    int lineNumber = 0;
     
-    cout << "Time remaining: " << timeoutSeconds << "s\n";
+    auto registerName = [&](vector<int32_t>& byName, string_view name, size_t index) {
+        NameId id = pack.names.intern(name);
+        if (id >= byName.size()) byName.resize(max<size_t>(id + 1, byName.size() * 2), -1);
+        if (byName[id] >= 0) return false;
+        byName[id] = index;
+        return true;
+    };
+    auto parseMoves = [&](string_view list, vector<MoveId>& moves) {
+        while (!list.empty()) {
+            size_t comma = list.find(',');
+            int32_t id = ContentPack::lookup(pack.moveByName, pack.names.find(trimField(list.substr(0, comma))));
+            if (id < 0) return false;
+            moves.push_back(id);
+            list = comma == string_view::npos ? string_view() : list.substr(comma + 1);
+        }
+        return true;
+    };
     
-    while (true) {
-        if (cin.rdbuf()->in_avail()) {
-            cin >> input;
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            try {
-                answer = stoi(input);
-                return true;
-            } catch (...) {
-                return false;
-            }
+    while (!text.empty()) {
+        size_t newline = text.find('\n');
+        string_view line = trimField(text.substr(0, newline));
+        text = newline == string_view::npos ? string_view() : text.substr(newline + 1);
+        lineNumber++;
+        if (line.empty() || line[0] == '#') continue;
+        
+        string_view fields[8];
+        size_t count = 0;
+        while (count < 8) {
+            size_t bar = line.find('|');
+            fields[count++] = trimField(line.substr(0, bar));
+            if (bar == string_view::npos) break;
+            line.remove_prefix(bar + 1);
         }
+        string_view kind = fields[0];
+        bool ok = false;
         
-        auto now = chrono::steady_clock::now();
-        auto elapsed = chrono::duration_cast<chrono::seconds>(now - start).count();
-        if (elapsed >= timeoutSeconds) {
-            return false;
+        if (kind == "element" && count == 2 && elementCount < ELEMENT_COUNT) {
+            pack.elements[elementCount++] = pack.names.intern(fields[1]);
+            ok = true;
+        } else if (kind == "move" && count == 3) {
+            MoveDef def = {0, 0.0f};
+            ok = parseField(fields[2], def.multiplier) && registerName(pack.moveByName, fields[1], pack.moves.size());
+            def.name = pack.names.find(fields[1]);
+            if (ok) pack.moves.push_back(def);
+        } else if (kind == "monster" && (count == 6 || count == 7)) {
+            MonsterTemplate monster = {0, MonsterType::NORMAL, 0.0f, 0.0f, {}};
+            NameId element = pack.names.find(fields[2]);
+            size_t type = 0;
+            while (type < elementCount && pack.elements[type] != element) type++;
+            monster.type = MonsterType(type);
+            ok = type < elementCount && parseField(fields[3], monster.baseHP) &&
+                 parseField(fields[4], monster.baseAttack) && parseMoves(fields[5], monster.specialMoves) &&
+                 (count == 6 || (parseField(fields[6], monster.speed) && monster.speed > 0)) &&
+                 registerName(pack.monsterByName, fields[1], pack.monsters.size());
+            monster.name = pack.names.find(fields[1]);
+            if (ok) pack.monsters.push_back(move(monster));
+        } else if (kind == "item" && count == 7) {
+            Item item = {ItemId(pack.items.size()), 0, pack.names.intern(fields[2]), 0, 0.0f, 0.0f, 0.0f};
+            ok = parseField(fields[3], item.duration) && parseField(fields[4], item.healAmount) &&
+                 parseField(fields[5], item.attackBuff) && parseField(fields[6], item.defenseBuff) &&
+                 registerName(pack.itemByName, fields[1], pack.items.size());
+            item.name = pack.names.find(fields[1]);
+            if (ok) pack.items.push_back(item);
+        } else if (kind == "hero" && count == 2) {
+            pack.heroMoves.clear();
+            ok = parseMoves(fields[1], pack.heroMoves);
+        } else if (kind == "start" && count == 3) {
+            int32_t item = ContentPack::lookup(pack.itemByName, pack.names.find(fields[1]));
+            int quantity = 0;
+            ok = item >= 0 && parseField(fields[2], quantity) && quantity > 0;
+            if (ok) pack.startingItems.push_back({ItemId(item), quantity});
+        } else if (kind == "scaling" && count == 3) {
+            ok = parseField(fields[1], pack.hpPerLevel) && parseField(fields[2], pack.attackPerLevel) &&
+                 pack.hpPerLevel > -1.0f && pack.attackPerLevel > -1.0f;
         }
         
-        this_thread::sleep_for(chrono::milliseconds(100));
+        if (!ok) {
+            error = "line " + to_string(lineNumber) + ": bad or duplicate " + string(kind) + " entry";
+            return false;
+        }
     }
+    
+    if (elementCount != ELEMENT_COUNT) error = "expected " + to_string(ELEMENT_COUNT) + " elements";
+    else if (pack.monsters.empty() || pack.items.empty() || pack.heroMoves.empty()) error = "needs monsters, items and hero moves";
+    else return true;
+    return false;
 }
 
-class Creature {
-protected:
-    string name;
-    float pv;
-    float pa;
-    int niveau;
-    MonsterType type;
-    vector<pair<string, float>> specialMoves;
-    map<string, StatusEffect> activeEffects;
-    int comboPoints;
-    float pv_max;
+bool loadContentFile(const string& path, ContentPack& pack, string& error) {
+    ifstream file(path, ios::binary);
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+    string text((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    return loadContent(text, pack, error);
+}
+
+// Writes a pack back in the format loadContent() reads
+void writeContent(ostream& out, const ContentPack& pack) {
+    out << defaultfloat << setprecision(6) << "# A-Battle content pack\n";
+    for (NameId element : pack.elements) out << "element|" << pack.names[element] << "\n";
+    out << "\n";
+    for (const MoveDef& move : pack.moves) out << "move|" << pack.names[move.name] << "|" << move.multiplier << "\n";
+    out << "\n";
+    for (const MonsterTemplate& monster : pack.monsters) {
+        out << "monster|" << pack.names[monster.name] << "|" << pack.elementName(monster.type) << "|"
+            << monster.baseHP << "|" << monster.baseAttack << "|";
+        for (size_t i = 0; i < monster.specialMoves.size(); i++) out << (i ? "," : "") << pack.moveName(monster.specialMoves[i]);
+        out << "|" << monster.speed << "\n";
+    }
+    out << "\n";
+    for (const Item& item : pack.items) {
+        out << "item|" << pack.names[item.name] << "|" << pack.names[item.description] << "|" << item.duration << "|"
+            << item.healAmount << "|" << item.attackBuff << "|" << item.defenseBuff << "\n";
+    }
+    out << "\nhero|";
+    for (size_t i = 0; i < pack.heroMoves.size(); i++) out << (i ? "," : "") << pack.moveName(pack.heroMoves[i]);
+    out << "\n";
+    for (const auto& [item, quantity] : pack.startingItems) out << "start|" << pack.names[pack.items[item].name] << "|" << quantity << "\n";
+    out << "scaling|" << pack.hpPerLevel << "|" << pack.attackPerLevel << "\n";
+}
+
+ContentPack loadBuiltinContent() {
+    ContentPack pack;
+    string error;
+    if (!loadContent(builtinContent, pack, error)) {
+        cerr << "Built-in content: " << error << "\n";
+        abort();
+    }
+    return pack;
+}
+
+ContentPack content = loadBuiltinContent();
+
+const string& Item::getName() const { return content.names[name]; }
+
+string Item::getDescription(int quantity) const {
+    string desc = getName() + ": " + content.names[description];
+    if (quantity > 0) {
+        desc += " (x" + to_string(quantity) + ")";
+    }
+    return desc;
+}
+
+class Creature;
+
+// Battle events emitted by the combat logic
+enum class BattleEventType {
+    EFFECTIVENESS,     // value = damage multiplier
+    DAMAGE,            // value = damage taken
+    DODGE,
+    EFFECT_APPLIED,    // label = effect name
+    EFFECT_EXPIRED,    // label = effect name
+    ITEM_ADDED,        // label = item name
+    ITEM_EMPTY,        // label = item name
+    ITEM_USED,         // label = item name
+    ITEM_LASTS,        // value = duration in turns
+    HEAL,              // value = HP restored
+    ITEM_HEAL,         // label = item name, value = HP restored
+    ITEM_EXPIRED,      // label = item name
+    BLOCK_SUCCESS,     // value = reaction time in ms
+    BLOCKED_DAMAGE,    // value = damage taken
+    BLOCK_TIMEOUT,     // value = correct answer
+    BLOCK_WRONG,       // value = correct answer
+    ATTACK,
+    SPECIAL_MOVE,      // label = move name
+    SPECIAL_FAILED,    // value = combo points
+    BLOCK_STANCE,
+    ESCAPED,
+    ESCAPE_FAILED,
+    MONSTER_ATTACK,
+    MONSTER_SPECIAL,   // label = move name
+    BACKSTAB,
+    VICTORY,
+    XP_GAINED,         // value = XP gained
+    LEVEL_UP,          // value = new level
+    XP_PROGRESS,       // value = current XP
+    COUNT
+};
+
+struct BattleEvent {
+    BattleEventType type;
+    const Creature* source;
+    const char* label;
+    float value;
+};
 
+// Receives battle events; lets the same rules drive the terminal or a headless run
+class EventSink {
 public:
-    Creature(const MonsterTemplate& templ, int level = 1) {
-        name = templ.name;
-        type = templ.type;
-        specialMoves = templ.specialMoves;
-        niveau = level;
-        pv = templ.baseHP * (1 + (niveau * 0.5f));
-        pa = templ.baseAttack * (1 + (niveau * 0.3f));
-        pv_max = pv;
-        comboPoints = 0;
+    virtual ~EventSink() = default;
+    virtual void emit(const BattleEvent& event) = 0;
+};
+
+// Discards every event
+class NullSink : public EventSink {
+public:
+    void emit(const BattleEvent&) override {}
+};
+
+// Counts events per type
+class CountingSink : public EventSink {
+public:
+    uint64_t counts[size_t(BattleEventType::COUNT)] = {};
+
+    void emit(const BattleEvent& event) override {
+        counts[size_t(event.type)]++;
     }
 
-    string getName() const { return name; }
-    float getPV() const { return pv; }
-    float getPVMax() const { return pv_max; }
-    float getPA() const { return pa; }
-    int getNiveau() const { return niveau; }
-    MonsterType getType() const { return type; }
-    int getComboPoints() const { return comboPoints; }
-    
-    vector<string> getActiveEffects() const {
-        vector<string> effects;
-        for (const auto& [_, effect] : activeEffects) {
-            effects.push_back(effect.getDescription());
-        }
-        return effects;
+    uint64_t count(BattleEventType type) const { return counts[size_t(type)]; }
+};
+
+// Renders events as the original battle text
+class TextSink : public EventSink {
+private:
+    ostream& out;
+
+public:
+    TextSink(ostream& out) : out(out) {}
+
+    void emit(const BattleEvent& event) override;
+};
+
+// xoshiro256** generator; every battle/session owns its own stream so runs are reproducible
+class Rng {
+private:
+    uint64_t s[4];
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    static uint64_t splitmix64(uint64_t& x) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
     }
 
-    virtual float calculateDamage(float baseDamage, MonsterType targetType) {
-        float multiplier = 1.0f;
-        
-        // Type effectiveness
-        if (type == MonsterType::FIRE && targetType == MonsterType::ICE) multiplier = 1.5f;
-        if (type == MonsterType::ICE && targetType == MonsterType::FIRE) multiplier = 0.5f;
-        if (type == MonsterType::POISON && targetType == MonsterType::UNDEAD) multiplier = 0.5f;
-        if (type == MonsterType::FIRE && targetType == MonsterType::UNDEAD) multiplier = 1.25f;
-        if (type == MonsterType::ICE && targetType == MonsterType::POISON) multiplier = 1.25f;
-        
-        // Apply status effects
-        for (const auto& [_, effect] : activeEffects) {
-            multiplier *= effect.damageMultiplier;
-        }
-        
-        if (multiplier != 1.0f) {
-            if (multiplier > 1.0f) cout << "It's super effective! (x" << multiplier << ")\n";
-            else cout << "It's not very effective... (x" << multiplier << ")\n";
-        }
-        
-        return baseDamage * multiplier;
+public:
+    // The same (seed, stream) pair always yields the same sequence
+    explicit Rng(uint64_t seed = 0, uint64_t stream = 0) { reseed(seed, stream); }
+
+    void reseed(uint64_t seed, uint64_t stream = 0) {
+        uint64_t x = stream;
+        x = seed ^ splitmix64(x);
+        for (auto& word : s) word = splitmix64(x);
     }
 
-    float attaque(Creature& target) {
-        float baseDamage = pa * (1.0f + float(rand() % 10)/10.0f);
-        float finalDamage = calculateDamage(baseDamage, target.getType());
-        comboPoints++;
-        return finalDamage;
+    uint64_t next() {
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
     }
 
-    string performSpecialMove(Creature& target) {
-        if (specialMoves.empty()) return "No special moves available!";
-        
-        int moveIndex = rand() % specialMoves.size();
-        auto [moveName, multiplier] = specialMoves[moveIndex];
-        float damage = pa * multiplier;
-        
-        // Add status effects based on type
-        switch(type) {
-            case MonsterType::FIRE:
-                target.addStatusEffect("Burn", 3, 0.9f, 1.0f);
-                break;
-            case MonsterType::ICE:
-                target.addStatusEffect("Frozen", 2, 1.0f, 0.8f);
-                break;
-            case MonsterType::POISON:
-                target.addStatusEffect("Poisoned", 4, 0.8f, 0.9f);
-                break;
-            case MonsterType::UNDEAD:
-                target.addStatusEffect("Cursed", 3, 0.7f, 0.7f);
-                break;
-            default:
-                break;
-        }
-        
-        target.subitDegat(calculateDamage(damage, target.getType()));
-        return moveName;
+    // Uniform integer in [0, n)
+    uint32_t below(uint32_t n) {
+        return uint32_t((uint64_t(uint32_t(next() >> 32)) * n) >> 32);
     }
 
-    void addStatusEffect(string name, int duration, float dmgMult, float defMult) {
-        activeEffects[name] = {name, duration, dmgMult, defMult};
-        cout << name << " status effect applied!\n";
+    // below(n) < k: one draw, for the rules' "k in n" rolls
+    bool chance(uint32_t k, uint32_t n) {
+        return below(n) < k;
     }
 
-    void updateStatusEffects() {
-        vector<string> expiredEffects;
-        for (auto& [name, effect] : activeEffects) {
-            effect.duration--;
-            if (effect.duration <= 0) {
-                expiredEffects.push_back(name);
-            }
-        }
-        for (const auto& name : expiredEffects) {
-            activeEffects.erase(name);
-            cout << name << " effect has worn off!\n";
-        }
+    // Uniform float in [0, 1)
+    float unit() {
+        return float(next() >> 40) * 0x1.0p-24f;
     }
 
-    virtual void subitDegat(float degat) {
-        float finalDamage = degat;
-        for (const auto& [_, effect] : activeEffects) {
-            finalDamage *= effect.defenseMultiplier;
-        }
-        
-        int esquive = rand() % 4;
-        if (esquive > 1) {
-            pv = pv - finalDamage;
-            cout << name << " took " << finalDamage << " damage!\n";
-        } else {
-            cout << name << " dodged the attack!\n";
-        }
+    void saveState(uint64_t out[4]) const {
+        for (int i = 0; i < 4; i++) out[i] = s[i];
     }
 
-    bool estVivant() const {
-        return pv > 0;
+    void loadState(const uint64_t in[4]) {
+        for (int i = 0; i < 4; i++) s[i] = in[i];
     }
 
-    virtual void resetCombo() {
-        comboPoints = 0;
+    // Independent child stream, e.g. one per battle handed to a worker thread
+    Rng split() {
+        Rng child;
+        child.reseed(next(), next());
+        return child;
     }
 };
 
-class Hero : public Creature {
-private:
-    bool isBlocking;
-    float xp;
-    int successful_blocks;
-    vector<pair<string, float>> heroSpecialMoves;
-    vector<Item> inventory;
-    vector<Item> activeItems;
+// Instrumentation, on with --stats: monotonic counters and per-phase latency
+// histograms, one block per thread. Only the owning thread writes its block (relaxed
+// load + store, no locked instructions); the report sums every block.
+enum class Phase {
+    INPUT_WAIT,     // menu choices and "Press Enter"
+    BLOCK_WAIT,     // answering a block challenge
+    HERO_TURN,      // resolving the hero's action
+    MONSTER_TURN,   // the monster's turn, including its block wait and updates
+    EFFECT_UPDATE,  // end-of-round status effect and item updates
+    RENDER,
+    PAUSE,
+    COUNT
+};
+
+const char* const phaseNames[] = {"input wait", "block wait", "hero turn", "monster turn",
+                                  "effect update", "render", "pause"};
+
+// Hero and monster turns are short and hot in headless runs; time 1 in statsSampleEvery
+const bool phaseSampled[] = {false, false, true, true, true, false, false};
+
+enum class Counter {
+    BATTLES,
+    TURNS,
+    DODGES,
+    BLOCKS_ATTEMPTED,
+    BLOCKS_SUCCEEDED,
+    ITEMS_USED,
+    LEVEL_UPS,
+    COUNT
+};
+
+const char* const counterNames[] = {"battles", "turns", "dodges", "blocks attempted",
+                                    "blocks succeeded", "items used", "level ups"};
+
+inline void bump(atomic<uint64_t>& value, uint64_t n = 1) {
+    value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
 
+// Log-linear buckets in the HDR histogram style: exact below 16 ns, then 16
+// sub-buckets per power of two, so a bucket is within ~6% of its values
+class LatencyHistogram {
 public:
-    Hero(string name) 
-        : Creature({"Hero", MonsterType::NORMAL, 30, 5, {}}, 1) {
-        this->name = name;
-        isBlocking = false;
-        xp = 0;
-        successful_blocks = 0;
-        
-        heroSpecialMoves = {
-            {"Triple Strike", 1.8f},
-            {"Whirlwind Slash", 2.0f},
-            {"Power Attack", 2.2f},
-            {"Ultimate Combo", 2.5f}
-        };
+    static const int SUB_BITS = 4;
+    static const int BUCKETS = (64 - SUB_BITS + 1) << SUB_BITS;
+
+    atomic<uint64_t> counts[BUCKETS] = {};
+    atomic<uint64_t> total{0};
+    atomic<uint64_t> sumNs{0};
+    atomic<uint64_t> maxNs{0};
+
+    static int bucketOf(uint64_t ns) {
+        if (ns < (1u << SUB_BITS)) return int(ns);
+        int msb = 63 - __builtin_clzll(ns);
+        return ((msb - SUB_BITS + 1) << SUB_BITS) + int((ns >> (msb - SUB_BITS)) & ((1u << SUB_BITS) - 1));
     }
 
-    void setBlocking(bool blocking) { isBlocking = blocking; }
-    bool getIsBlocking() const { return isBlocking; }
-    int getSuccessfulBlocks() const { return successful_blocks; }
+    // Smallest value that lands in the bucket
+    static uint64_t bucketLow(int bucket) {
+        if (bucket < (1 << SUB_BITS)) return bucket;
+        int msb = (bucket >> SUB_BITS) + SUB_BITS - 1;
+        return (uint64_t((1 << SUB_BITS) + (bucket & ((1 << SUB_BITS) - 1)))) << (msb - SUB_BITS);
+    }
 
-    void addItem(const Item& item) {
-        for (auto& invItem : inventory) {
-            if (invItem.name == item.name) {
-                invItem.quantity += item.quantity;
-                cout << "Added " << item.name << " to inventory.\n";
-                return;
-            }
+    void record(uint64_t ns) {
+        bump(counts[bucketOf(ns)]);
+        bump(total);
+        bump(sumNs, ns);
+        if (ns > maxNs.load(memory_order_relaxed)) maxNs.store(ns, memory_order_relaxed);
+    }
+};
+
+struct ThreadStats {
+    atomic<uint64_t> counters[size_t(Counter::COUNT)] = {};
+    LatencyHistogram phases[size_t(Phase::COUNT)];
+};
+
+bool statsEnabled = false;
+uint64_t statsSampleEvery = 1;
+
+// Blocks outlive their threads so the balance workers' numbers stay in the report
+mutex statsMutex;
+deque<ThreadStats> statsBlocks;
+
+thread_local ThreadStats* threadStatsBlock = nullptr;
+
+__attribute__((noinline)) ThreadStats& registerThreadStats() {
+    lock_guard<mutex> lock(statsMutex);
+    statsBlocks.emplace_back();
+    threadStatsBlock = &statsBlocks.back();
+    return *threadStatsBlock;
+}
+
+inline ThreadStats& threadStats() {
+    return threadStatsBlock ? *threadStatsBlock : registerThreadStats();
+}
+
+inline void countStat(Counter counter, uint64_t n = 1) {
+    if (statsEnabled) bump(threadStats().counters[size_t(counter)], n);
+}
+
+void recordPhase(Phase phase, chrono::steady_clock::duration elapsed) {
+    if (!statsEnabled) return;
+    threadStats().phases[size_t(phase)].record(chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+}
+
+// Counts down to the next sampled turn phase on this thread
+thread_local uint64_t phaseSampleCountdown = 1;
+
+// Times the enclosing scope; costs one branch while stats are off
+class PhaseTimer {
+private:
+    Phase phase;
+    bool active;
+    chrono::steady_clock::time_point start;
+
+public:
+    explicit PhaseTimer(Phase phase) : phase(phase), active(statsEnabled) {
+        if (active && phaseSampled[size_t(phase)]) {
+            active = --phaseSampleCountdown == 0;
+            if (active) phaseSampleCountdown = statsSampleEvery;
         }
-        inventory.push_back(item);
-        cout << "Added " << item.name << " to inventory.\n";
+        if (active) start = chrono::steady_clock::now();
     }
-    
-    void useItem(int index) {
-        if (index >= 0 && index < inventory.size()) {
-            Item& item = inventory[index];
-            
-            if (item.quantity <= 0) {
-                cout << "No more " << item.name << " remaining!\n";
-                return;
-            }
+
+    ~PhaseTimer() {
+        if (active) recordPhase(phase, chrono::steady_clock::now() - start);
+    }
+};
+
+// Sums every thread's block. Percentiles are bucket midpoints, capped at the maximum.
+void writeStats(ostream& out) {
+    uint64_t counters[size_t(Counter::COUNT)] = {};
+    static uint64_t counts[size_t(Phase::COUNT)][LatencyHistogram::BUCKETS];
+    uint64_t totals[size_t(Phase::COUNT)] = {}, sums[size_t(Phase::COUNT)] = {}, maxima[size_t(Phase::COUNT)] = {};
+    {
+        lock_guard<mutex> lock(statsMutex);
+        memset(counts, 0, sizeof(counts));
+        for (const ThreadStats& block : statsBlocks) {
+            for (size_t c = 0; c < size_t(Counter::COUNT); c++) {
+                counters[c] += block.counters[c].load(memory_order_relaxed);
+            }
+            for (size_t p = 0; p < size_t(Phase::COUNT); p++) {
+                const LatencyHistogram& histogram = block.phases[p];
+                for (int b = 0; b < LatencyHistogram::BUCKETS; b++) {
+                    counts[p][b] += histogram.counts[b].load(memory_order_relaxed);
+                }
+                totals[p] += histogram.total.load(memory_order_relaxed);
+                sums[p] += histogram.sumNs.load(memory_order_relaxed);
+                maxima[p] = max(maxima[p], histogram.maxNs.load(memory_order_relaxed));
+            }
+        }
+    }
+    
+    auto percentile = [](const uint64_t* buckets, uint64_t total, uint64_t maxNs, double q) {
+        uint64_t rank = uint64_t(q * total), seen = 0;
+        for (int b = 0; b < LatencyHistogram::BUCKETS; b++) {
+            seen += buckets[b];
+            if (seen > rank) {
+                uint64_t low = LatencyHistogram::bucketLow(b);
+                uint64_t high = b + 1 < LatencyHistogram::BUCKETS ? LatencyHistogram::bucketLow(b + 1) : low;
+                return min((low + high) / 2.0, double(maxNs)) / 1000.0;
+            }
+        }
+        return 0.0;
+    };
+    
+    out << "Counters\n";
+    for (size_t c = 0; c < size_t(Counter::COUNT); c++) {
+        out << "  " << left << setw(18) << counterNames[c] << right << counters[c] << "\n";
+    }
+    out << "Phase latency (us)" << setw(12) << "count" << setw(12) << "mean" << setw(12) << "p50"
+        << setw(12) << "p90" << setw(12) << "p99" << setw(12) << "max" << "\n" << fixed << setprecision(3);
+    for (size_t p = 0; p < size_t(Phase::COUNT); p++) {
+        if (totals[p] == 0) continue;
+        out << "  " << left << setw(16) << phaseNames[p] << right << setw(12) << totals[p]
+            << setw(12) << sums[p] / 1000.0 / totals[p]
+            << setw(12) << percentile(counts[p], totals[p], maxima[p], 0.50)
+            << setw(12) << percentile(counts[p], totals[p], maxima[p], 0.90)
+            << setw(12) << percentile(counts[p], totals[p], maxima[p], 0.99)
+            << setw(12) << maxima[p] / 1000.0 << "\n";
+    }
+    if (statsSampleEvery > 1) out << "  (turn phases sampled 1 in " << statsSampleEvery << ")\n";
+    out << defaultfloat;
+}
+
+// SIGUSR1 dumps the report to stderr. Call before any other thread starts: they
+// inherit the blocked mask, leaving sigwait() here as the only receiver.
+void startStatsReporter() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    thread([signals] {
+        int signal;
+        while (sigwait(&signals, &signal) == 0) {
+            ostringstream report;
+            writeStats(report);
+            cerr << report.str() << flush;
+        }
+    }).detach();
+}
+
+const int BLOCK_TIMEOUT_MS = 5000;
+
+// Outcome of a block challenge
+struct BlockAttempt {
+    bool answered;
+    bool correct;
+    int correctAnswer;
+    float reactionMs;  // time taken to answer
+};
+
+// Share of the damage still taken after a correct block: 10% for an instant
+// answer, rising linearly to 50% at the deadline
+float blockDamageFactor(float reactionMs) {
+    float t = min(max(reactionMs / BLOCK_TIMEOUT_MS, 0.0f), 1.0f);
+    return 0.1f + 0.4f * t;
+}
+
+// Per battle/session state shared by the combatants
+struct BattleContext {
+    EventSink* sink;
+    BlockAttempt (*attemptBlock)(BattleContext& ctx);
+    float blockSuccessRate;  // used by scripted block attempts
+    Rng rng;
+    void* owner = nullptr;   // the driver's own state, for attemptBlock
+};
+
+BlockAttempt interactiveBlock(BattleContext& ctx);
+
+TextSink consoleSink(cout);
+BattleContext consoleContext = {&consoleSink, interactiveBlock, 0.0f, Rng()};
+
+// Math challenge functions
+pair<string, int> generateMathProblem(Rng& rng) {
+    int num1 = rng.below(10) + 1;
+    int num2 = rng.below(10) + 1;
+    int operation = rng.below(3);
+    string problem;
+    int answer;
+    
+    switch(operation) {
+        case 0:
+            problem = to_string(num1) + " + " + to_string(num2);
+            answer = num1 + num2;
+            break;
+        case 1:
+            if (num1 < num2) swap(num1, num2);
+            problem = to_string(num1) + " - " + to_string(num2);
+            answer = num1 - num2;
+            break;
+        case 2:
+            problem = to_string(num1) + " × " + to_string(num2);
+            answer = num1 * num2;
+            break;
+    }
+    
+    return {problem, answer};
+}
+
+// Line-oriented input on a file descriptor (stdin or a scripted client's pipe/socket).
+// Waits with ppoll() against a steady_clock deadline, so an answer is picked up as soon
+// as its newline arrives instead of on the next polling tick.
+class LineReader {
+public:
+    enum class Status { LINE, TIMEOUT, CLOSED };
+
+private:
+    int fd;
+    string pending;  // bytes read past the last returned line
+    bool eof = false;
+
+public:
+    explicit LineReader(int fd) : fd(fd) {}
+
+    int getFd() const { return fd; }
+
+    Status readLine(string& line, chrono::steady_clock::time_point deadline) {
+        while (true) {
+            size_t newline = pending.find('\n');
+            if (newline != string::npos) {
+                line.assign(pending, 0, newline);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                pending.erase(0, newline + 1);
+                return Status::LINE;
+            }
+            if (eof) {
+                if (pending.empty()) return Status::CLOSED;
+                line.swap(pending);
+                pending.clear();
+                return Status::LINE;
+            }
+            
+            auto remaining = deadline - chrono::steady_clock::now();
+            if (remaining <= chrono::nanoseconds::zero()) return Status::TIMEOUT;
+            auto ns = chrono::duration_cast<chrono::nanoseconds>(remaining).count();
+            timespec timeout = {time_t(ns / 1000000000), long(ns % 1000000000)};
+            pollfd pfd = {fd, POLLIN, 0};
+            int ready = ppoll(&pfd, 1, &timeout, nullptr);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) continue;  // timed out: the deadline check above returns
+            
+            char chunk[512];
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+            if (n <= 0) eof = true;
+            else pending.append(chunk, n);
+        }
+    }
+
+    Status readLine(string& line) {
+        return readLine(line, chrono::steady_clock::time_point::max());
+    }
+};
+
+LineReader consoleInput(STDIN_FILENO);
+
+// Reads a number from the console; 0 for anything that is not one, -1 once input is closed
+int readChoice() {
+    PhaseTimer timer(Phase::INPUT_WAIT);
+    cout.flush();
+    string line;
+    if (consoleInput.readLine(line) == LineReader::Status::CLOSED) return -1;
+    try {
+        return stoi(line);
+    } catch (...) {
+        return 0;
+    }
+}
+
+void waitForEnter() {
+    PhaseTimer timer(Phase::INPUT_WAIT);
+    cout.flush();
+    string line;
+    consoleInput.readLine(line);
+}
+
+// Save records: fixed layout and trivially copyable, so a snapshot file is read
+// in place through mmap. Bump SNAPSHOT_VERSION whenever one of them changes.
+const char SNAPSHOT_MAGIC[8] = {'A', 'B', 'S', 'N', 'A', 'P', '\0', '\0'};
+const uint32_t SNAPSHOT_VERSION = 2;
+const size_t SNAPSHOT_MAX_ITEMS = 64;  // item types held; extra ones are not saved
+const size_t SNAPSHOT_MAX_BUFFS = 8;
+
+struct EffectRecord {
+    int32_t duration;
+    float damageMultiplier;
+    float defenseMultiplier;
+};
+
+// Items are saved by name, so profiles survive a reordered content pack;
+// their stats come from the pack
+struct ItemRecord {
+    char name[32];
+    int32_t count;  // quantity held, or turns left for a buff
+};
+
+struct CreatureRecord {
+    char name[32];
+    int32_t niveau;
+    float pv;
+    float pv_max;
+    float pa;
+    int32_t comboPoints;
+    uint32_t effectMask;
+    EffectRecord effects[size_t(EffectId::COUNT)];
+};
+
+struct HeroRecord {
+    CreatureRecord base;
+    float xp;
+    int32_t successfulBlocks;
+    uint32_t isBlocking;
+    uint32_t inventoryCount;
+    uint32_t buffCount;
+    ItemRecord inventory[SNAPSHOT_MAX_ITEMS];
+    ItemRecord buffs[SNAPSHOT_MAX_BUFFS];
+};
+
+// One player profile, with the battle in progress if there is one
+struct PlayerSnapshot {
+    HeroRecord hero;
+    int32_t monstersDefeated;
+    int32_t monsterTemplate;  // index into content.monsters when saved, -1 between battles
+    CreatureRecord monster;
+    uint64_t rngState[4];
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t count;
+};
+
+static_assert(is_trivially_copyable<PlayerSnapshot>::value, "snapshots are copied as raw bytes");
+static_assert(sizeof(SnapshotHeader) % alignof(PlayerSnapshot) == 0, "records follow the header aligned");
+
+template <size_t N>
+void copyName(char (&dst)[N], const string& src) {
+    size_t n = min(src.size(), N - 1);
+    memcpy(dst, src.data(), n);
+    memset(dst + n, 0, N - n);
+}
+
+template <size_t N>
+string readName(const char (&src)[N]) {
+    return string(src, strnlen(src, N));
+}
+
+// Multipliers a combatant's effects or buffs add up to, cached and rebuilt only when
+// one is added or expires
+struct EffectiveStats {
+    float attack = 1.0f;       // damage dealt
+    float defense = 1.0f;      // share of the damage taken
+    float healPerTurn = 0.0f;
+
+    bool operator==(const EffectiveStats& other) const {
+        return attack == other.attack && defense == other.defense && healPerTurn == other.healPerTurn;
+    }
+};
+
+// --check-cache: every read of the cached stats first compares them with a fresh
+// computation and aborts on a difference
+bool cacheChecks = false;
+
+void reportStaleCache(const string& who, const char* record, const EffectiveStats& cached, const EffectiveStats& fresh) {
+    cerr << "Stale " << record << " stats on " << who << ": cached attack " << cached.attack << ", defense "
+         << cached.defense << ", heal " << cached.healPerTurn << "; recomputed " << fresh.attack << ", "
+         << fresh.defense << ", " << fresh.healPerTurn << "\n";
+    abort();
+}
+
+// When each of N slots (a creature's effects, a hero's buffs) runs out, as a round
+// number on an indexed binary min-heap: the end of a round pops what is due instead of
+// ticking every slot. Plain arrays, so the search states can hold one.
+template <size_t N>
+class ExpiryTimers {
+    uint32_t expiry[N];   // round each scheduled slot runs out at
+    uint8_t heap[N];      // scheduled slots, soonest first
+    uint8_t position[N];  // index of each slot in heap, N when not scheduled
+    uint8_t count;
+
+    bool sooner(size_t a, size_t b) const { return expiry[heap[a]] < expiry[heap[b]]; }
+
+    void place(size_t at, size_t slot) {
+        heap[at] = uint8_t(slot);
+        position[slot] = uint8_t(at);
+    }
+
+    void swapAt(size_t a, size_t b) {
+        size_t slot = heap[a];
+        place(a, heap[b]);
+        place(b, slot);
+    }
+
+    void siftUp(size_t at) {
+        for (; at > 0 && sooner(at, (at - 1) / 2); at = (at - 1) / 2) swapAt(at, (at - 1) / 2);
+    }
+
+    void siftDown(size_t at) {
+        for (;;) {
+            size_t least = at;
+            for (size_t child = 2 * at + 1; child <= 2 * at + 2 && child < count; child++) {
+                if (sooner(child, least)) least = child;
+            }
+            if (least == at) return;
+            swapAt(at, least);
+            at = least;
+        }
+    }
+
+public:
+    ExpiryTimers() : count(0) { fill(begin(position), end(position), uint8_t(N)); }
+
+    bool scheduled(size_t slot) const { return position[slot] < N; }
+    uint32_t expiryOf(size_t slot) const { return expiry[slot]; }
+
+    // Sets the slot's expiry, moving it if already scheduled
+    void schedule(size_t slot, uint32_t round) {
+        expiry[slot] = round;
+        if (!scheduled(slot)) {
+            place(count++, slot);
+            siftUp(count - 1);
+        } else {
+            siftUp(position[slot]);
+            siftDown(position[slot]);
+        }
+    }
+
+    void cancel(size_t slot) {
+        size_t at = position[slot];
+        position[slot] = uint8_t(N);
+        if (at == --count) return;
+        size_t moved = heap[count];
+        place(at, moved);
+        siftUp(at);
+        siftDown(position[moved]);
+    }
+
+    // The slot to expire by the given round, unscheduled; N when none is due
+    size_t popDue(uint32_t round) {
+        if (count == 0 || expiry[heap[0]] > round) return N;
+        size_t slot = heap[0];
+        cancel(slot);
+        return slot;
+    }
+};
+
+// A duration counted from now as the round it runs out at; one that is already over
+// still lasts until the end of this round, as a countdown would
+inline uint32_t expiryAfter(uint32_t round, int turns) { return round + uint32_t(max(turns, 1)); }
+
+// Search copies of the combatants (see BattleState): plain fields only, so a battle
+// is copied with memcpy. Move lists are borrowed from the live Creature/Hero.
+struct CreatureState {
+    float pv, pv_max, pa;
+    int niveau;
+    MonsterType type;
+    int comboPoints;
+    unsigned effectMask;
+    float effectDamageMultiplier, effectDefenseMultiplier;
+    StatusEffect activeEffects[size_t(EffectId::COUNT)];
+    ExpiryTimers<size_t(EffectId::COUNT)> effectTimers;
+    uint32_t effectRound;                                 // rounds ended so far
+
+    int effectTurnsLeft(size_t i) const { return int(effectTimers.expiryOf(i) - effectRound); }
+    const MoveId* specialMoves;
+    uint32_t specialMoveCount;
+};
+
+class Creature {
+protected:
+    const MonsterTemplate* templ;  // shared, never copied: name and special moves
+    float pv;
+    float pa;
+    int niveau;
+    MonsterType type;
+    StatusEffect activeEffects[size_t(EffectId::COUNT)];  // as applied; see effectTurnsLeft()
+    unsigned effectMask;           // bit i set while activeEffects[i] is active
+    ExpiryTimers<size_t(EffectId::COUNT)> effectTimers;   // by EffectId, for the active ones
+    uint32_t effectRound;          // updateStatusEffects() calls so far
+    EffectiveStats effectStats;    // products over the active effects
+    int comboPoints;
+    float pv_max;
+    BattleContext* ctx;
+
+    EffectiveStats computeEffectStats() const {
+        EffectiveStats stats;
+        for (unsigned mask = effectMask; mask; mask &= mask - 1) {
+            const StatusEffect& effect = activeEffects[__builtin_ctz(mask)];
+            stats.attack *= effect.damageMultiplier;
+            stats.defense *= effect.defenseMultiplier;
+        }
+        return stats;
+    }
+
+    void refreshEffectMultipliers() { effectStats = computeEffectStats(); }
+
+    virtual void verifyCachedStats() const {
+        EffectiveStats fresh = computeEffectStats();
+        if (!(effectStats == fresh)) reportStaleCache(getName(), "effect", effectStats, fresh);
+    }
+
+    void checkCachedStats() const {
+        if (cacheChecks) verifyCachedStats();
+    }
+
+public:
+    // Keeps a pointer to the template: it must outlive the creature
+    Creature(const MonsterTemplate& monsterTemplate, int level = 1) {
+        templ = &monsterTemplate;
+        type = templ->type;
+        niveau = level;
+        pv = content.monsterHP(*templ, niveau);
+        pa = content.monsterAttack(*templ, niveau);
+        pv_max = pv;
+        comboPoints = 0;
+        effectMask = 0;
+        effectRound = 0;
+        effectStats = EffectiveStats();
+        ctx = &consoleContext;
+    }
+
+    void setContext(BattleContext& context) { ctx = &context; }
+    BattleContext& getContext() const { return *ctx; }
+
+    void emit(BattleEventType type, const char* label = nullptr, float value = 0.0f) const {
+        ctx->sink->emit({type, this, label, value});
+    }
+
+    virtual const string& getName() const { return content.names[templ->name]; }
+    float getPV() const { return pv; }
+    void setPV(float value) { pv = min(value, pv_max); }
+    float getPVMax() const { return pv_max; }
+    float getPA() const { return pa; }
+    int getNiveau() const { return niveau; }
+    MonsterType getType() const { return type; }
+    int getComboPoints() const { return comboPoints; }
+    
+    unsigned getEffectMask() const { return effectMask; }
+    int effectTurnsLeft(EffectId id) const { return int(effectTimers.expiryOf(size_t(id)) - effectRound); }
+    
+    // An active effect, its duration being the turns left
+    StatusEffect getEffect(EffectId id) const {
+        StatusEffect effect = activeEffects[size_t(id)];
+        effect.duration = effectTurnsLeft(id);
+        return effect;
+    }
+    
+    vector<string> getActiveEffects() const {
+        vector<string> effects;
+        for (unsigned mask = effectMask; mask; mask &= mask - 1) {
+            effects.push_back(getEffect(EffectId(__builtin_ctz(mask))).getDescription());
+        }
+        return effects;
+    }
+
+    virtual float calculateDamage(float baseDamage, MonsterType targetType) {
+        // Type effectiveness
+        float multiplier = effectiveness(type, targetType);
+        
+        // Apply status effects
+        checkCachedStats();
+        multiplier *= effectStats.attack;
+        
+        if (multiplier != 1.0f) {
+            emit(BattleEventType::EFFECTIVENESS, nullptr, multiplier);
+        }
+        
+        return baseDamage * multiplier;
+    }
+
+    float attaque(Creature& target) {
+        float baseDamage = pa * (1.0f + float(ctx->rng.below(10))/10.0f);
+        float finalDamage = calculateDamage(baseDamage, target.getType());
+        comboPoints++;
+        return finalDamage;
+    }
+
+    const string& performSpecialMove(Creature& target) {
+        static const string noMoves = "No special moves available!";
+        const vector<MoveId>& specialMoves = templ->specialMoves;
+        if (specialMoves.empty()) return noMoves;
+        
+        int moveIndex = ctx->rng.below(specialMoves.size());
+        const MoveDef& move = content.moves[specialMoves[moveIndex]];
+        float damage = pa * move.multiplier;
+        
+        // Add status effects based on type
+        StatusEffect effect = elementEffect(type);
+        if (effect.id != EffectId::COUNT) {
+            target.addStatusEffect(effect.id, effect.duration, effect.damageMultiplier, effect.defenseMultiplier);
+        }
+        
+        target.subitDegat(calculateDamage(damage, target.getType()));
+        return content.names[move.name];
+    }
+
+    void addStatusEffect(EffectId id, int duration, float dmgMult, float defMult) {
+        activeEffects[size_t(id)] = {id, duration, dmgMult, defMult};
+        effectMask |= 1u << size_t(id);
+        effectTimers.schedule(size_t(id), expiryAfter(effectRound, duration));
+        refreshEffectMultipliers();
+        emit(BattleEventType::EFFECT_APPLIED, effectNames[size_t(id)]);
+    }
+
+    // Ends a round: only the effects due now are looked at
+    void updateStatusEffects() {
+        effectRound++;
+        unsigned expired = 0;
+        for (size_t i; (i = effectTimers.popDue(effectRound)) != size_t(EffectId::COUNT);) {
+            expired |= 1u << i;
+        }
+        if (!expired) return;
+        
+        effectMask &= ~expired;
+        refreshEffectMultipliers();
+        for (; expired; expired &= expired - 1) {
+            emit(BattleEventType::EFFECT_EXPIRED, effectNames[__builtin_ctz(expired)]);
+        }
+    }
+
+    virtual void subitDegat(float degat) {
+        checkCachedStats();
+        float finalDamage = degat * effectStats.defense;
+        
+        int esquive = ctx->rng.below(4);
+        if (esquive > 1) {
+            pv = pv - finalDamage;
+            emit(BattleEventType::DAMAGE, nullptr, finalDamage);
+        } else {
+            countStat(Counter::DODGES);
+            emit(BattleEventType::DODGE);
+        }
+    }
+
+    bool estVivant() const {
+        return pv > 0;
+    }
+
+    virtual void resetCombo() {
+        comboPoints = 0;
+    }
+
+    void saveTo(CreatureRecord& record) const {
+        copyName(record.name, getName());
+        record.niveau = niveau;
+        record.pv = pv;
+        record.pv_max = pv_max;
+        record.pa = pa;
+        record.comboPoints = comboPoints;
+        record.effectMask = effectMask;
+        for (size_t i = 0; i < size_t(EffectId::COUNT); i++) {
+            int turnsLeft = effectMask >> i & 1 ? effectTurnsLeft(EffectId(i)) : 0;
+            record.effects[i] = {turnsLeft, activeEffects[i].damageMultiplier, activeEffects[i].defenseMultiplier};
+        }
+    }
+
+    void saveTo(CreatureState& state) const {
+        state.pv = pv;
+        state.pv_max = pv_max;
+        state.pa = pa;
+        state.niveau = niveau;
+        state.type = type;
+        state.comboPoints = comboPoints;
+        state.effectMask = effectMask;
+        state.effectDamageMultiplier = effectStats.attack;
+        state.effectDefenseMultiplier = effectStats.defense;
+        copy(begin(activeEffects), end(activeEffects), state.activeEffects);
+        state.effectTimers = effectTimers;
+        state.effectRound = effectRound;
+        state.specialMoves = templ->specialMoves.data();
+        state.specialMoveCount = templ->specialMoves.size();
+    }
+
+    void restoreFrom(const CreatureRecord& record) {
+        niveau = record.niveau;
+        pv = record.pv;
+        pv_max = record.pv_max;
+        pa = record.pa;
+        comboPoints = record.comboPoints;
+        effectMask = record.effectMask & ((1u << size_t(EffectId::COUNT)) - 1);
+        for (size_t i = 0; i < size_t(EffectId::COUNT); i++) {
+            const EffectRecord& effect = record.effects[i];
+            activeEffects[i] = {EffectId(i), effect.duration, effect.damageMultiplier, effect.defenseMultiplier};
+            if (effectMask >> i & 1) effectTimers.schedule(i, expiryAfter(effectRound, effect.duration));
+            else if (effectTimers.scheduled(i)) effectTimers.cancel(i);
+        }
+        refreshEffectMultipliers();
+    }
+};
+
+struct HeroState;
+
+// An item's effect while it lasts
+struct ActiveBuff {
+    ItemId id;
+    int timer;  // its slot in the hero's buffTimers, kept while the buff lasts
+};
+
+class Hero : public Creature {
+public:
+    static const int MAX_BUFFS = 8;
+    // Level 1 stats of the original rules, whatever level scaling the pack sets for monsters
+    static constexpr float START_HP_FACTOR = 1 + 0.5f;
+    static constexpr float START_ATTACK_FACTOR = 1 + 0.3f;
+
+private:
+    string name;
+    bool isBlocking;
+    float xp;
+    int successful_blocks;
+    vector<int> itemCounts;         // by ItemId, grown to the highest id held
+    ActiveBuff buffs[MAX_BUFFS];    // in the order they were used
+    int buffCount;
+    ExpiryTimers<MAX_BUFFS> buffTimers;
+    uint32_t buffRound;             // updateActiveItems() calls so far
+    EffectiveStats buffStats;       // defense is the product of (2 - defense buff)
+    
+    EffectiveStats computeBuffStats() const {
+        EffectiveStats stats;
+        for (int i = 0; i < buffCount; i++) {
+            const Item& item = content.items[buffs[i].id];
+            stats.attack *= item.attackBuff;
+            stats.defense *= 2.0f - item.defenseBuff;
+            stats.healPerTurn += item.healAmount;
+        }
+        return stats;
+    }
+    
+    void refreshBuffTotals() { buffStats = computeBuffStats(); }
+    
+    void verifyCachedStats() const override {
+        Creature::verifyCachedStats();
+        EffectiveStats fresh = computeBuffStats();
+        if (!(buffStats == fresh)) reportStaleCache(getName(), "buff", buffStats, fresh);
+    }
+    
+    // A full pool drops the buff closest to expiring
+    void addBuff(ItemId id, int turns) {
+        if (buffCount == MAX_BUFFS) {
+            int soonest = 0;
+            for (int i = 1; i < buffCount; i++) {
+                if (buffTimers.expiryOf(buffs[i].timer) < buffTimers.expiryOf(buffs[soonest].timer)) soonest = i;
+            }
+            buffTimers.cancel(buffs[soonest].timer);
+            copy(buffs + soonest + 1, buffs + buffCount, buffs + soonest);
+            buffCount--;
+        }
+        int timer = 0;
+        while (buffTimers.scheduled(timer)) timer++;
+        buffTimers.schedule(timer, expiryAfter(buffRound, turns));
+        buffs[buffCount++] = {id, timer};
+        refreshBuffTotals();
+    }
+
+public:
+    Hero(string name) 
+        : Creature(heroTemplate(), 1) {
+        this->name = name;
+        pv = pv_max = heroTemplate().baseHP * START_HP_FACTOR;
+        pa = heroTemplate().baseAttack * START_ATTACK_FACTOR;
+        isBlocking = false;
+        xp = 0;
+        successful_blocks = 0;
+        buffCount = 0;
+        buffRound = 0;
+        refreshBuffTotals();
+    }
+
+    // Heroes have no template of their own; their special moves are the pack's hero moves
+    static const MonsterTemplate& heroTemplate() {
+        static const MonsterTemplate hero = {0, MonsterType::NORMAL, 30, 5, {}};
+        return hero;
+    }
+
+    const string& getName() const override { return name; }
+
+    void setBlocking(bool blocking) { isBlocking = blocking; }
+    bool getIsBlocking() const { return isBlocking; }
+    int getSuccessfulBlocks() const { return successful_blocks; }
+
+    void addItem(ItemId id, int quantity) {
+        if (id >= itemCounts.size()) itemCounts.resize(id + 1, 0);
+        itemCounts[id] += quantity;
+        emit(BattleEventType::ITEM_ADDED, content.items[id].getName().c_str());
+    }
+    
+    int getItemCount(ItemId id) const {
+        return id < itemCounts.size() ? itemCounts[id] : 0;
+    }
+    
+    void useItem(ItemId id) {
+        if (id >= itemCounts.size()) return;
+        const Item& item = content.items[id];
+        
+        if (itemCounts[id] <= 0) {
+            emit(BattleEventType::ITEM_EMPTY, item.getName().c_str());
+            return;
+        }
+        
+        countStat(Counter::ITEMS_USED);
+        emit(BattleEventType::ITEM_USED, item.getName().c_str());
+        
+        // Apply instant healing
+        if (item.healAmount > 0 && item.duration == 0) {
+            float oldHP = pv;
+            pv = min(pv + item.healAmount, pv_max);
+            emit(BattleEventType::HEAL, nullptr, pv - oldHP);
+        }
+        
+        // Add to active buffs if it has duration
+        if (item.duration > 0) {
+            addBuff(id, item.duration);
+            emit(BattleEventType::ITEM_LASTS, nullptr, item.duration);
+        }
+        
+        itemCounts[id]--;
+    }
+    
+    void updateActiveItems() {
+        // Apply over-time effects
+        checkCachedStats();
+        if (buffStats.healPerTurn > 0) {
+            for (int i = 0; i < buffCount; i++) {
+                const Item& item = content.items[buffs[i].id];
+                if (item.healAmount <= 0) continue;
+                float oldHP = pv;
+                pv = min(pv + item.healAmount, pv_max);
+                emit(BattleEventType::ITEM_HEAL, item.getName().c_str(), pv - oldHP);
+            }
+        }
+        
+        // End the round: only the buffs due now are looked at
+        buffRound++;
+        unsigned due = 0;
+        for (size_t timer; (timer = buffTimers.popDue(buffRound)) != MAX_BUFFS;) due |= 1u << timer;
+        if (!due) return;
+        
+        // Drop them, keeping the survivors in order
+        ItemId expired[MAX_BUFFS];
+        int expiredCount = 0;
+        int kept = 0;
+        for (int i = 0; i < buffCount; i++) {
+            if (due >> buffs[i].timer & 1) expired[expiredCount++] = buffs[i].id;
+            else buffs[kept++] = buffs[i];
+        }
+        
+        buffCount = kept;
+        refreshBuffTotals();
+        while (expiredCount > 0) {
+            emit(BattleEventType::ITEM_EXPIRED, content.items[expired[--expiredCount]].getName().c_str());
+        }
+    }
+    
+    float calculateDamage(float baseDamage, MonsterType targetType) override {
+        // Apply item buffs
+        return Creature::calculateDamage(baseDamage, targetType) * buffStats.attack;
+    }
+
+    void subitDegat(float degat) override {
+        checkCachedStats();
+        BlockAttempt attempt = {false, false, 0, 0.0f};
+        bool blocked = false;
+        if (isBlocking) {
+            attempt = ctx->attemptBlock(*ctx);
+            countStat(Counter::BLOCKS_ATTEMPTED);
+            blocked = attempt.answered && attempt.correct;
+            if (blocked) {
+                successful_blocks++;
+                countStat(Counter::BLOCKS_SUCCEEDED);
+                degat *= blockDamageFactor(attempt.reactionMs);
+            } else {
+                emit(attempt.answered ? BattleEventType::BLOCK_WRONG : BattleEventType::BLOCK_TIMEOUT,
+                     nullptr, attempt.correctAnswer);
+            }
+        }
+        
+        // Item defense buffs apply to every hit, blocked or not
+        float finalDamage = degat * buffStats.defense;
+        pv = pv - finalDamage;
+        if (blocked) {
+            emit(BattleEventType::BLOCK_SUCCESS, nullptr, attempt.reactionMs);
+            emit(BattleEventType::BLOCKED_DAMAGE, nullptr, finalDamage);
+        } else {
+            emit(BattleEventType::DAMAGE, nullptr, finalDamage);
+        }
+    }
+
+    // Returns false when there are not enough combo points
+    bool performHeroSpecialMove(Creature& target) {
+        if (comboPoints < 3) {
+            emit(BattleEventType::SPECIAL_FAILED, nullptr, comboPoints);
+            return false;
+        }
+        
+        int moveIndex = min((comboPoints - 3), (int)content.heroMoves.size() - 1);
+        const MoveDef& move = content.moves[content.heroMoves[moveIndex]];
+        float damage = pa * move.multiplier * (1.0f + float(successful_blocks) / 10.0f);
+        
+        target.subitDegat(calculateDamage(damage, target.getType()));
+        resetCombo();
+        emit(BattleEventType::SPECIAL_MOVE, content.names[move.name].c_str());
+        return true;
+    }
+
+    void addXP(float gained_xp) {
+        xp += gained_xp;
+        emit(BattleEventType::XP_GAINED, nullptr, gained_xp);
+        
+        while (xp >= 100.0) {
+            niveau++;
+            pv_max += 10;
+            pa += 3;
+            xp -= 100.0;
+            pv = pv_max;
+            countStat(Counter::LEVEL_UPS);
+            emit(BattleEventType::LEVEL_UP, nullptr, niveau);
+        }
+        
+        emit(BattleEventType::XP_PROGRESS, nullptr, xp);
+    }
+    
+    // Ids of the items held, in id order; the item menu numbers these from 1
+    vector<ItemId> getAvailableItems() const {
+        vector<ItemId> ids;
+        for (ItemId id = 0; id < itemCounts.size(); id++) {
+            if (itemCounts[id] > 0) ids.push_back(id);
+        }
+        return ids;
+    }
+    
+    const ActiveBuff* getBuffs() const { return buffs; }
+    int getBuffCount() const { return buffCount; }
+    int buffTurnsLeft(int i) const { return int(buffTimers.expiryOf(buffs[i].timer) - buffRound); }
+    float getBuffAttack() const { return buffStats.attack; }
+    float getBuffDefense() const { return buffStats.defense; }
+    float getBuffHeal() const { return buffStats.healPerTurn; }
+    float getXP() const { return xp; }
+    const vector<MoveId>& getHeroSpecialMoves() const { return content.heroMoves; }
+
+    vector<string> getInventoryList() const {
+        vector<string> list;
+        for (ItemId id : getAvailableItems()) {
+            list.push_back(content.items[id].getDescription(itemCounts[id]));
+        }
+        return list;
+    }
+    
+    vector<string> getActiveItemsList() const {
+        vector<string> list;
+        for (int i = 0; i < buffCount; i++) {
+            list.push_back(content.items[buffs[i].id].getName() + " (" + to_string(buffTurnsLeft(i)) + " turns remaining)");
+        }
+        return list;
+    }
+
+    void saveTo(HeroRecord& record) const {
+        Creature::saveTo(record.base);
+        record.xp = xp;
+        record.successfulBlocks = successful_blocks;
+        record.isBlocking = isBlocking;
+        record.inventoryCount = 0;
+        for (ItemId id : getAvailableItems()) {
+            if (record.inventoryCount == SNAPSHOT_MAX_ITEMS) break;
+            ItemRecord& item = record.inventory[record.inventoryCount++];
+            copyName(item.name, content.items[id].getName());
+            item.count = itemCounts[id];
+        }
+        record.buffCount = min<size_t>(buffCount, SNAPSHOT_MAX_BUFFS);
+        for (size_t i = 0; i < record.buffCount; i++) {
+            copyName(record.buffs[i].name, content.items[buffs[i].id].getName());
+            record.buffs[i].count = buffTurnsLeft(i);
+        }
+    }
+
+    void saveTo(HeroState& state) const;
+
+    // Items the content pack no longer has are dropped
+    void restoreFrom(const HeroRecord& record) {
+        Creature::restoreFrom(record.base);
+        name = readName(record.base.name);
+        xp = record.xp;
+        successful_blocks = record.successfulBlocks;
+        isBlocking = record.isBlocking != 0;
+        
+        itemCounts.clear();
+        for (size_t i = 0; i < min<size_t>(record.inventoryCount, SNAPSHOT_MAX_ITEMS); i++) {
+            int32_t id = content.findItem(readName(record.inventory[i].name));
+            if (id < 0) continue;
+            if (size_t(id) >= itemCounts.size()) itemCounts.resize(id + 1, 0);
+            itemCounts[id] = record.inventory[i].count;
+        }
+        buffCount = 0;
+        buffTimers = ExpiryTimers<MAX_BUFFS>();
+        for (size_t i = 0; i < min<size_t>(record.buffCount, MAX_BUFFS); i++) {
+            int32_t id = content.findItem(readName(record.buffs[i].name));
+            if (id < 0) continue;
+            buffTimers.schedule(buffCount, expiryAfter(buffRound, record.buffs[i].count));
+            buffs[buffCount] = {ItemId(id), buffCount};
+            buffCount++;
+        }
+        refreshBuffTotals();
+    }
+};
+
+const size_t STATE_MAX_ITEMS = 16;  // item ids past this are left out of searches
+
+struct HeroState {
+    CreatureState base;
+    bool isBlocking;
+    int successfulBlocks;
+    int buffCount;
+    float buffAttack, buffDefense, buffHeal;
+    ActiveBuff buffs[Hero::MAX_BUFFS];
+    ExpiryTimers<Hero::MAX_BUFFS> buffTimers;
+    uint32_t buffRound;
+    int itemCounts[STATE_MAX_ITEMS];
+    const MoveId* heroSpecialMoves;
+    uint32_t heroSpecialMoveCount;
+
+    int buffTurnsLeft(int i) const { return int(buffTimers.expiryOf(buffs[i].timer) - buffRound); }
+};
+
+void Hero::saveTo(HeroState& state) const {
+    Creature::saveTo(state.base);
+    state.isBlocking = isBlocking;
+    state.successfulBlocks = successful_blocks;
+    state.buffCount = buffCount;
+    state.buffAttack = buffStats.attack;
+    state.buffDefense = buffStats.defense;
+    state.buffHeal = buffStats.healPerTurn;
+    copy(buffs, buffs + buffCount, state.buffs);
+    state.buffTimers = buffTimers;
+    state.buffRound = buffRound;
+    for (ItemId id = 0; id < STATE_MAX_ITEMS; id++) state.itemCounts[id] = getItemCount(id);
+    state.heroSpecialMoves = content.heroMoves.data();
+    state.heroSpecialMoveCount = content.heroMoves.size();
+}
+
+void TextSink::emit(const BattleEvent& event) {
+    switch (event.type) {
+        case BattleEventType::EFFECTIVENESS:
+            if (event.value > 1.0f) out << "It's super effective! (x" << event.value << ")\n";
+            else out << "It's not very effective... (x" << event.value << ")\n";
+            break;
+        case BattleEventType::DAMAGE:
+            out << event.source->getName() << " took " << event.value << " damage!\n";
+            break;
+        case BattleEventType::DODGE:
+            out << event.source->getName() << " dodged the attack!\n";
+            break;
+        case BattleEventType::EFFECT_APPLIED:
+            out << event.label << " status effect applied!\n";
+            break;
+        case BattleEventType::EFFECT_EXPIRED:
+        case BattleEventType::ITEM_EXPIRED:
+            out << event.label << " effect has worn off!\n";
+            break;
+        case BattleEventType::ITEM_ADDED:
+            out << "Added " << event.label << " to inventory.\n";
+            break;
+        case BattleEventType::ITEM_EMPTY:
+            out << "No more " << event.label << " remaining!\n";
+            break;
+        case BattleEventType::ITEM_USED:
+            out << "Used " << event.label << "!\n";
+            break;
+        case BattleEventType::ITEM_LASTS:
+            out << "Effect will last for " << event.value << " turns.\n";
+            break;
+        case BattleEventType::HEAL:
+            out << "Healed for " << event.value << " HP!\n";
+            break;
+        case BattleEventType::ITEM_HEAL:
+            out << event.label << " healed for " << event.value << " HP!\n";
+            break;
+        case BattleEventType::BLOCK_SUCCESS:
+            out << "Correct! Perfect block! (answered in " << int(event.value) << " ms)\n";
+            break;
+        case BattleEventType::BLOCKED_DAMAGE:
+            out << event.source->getName() << " blocked most of the damage! Only took " << event.value << " damage!\n";
+            break;
+        case BattleEventType::BLOCK_TIMEOUT:
+        case BattleEventType::BLOCK_WRONG:
+            out << (event.type == BattleEventType::BLOCK_TIMEOUT ? "Time's up! Block failed!\n" : "Wrong answer! Block failed!\n")
+                << "The correct answer was: " << int(event.value) << "\n";
+            break;
+        case BattleEventType::ATTACK:
+            out << "You attack!\n";
+            break;
+        case BattleEventType::SPECIAL_MOVE:
+            out << "Special Move: " << event.label << "!\n";
+            break;
+        case BattleEventType::SPECIAL_FAILED:
+            out << "Special Move: Not enough combo points! (Need 3, have " << int(event.value) << ")!\n";
+            break;
+        case BattleEventType::BLOCK_STANCE:
+            out << "You take a defensive stance!\n";
+            break;
+        case BattleEventType::ESCAPED:
+            out << "You successfully ran away!\n";
+            break;
+        case BattleEventType::ESCAPE_FAILED:
+            out << "Couldn't escape!\n";
+            break;
+        case BattleEventType::MONSTER_ATTACK:
+            out << "\n" << event.source->getName() << " attacks!\n";
+            break;
+        case BattleEventType::MONSTER_SPECIAL:
+            out << "\n" << event.source->getName() << " uses " << event.label << "!\n";
+            break;
+        case BattleEventType::BACKSTAB:
+            out << "\n" << event.source->getName() << " attacks from behind!\n";
+            break;
+        case BattleEventType::VICTORY:
+            out << "\nVictory! You defeated the " << event.source->getName() << "!\n";
+            break;
+        case BattleEventType::XP_GAINED:
+            out << "\nGained " << event.value << " XP!\n";
+            break;
+        case BattleEventType::LEVEL_UP:
+            out << "\nLEVEL UP! You are now level " << int(event.value) << "!\n"
+                << "Max HP increased by 5!\n"
+                << "Attack increased by 2!\n"
+                << "You've been fully healed!\n";
+            break;
+        case BattleEventType::XP_PROGRESS:
+            out << "XP Progress: " << event.value << "/100\n";
+            break;
+        case BattleEventType::COUNT:
+            break;
+    }
+}
+
+BlockAttempt interactiveBlock(BattleContext& ctx) {
+    cout << "\nQuick! Solve this problem to block effectively!\n";
+    auto [problem, correct_answer] = generateMathProblem(ctx.rng);
+    cout << problem << " = ? (" << BLOCK_TIMEOUT_MS / 1000 << " seconds to answer!)\n" << flush;
+    
+    auto start = chrono::steady_clock::now();
+    string input;
+    auto status = consoleInput.readLine(input, start + chrono::milliseconds(BLOCK_TIMEOUT_MS));
+    recordPhase(Phase::BLOCK_WAIT, chrono::steady_clock::now() - start);
+    float reactionMs = chrono::duration<float, milli>(chrono::steady_clock::now() - start).count();
+    if (status != LineReader::Status::LINE) {
+        return {false, false, correct_answer, reactionMs};
+    }
+    
+    bool correct = false;
+    try {
+        correct = stoi(input) == correct_answer;
+    } catch (...) {
+    }
+    return {true, correct, correct_answer, reactionMs};
+}
+
+// Block attempt for headless battles: succeeds with ctx.blockSuccessRate, answering
+// halfway to the deadline
+BlockAttempt scriptedBlock(BattleContext& ctx) {
+    bool correct = ctx.rng.unit() < ctx.blockSuccessRate;
+    return {true, correct, 0, BLOCK_TIMEOUT_MS / 2.0f};
+}
+
+// Hero actions from the battle menu
+enum class HeroAction {
+    ATTACK = 1,
+    SPECIAL,
+    BLOCK,
+    ITEM,
+    RUN
+};
+
+// Resolves the hero's action; returns false when the hero ran away
+bool heroTurn(Hero& player, Creature& monster, HeroAction action, ItemId item = 0) {
+    PhaseTimer timer(Phase::HERO_TURN);
+    Rng& rng = player.getContext().rng;
+    switch (action) {
+        case HeroAction::ATTACK: {
+            float damage = player.attaque(monster);
+            player.emit(BattleEventType::ATTACK);
+            monster.subitDegat(damage);
+            break;
+        }
+        case HeroAction::SPECIAL:
+            player.performHeroSpecialMove(monster);
+            break;
+        case HeroAction::BLOCK:
+            player.emit(BattleEventType::BLOCK_STANCE);
+            player.setBlocking(true);
+            return true;
+        case HeroAction::ITEM:
+            player.useItem(item);
+            break;
+        case HeroAction::RUN: {
+            if (rng.below(4) == 0) {
+                player.emit(BattleEventType::ESCAPED);
+                player.setBlocking(false);
+                return false;
+            }
+            player.emit(BattleEventType::ESCAPE_FAILED);
+            float damage = monster.attaque(player);
+            monster.emit(BattleEventType::BACKSTAB);
+            player.subitDegat(damage*1.3);
+            break;
+        }
+    }
+    player.setBlocking(false);
+    return true;
+}
+
+// Monster's turn, followed by the end-of-round effect and item updates
+void monsterTurn(Hero& player, Creature& monster) {
+    PhaseTimer timer(Phase::MONSTER_TURN);
+    if (monster.getContext().rng.below(4) == 0) { // 25% chance for special move
+        const string& moveName = monster.performSpecialMove(player);
+        monster.emit(BattleEventType::MONSTER_SPECIAL, moveName.c_str());
+    } else {
+        float damage = monster.attaque(player);
+        monster.emit(BattleEventType::MONSTER_ATTACK);
+        player.subitDegat(damage);
+    }
+    
+    PhaseTimer updates(Phase::EFFECT_UPDATE);
+    player.updateStatusEffects();
+    player.updateActiveItems();
+    monster.updateStatusEffects();
+}
+
+// XP for defeating a monster, with a bonus for elemental ones
+float victoryXP(int level, MonsterType type) {
+    float xpGained = 30 + (level * 5);
+    if (type != MonsterType::NORMAL) {
+        xpGained *= 1.2f;
+    }
+    return xpGained;
+}
+
+// XP and random loot for a defeated monster
+void claimVictory(Hero& player, const Creature& monster) {
+    monster.emit(BattleEventType::VICTORY);
+    player.addXP(victoryXP(monster.getNiveau(), monster.getType()));
+    
+    // Random item drop (50% chance)
+    Rng& rng = player.getContext().rng;
+    if (rng.below(2) == 0) {
+        player.addItem(rng.below(content.items.size()), 1);
+    }
+}
+
+void giveStartingItems(Hero& player) {
+    for (const auto& [id, quantity] : content.startingItems) {
+        player.addItem(id, quantity);
+    }
+    player.addXP(300);
+}
+
+// Profiles are keyed by the hero's name as stored (truncated to the record field)
+string profileKey(const string& name) {
+    return name.substr(0, sizeof(CreatureRecord::name) - 1);
+}
+
+bool profileMatches(const PlayerSnapshot& snapshot, const string& name) {
+    return readName(snapshot.hero.base.name) == profileKey(name);
+}
+
+// Captures the hero, the monster being fought (null or dead: between battles) and the RNG
+PlayerSnapshot takeSnapshot(const Hero& player, int monstersDefeated, const Creature* monster) {
+    PlayerSnapshot snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    player.saveTo(snapshot.hero);
+    snapshot.monstersDefeated = monstersDefeated;
+    snapshot.monsterTemplate = monster && monster->estVivant() ? content.findMonster(monster->getName()) : -1;
+    if (snapshot.monsterTemplate >= 0) monster->saveTo(snapshot.monster);
+    player.getContext().rng.saveState(snapshot.rngState);
+    return snapshot;
+}
+
+// Restores the hero and its RNG; returns the monster of the battle in progress, if any
+unique_ptr<Creature> restoreSnapshot(const PlayerSnapshot& snapshot, Hero& player, int& monstersDefeated) {
+    player.restoreFrom(snapshot.hero);
+    monstersDefeated = snapshot.monstersDefeated;
+    player.getContext().rng.loadState(snapshot.rngState);
+    
+    // Looked up by name rather than by the saved index, which depends on the content pack
+    int index = snapshot.monsterTemplate < 0 ? -1 : content.findMonster(readName(snapshot.monster.name));
+    if (index < 0) return nullptr;
+    auto monster = make_unique<Creature>(content.monsters[index], snapshot.monster.niveau);
+    monster->setContext(player.getContext());
+    monster->restoreFrom(snapshot.monster);
+    return monster;
+}
+
+bool writeAll(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Writes a snapshot file: header, then the records back to back. The file is
+// written beside the target and renamed over it, so readers never see half of one.
+bool writeSnapshots(const string& path, const PlayerSnapshot* records, size_t count) {
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.recordSize = sizeof(PlayerSnapshot);
+    header.count = count;
+    
+    string temporary = path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = writeAll(fd, &header, sizeof(header)) &&
+              writeAll(fd, records, count * sizeof(PlayerSnapshot)) &&
+              fdatasync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (ok && rename(temporary.c_str(), path.c_str()) == 0) return true;
+    unlink(temporary.c_str());
+    return false;
+}
+
+// Read-only mapping of a snapshot file; records are used in place, nothing is parsed
+class MappedSnapshots {
+private:
+    void* base = MAP_FAILED;
+    size_t length = 0;
+    const PlayerSnapshot* records = nullptr;
+    size_t count = 0;
+    
+    void unmap() {
+        if (base != MAP_FAILED) munmap(base, length);
+        base = MAP_FAILED;
+        records = nullptr;
+        count = 0;
+    }
+
+public:
+    MappedSnapshots() = default;
+    MappedSnapshots(const MappedSnapshots&) = delete;
+    MappedSnapshots& operator=(const MappedSnapshots&) = delete;
+    ~MappedSnapshots() { unmap(); }
+    
+    // False if the file is missing, truncated or written by another format version
+    bool open(const string& path) {
+        unmap();
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && size_t(info.st_size) >= sizeof(SnapshotHeader)) {
+            length = info.st_size;
+            base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (base == MAP_FAILED) return false;
+        
+        const SnapshotHeader* header = static_cast<const SnapshotHeader*>(base);
+        size_t capacity = (length - sizeof(SnapshotHeader)) / sizeof(PlayerSnapshot);
+        if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != SNAPSHOT_VERSION || header->recordSize != sizeof(PlayerSnapshot) ||
+            header->count > capacity) {
+            unmap();
+            return false;
+        }
+        records = reinterpret_cast<const PlayerSnapshot*>(header + 1);
+        count = header->count;
+        return true;
+    }
+    
+    size_t size() const { return count; }
+    const PlayerSnapshot& operator[](size_t i) const { return records[i]; }
+    
+    const PlayerSnapshot* find(const string& name) const {
+        for (size_t i = 0; i < count; i++) {
+            if (profileMatches(records[i], name)) return &records[i];
+        }
+        return nullptr;
+    }
+};
+
+// Replaces the named player's profile in the file; a null snapshot removes it
+bool storeProfile(const string& path, const string& name, const PlayerSnapshot* snapshot) {
+    vector<PlayerSnapshot> profiles;
+    MappedSnapshots existing;
+    if (existing.open(path)) {
+        profiles.reserve(existing.size() + 1);
+        for (size_t i = 0; i < existing.size(); i++) {
+            if (!profileMatches(existing[i], name)) profiles.push_back(existing[i]);
+        }
+    }
+    if (snapshot) profiles.push_back(*snapshot);
+    return writeSnapshots(path, profiles.data(), profiles.size());
+}
+
+// Run history: every finished run appended to a log of fixed-size records, with a
+// sorted index beside it (path + ".idx") for the leaderboards and per-player lists
+const char HISTORY_MAGIC[8] = {'A', 'B', 'H', 'I', 'S', 'T', '\0', '\0'};
+const char HISTORY_INDEX_MAGIC[8] = {'A', 'B', 'H', 'I', 'D', 'X', '\0', '\0'};
+const uint32_t HISTORY_VERSION = 1;
+
+enum class RunMode : uint32_t { PLAYED, AUTO, SERVER };
+
+const char* const runModeNames[] = {"played", "auto", "server"};
+
+struct RunRecord {
+    char player[32];
+    int64_t endedAt;           // Unix time
+    int32_t monstersDefeated;
+    int32_t level;
+    int32_t successfulBlocks;
+    uint32_t mode;             // RunMode
+    uint32_t sequence;         // position in the log when appended
+    uint32_t checksum;         // of the bytes before it: torn or stray writes are skipped
+};
+
+struct HistoryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+};
+
+static_assert(sizeof(RunRecord) == 64, "run records are one cache line");
+static_assert(sizeof(HistoryHeader) % alignof(RunRecord) == 0, "records follow the header aligned");
+
+// FNV-1a: stable across builds, unlike std::hash, so it can be stored
+uint32_t fnv1a(const void* data, size_t size) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < size; i++) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+uint32_t runChecksum(const RunRecord& run) {
+    return fnv1a(&run, offsetof(RunRecord, checksum));
+}
+
+uint32_t playerKey(const char* name, size_t size) {
+    return fnv1a(name, strnlen(name, size));
+}
+
+RunRecord makeRunRecord(const string& player, int monstersDefeated, int level, int successfulBlocks, RunMode mode) {
+    RunRecord run;
+    memset(&run, 0, sizeof(run));
+    copyName(run.player, player);
+    run.endedAt = time(nullptr);
+    run.monstersDefeated = monstersDefeated;
+    run.level = level;
+    run.successfulBlocks = successfulBlocks;
+    run.mode = uint32_t(mode);
+    return run;
+}
+
+// Appends one run under an exclusive lock and syncs it before returning. A record
+// torn by a crash is cut off here, and skipped by readers until then.
+bool appendRun(const string& path, RunRecord run) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = flock(fd, LOCK_EX) == 0;
+    
+    struct stat info;
+    ok = ok && fstat(fd, &info) == 0;
+    size_t size = ok ? info.st_size : 0;
+    HistoryHeader header = {};
+    memcpy(header.magic, HISTORY_MAGIC, sizeof(header.magic));
+    header.version = HISTORY_VERSION;
+    header.recordSize = sizeof(RunRecord);
+    
+    // Never append to, or overwrite, a file in another format
+    bool ours = true;
+    if (ok && size < sizeof(header)) {
+        // Empty, or a header torn by a crash
+        char present[sizeof(header)];
+        ok = pread(fd, present, size, 0) == ssize_t(size);
+        ours = memcmp(present, &header, size) == 0;
+        ok = ok && ours && ftruncate(fd, 0) == 0 && writeAll(fd, &header, sizeof(header));
+        size = sizeof(header);
+    } else if (ok) {
+        HistoryHeader found;
+        ok = pread(fd, &found, sizeof(found), 0) == ssize_t(sizeof(found));
+        ours = memcmp(&found, &header, sizeof(header)) == 0;
+        ok = ok && ours;
+        size_t torn = (size - sizeof(header)) % sizeof(RunRecord);
+        if (ok && torn) {
+            size -= torn;
+            ok = ftruncate(fd, size) == 0;
+        }
+    }
+    
+    if (ok) {
+        run.sequence = uint32_t((size - sizeof(header)) / sizeof(RunRecord));
+        run.checksum = runChecksum(run);
+        ok = writeAll(fd, &run, sizeof(run)) && fdatasync(fd) == 0;
+    }
+    ok = close(fd) == 0 && ok;
+    if (!ours) errno = EINVAL;
+    return ok;
+}
+
+enum class HistoryKey { MONSTERS, LEVEL, BLOCKS, PLAYER, COUNT };
+
+const char* const historyKeyNames[] = {"monsters", "level", "blocks", "player"};
+
+// Index: the covered log prefix, then one section per key of (key, record) pairs.
+// Rankings are sorted by key descending, ties by the earlier run; the player section
+// by name hash, then by record.
+struct HistoryIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t indexedRecords;  // log records covered, including skipped ones
+    uint64_t entries;         // valid records among them: entries per section
+};
+
+struct IndexEntry {
+    uint32_t key;
+    uint32_t record;
+};
+
+uint32_t indexKey(const RunRecord& run, HistoryKey key) {
+    switch (key) {
+        case HistoryKey::MONSTERS: return max(run.monstersDefeated, 0);
+        case HistoryKey::LEVEL: return max(run.level, 0);
+        case HistoryKey::BLOCKS: return max(run.successfulBlocks, 0);
+        default: return playerKey(run.player, sizeof(run.player));
+    }
+}
+
+bool indexOrder(HistoryKey key, const IndexEntry& a, const IndexEntry& b) {
+    if (a.key != b.key) return key == HistoryKey::PLAYER ? a.key < b.key : a.key > b.key;
+    return a.record < b.record;
+}
+
+// Read-only mapping of a run log and its index. Queries read the index and only the
+// records they return, plus the runs appended since the index was built.
+class RunHistory {
+private:
+    struct Mapping {
+        void* base = MAP_FAILED;
+        size_t length = 0;
+        
+        bool map(int fd, size_t size) {
+            length = size;
+            base = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            return base != MAP_FAILED;
+        }
+        ~Mapping() {
+            if (base != MAP_FAILED) munmap(base, length);
+        }
+    };
+    
+    Mapping log, index;
+    const RunRecord* records = nullptr;
+    size_t count = 0;
+    size_t indexed = 0;  // records covered by the index
+    const IndexEntry* sections[size_t(HistoryKey::COUNT)] = {};
+    size_t entries = 0;
+    
+    void openIndex(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        struct stat info;
+        bool mapped = fstat(fd, &info) == 0 && size_t(info.st_size) >= sizeof(HistoryIndexHeader) &&
+                      index.map(fd, info.st_size);
+        close(fd);
+        if (!mapped) return;
+        
+        const HistoryIndexHeader* header = static_cast<const HistoryIndexHeader*>(index.base);
+        size_t sectionBytes = header->entries * sizeof(IndexEntry);
+        if (memcmp(header->magic, HISTORY_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != HISTORY_VERSION || header->recordSize != sizeof(RunRecord) ||
+            header->indexedRecords > count || header->entries > header->indexedRecords ||
+            index.length != sizeof(*header) + sectionBytes * size_t(HistoryKey::COUNT)) {
+            return;  // stale or foreign: the whole log is scanned as the tail
+        }
+        const IndexEntry* first = reinterpret_cast<const IndexEntry*>(header + 1);
+        for (size_t k = 0; k < size_t(HistoryKey::COUNT); k++) sections[k] = first + k * header->entries;
+        indexed = header->indexedRecords;
+        entries = header->entries;
+    }
+
+public:
+    RunHistory() = default;
+    RunHistory(const RunHistory&) = delete;
+    RunHistory& operator=(const RunHistory&) = delete;
+    
+    // False if the log is missing or in another format; a missing index is fine
+    bool open(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        // Shared lock: no append is half written while the size is taken
+        flock(fd, LOCK_SH);
+        struct stat info;
+        bool mapped = fstat(fd, &info) == 0 && size_t(info.st_size) >= sizeof(HistoryHeader) &&
+                      log.map(fd, info.st_size);
+        close(fd);
+        if (!mapped) return false;
+        
+        const HistoryHeader* header = static_cast<const HistoryHeader*>(log.base);
+        if (memcmp(header->magic, HISTORY_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != HISTORY_VERSION || header->recordSize != sizeof(RunRecord)) {
+            return false;
+        }
+        records = reinterpret_cast<const RunRecord*>(header + 1);
+        count = (log.length - sizeof(HistoryHeader)) / sizeof(RunRecord);
+        openIndex(path + ".idx");
+        return true;
+    }
+    
+    size_t size() const { return count; }
+    size_t indexedRecords() const { return indexed; }
+    const RunRecord& operator[](size_t i) const { return records[i]; }
+    bool valid(size_t i) const { return records[i].checksum == runChecksum(records[i]); }
+    
+    // Record numbers of the n best runs by key
+    vector<uint32_t> top(HistoryKey key, size_t n) const {
+        vector<IndexEntry> tail;
+        for (size_t i = indexed; i < count; i++) {
+            if (valid(i)) tail.push_back({indexKey(records[i], key), uint32_t(i)});
+        }
+        auto order = [key](const IndexEntry& a, const IndexEntry& b) { return indexOrder(key, a, b); };
+        size_t kept = min(n, tail.size());
+        partial_sort(tail.begin(), tail.begin() + kept, tail.end(), order);
+        tail.resize(kept);
+        
+        const IndexEntry* head = sections[size_t(key)];
+        size_t headCount = head ? min(n, entries) : 0;
+        vector<IndexEntry> merged(headCount + kept);
+        merge(head, head + headCount, tail.begin(), tail.end(), merged.begin(), order);
+        
+        vector<uint32_t> result;
+        for (size_t i = 0; i < min(n, merged.size()); i++) result.push_back(merged[i].record);
+        return result;
+    }
+    
+    // Record numbers of the player's last n runs, latest first
+    vector<uint32_t> playerRuns(const string& name, size_t n) const {
+        char player[sizeof(RunRecord::player)];
+        copyName(player, name);
+        uint32_t key = playerKey(player, sizeof(player));
+        auto matches = [&](size_t i) { return strncmp(records[i].player, player, sizeof(player)) == 0; };
+        
+        vector<uint32_t> result;
+        for (size_t i = count; i > indexed && result.size() < n; i--) {
+            if (valid(i - 1) && matches(i - 1)) result.push_back(i - 1);
+        }
+        const IndexEntry* section = sections[size_t(HistoryKey::PLAYER)];
+        if (!section) return result;
+        // Entries of a hash are in record order; names sharing the hash are filtered out
+        auto range = equal_range(section, section + entries, IndexEntry{key, 0},
+                                 [](const IndexEntry& a, const IndexEntry& b) { return a.key < b.key; });
+        for (auto it = range.second; it != range.first && result.size() < n; ) {
+            --it;
+            if (matches(it->record)) result.push_back(it->record);
+        }
+        return result;
+    }
+};
+
+// Sorts every valid record of the log into a new index, written beside it and renamed
+// over the old one. One section is held in memory at a time.
+bool reindexHistory(const string& path, size_t& indexed) {
+    RunHistory history;
+    if (!history.open(path)) return false;
+    indexed = history.size();
+    vector<IndexEntry> section;
+    for (size_t i = 0; i < indexed; i++) {
+        if (history.valid(i)) section.push_back({0, uint32_t(i)});
+    }
+    
+    HistoryIndexHeader header = {};
+    memcpy(header.magic, HISTORY_INDEX_MAGIC, sizeof(header.magic));
+    header.version = HISTORY_VERSION;
+    header.recordSize = sizeof(RunRecord);
+    header.indexedRecords = indexed;
+    header.entries = section.size();
+    
+    string temporary = path + ".idx.tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = writeAll(fd, &header, sizeof(header));
+    for (size_t k = 0; k < size_t(HistoryKey::COUNT) && ok; k++) {
+        HistoryKey key = HistoryKey(k);
+        for (IndexEntry& entry : section) entry.key = indexKey(history[entry.record], key);
+        sort(section.begin(), section.end(), [key](const IndexEntry& a, const IndexEntry& b) { return indexOrder(key, a, b); });
+        ok = writeAll(fd, section.data(), section.size() * sizeof(IndexEntry));
+    }
+    ok = fdatasync(fd) == 0 && ok;
+    ok = close(fd) == 0 && ok;
+    if (ok && rename(temporary.c_str(), (path + ".idx").c_str()) == 0) return true;
+    unlink(temporary.c_str());
+    return false;
+}
+
+// Appends a finished run to the history log, if one was given
+void recordRun(const string& path, const Hero& player, int monstersDefeated, RunMode mode) {
+    if (path.empty()) return;
+    RunRecord run = makeRunRecord(player.getName(), monstersDefeated, player.getNiveau(), player.getSuccessfulBlocks(), mode);
+    if (!appendRun(path, run)) cerr << "Cannot append the run to " << path << ": " << strerror(errno) << "\n";
+}
+
+struct LeaderboardConfig {
+    string path;
+    size_t count = 10;
+    HistoryKey by = HistoryKey::MONSTERS;
+    string player;             // non-empty: that player's runs instead of the ranking
+    bool reindex = false;
+    size_t reindexTail = 65536;  // unindexed runs that trigger a rebuild before the query
+};
+
+void writeRuns(ostream& out, const RunHistory& history, const vector<uint32_t>& runs) {
+    out << "Rank  Player                            Monsters  Level  Blocks  Mode    Ended\n";
+    for (size_t i = 0; i < runs.size(); i++) {
+        const RunRecord& run = history[runs[i]];
+        time_t ended = run.endedAt;
+        tm local;
+        localtime_r(&ended, &local);
+        char date[32];
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &local);
+        out << setw(4) << i + 1 << "  " << left << setw(32) << readName(run.player) << right
+            << setw(10) << run.monstersDefeated << setw(7) << run.level << setw(8) << run.successfulBlocks << "  "
+            << left << setw(8) << runModeNames[min<uint32_t>(run.mode, 2)] << right << date << "\n";
+    }
+}
+
+// Leaderboards and player histories from a run log
+int runLeaderboard(const LeaderboardConfig& config) {
+    RunHistory probe;
+    if (!probe.open(config.path)) {
+        cerr << "No run history in " << config.path << "\n";
+        return 1;
+    }
+    if (config.reindex || probe.size() - probe.indexedRecords() > config.reindexTail) {
+        size_t indexed = 0;
+        auto start = chrono::steady_clock::now();
+        if (!reindexHistory(config.path, indexed)) {
+            cerr << "Cannot write " << config.path << ".idx: " << strerror(errno) << "\n";
+            return 1;
+        }
+        cerr << "Indexed " << indexed << " runs in " << fixed << setprecision(3)
+             << chrono::duration<double>(chrono::steady_clock::now() - start).count() << "s\n";
+    }
+    
+    RunHistory history;
+    history.open(config.path);
+    auto start = chrono::steady_clock::now();
+    vector<uint32_t> runs = config.player.empty() ? history.top(config.by, config.count)
+                                                  : history.playerRuns(config.player, config.count);
+    double micros = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    
+    if (config.player.empty()) cout << "Top " << config.count << " runs by " << historyKeyNames[size_t(config.by)] << "\n";
+    else cout << "Last " << config.count << " runs of " << config.player << "\n";
+    writeRuns(cout, history, runs);
+    cerr << history.size() << " runs (" << history.size() - history.indexedRecords() << " not indexed), query "
+         << fixed << setprecision(1) << micros << " us\n";
+    return 0;
+}
+
+// Chooses the hero's actions when nobody is at the keyboard
+class BattlePolicy {
+public:
+    virtual ~BattlePolicy() = default;
+    virtual HeroAction choose(const Hero& player, const Creature& monster, ItemId& item) = 0;
+};
+
+// Heals when low, spends combo points on specials, otherwise attacks
+class ScriptedPolicy : public BattlePolicy {
+public:
+    float healBelow = 0.3f;  // fraction of max HP
+    int specialAt = 3;       // combo points
+    bool useBuffs = false;   // drink a buff item whenever none is active
+
+    HeroAction choose(const Hero& player, const Creature&, ItemId& item) override {
+        if (player.getPV() < player.getPVMax() * healBelow) {
+            for (ItemId id : player.getAvailableItems()) {
+                if (content.items[id].healAmount > 0) {
+                    item = id;
+                    return HeroAction::ITEM;
+                }
+            }
+        }
+        if (useBuffs && player.getBuffCount() == 0) {
+            for (ItemId id : player.getAvailableItems()) {
+                if (content.items[id].duration > 0 && content.items[id].healAmount <= 0) {
+                    item = id;
+                    return HeroAction::ITEM;
+                }
+            }
+        }
+        if (player.getComboPoints() >= specialAt) return HeroAction::SPECIAL;
+        return HeroAction::ATTACK;
+    }
+};
+
+struct BattleResult {
+    bool heroWon;
+    bool escaped;
+    int turns;     // full rounds played
+    float heroPV;
+};
+
+// Runs a whole battle with no input and no pauses
+BattleResult runBattle(Hero& player, Creature& monster, BattlePolicy& policy, int maxTurns = 1000) {
+    BattleResult result = {false, false, 0, 0.0f};
+    countStat(Counter::BATTLES);
+    
+    while (monster.estVivant() && player.estVivant() && result.turns < maxTurns) {
+        ItemId item = 0;
+        HeroAction action = policy.choose(player, monster, item);
+        if (!heroTurn(player, monster, action, item)) {
+            result.escaped = true;
+            break;
+        }
+        if (monster.estVivant() && player.estVivant()) {
+            monsterTurn(player, monster);
+        }
+        result.turns++;
+    }
+    countStat(Counter::TURNS, result.turns);
+    
+    result.heroWon = !monster.estVivant() && player.estVivant();
+    result.heroPV = player.getPV();
+    return result;
+}
+
+// The battle rules again, on a trivially copyable state: what a search copies
+// thousands of times per decision. Each step draws from the RNG exactly as
+// heroTurn()/monsterTurn() do with scriptedBlock, so a state captured from a live
+// battle follows it draw for draw (--mcts counts any divergence). No events are emitted.
+enum class BattleOutcome { ONGOING, WON, LOST, ESCAPED };
+
+struct BattleState {
+    HeroState hero;
+    CreatureState monster;
+    Rng rng;
+    float blockSuccessRate;
+
+    static void refreshEffects(CreatureState& c) {
+        c.effectDamageMultiplier = 1.0f;
+        c.effectDefenseMultiplier = 1.0f;
+        for (unsigned mask = c.effectMask; mask; mask &= mask - 1) {
+            const StatusEffect& effect = c.activeEffects[__builtin_ctz(mask)];
+            c.effectDamageMultiplier *= effect.damageMultiplier;
+            c.effectDefenseMultiplier *= effect.defenseMultiplier;
+        }
+    }
+
+    static void updateEffects(CreatureState& c) {
+        c.effectRound++;
+        unsigned expired = 0;
+        for (size_t i; (i = c.effectTimers.popDue(c.effectRound)) != size_t(EffectId::COUNT);) expired |= 1u << i;
+        if (!expired) return;
+        c.effectMask &= ~expired;
+        refreshEffects(c);
+    }
+
+    static float calculateDamage(const CreatureState& attacker, float baseDamage, MonsterType targetType) {
+        float multiplier = effectiveness(attacker.type, targetType);
+        multiplier *= attacker.effectDamageMultiplier;
+        return baseDamage * multiplier;
+    }
+
+    float heroDamage(float baseDamage) const {
+        return calculateDamage(hero.base, baseDamage, monster.type) * hero.buffAttack;
+    }
+
+    template <typename Dice>
+    void monsterTakes(Dice& dice, float degat) {
+        float finalDamage = degat * monster.effectDefenseMultiplier;
+        if (!dice.chance(2, 4)) monster.pv = monster.pv - finalDamage;  // 2 in 4 dodge
+    }
+
+    template <typename Dice>
+    void heroTakes(Dice& dice, float degat) {
+        if (hero.isBlocking) {
+            bool correct = dice.unit() < blockSuccessRate;
+            if (correct) {
+                hero.successfulBlocks++;
+                hero.base.pv = hero.base.pv - degat * blockDamageFactor(BLOCK_TIMEOUT_MS / 2.0f) * hero.buffDefense;
+                return;
+            }
+        }
+        hero.base.pv = hero.base.pv - degat * hero.buffDefense;
+    }
+
+    void refreshBuffs() {
+        hero.buffAttack = 1.0f;
+        hero.buffDefense = 1.0f;
+        hero.buffHeal = 0.0f;
+        for (int i = 0; i < hero.buffCount; i++) {
+            const Item& item = content.items[hero.buffs[i].id];
+            hero.buffAttack *= item.attackBuff;
+            hero.buffDefense *= 2.0f - item.defenseBuff;
+            hero.buffHeal += item.healAmount;
+        }
+    }
+
+    void useItem(ItemId id) {
+        if (id >= STATE_MAX_ITEMS || hero.itemCounts[id] <= 0) return;
+        const Item& item = content.items[id];
+        if (item.healAmount > 0 && item.duration == 0) {
+            hero.base.pv = min(hero.base.pv + item.healAmount, hero.base.pv_max);
+        }
+        if (item.duration > 0) {
+            ExpiryTimers<Hero::MAX_BUFFS>& timers = hero.buffTimers;
+            if (hero.buffCount == Hero::MAX_BUFFS) {
+                int soonest = 0;
+                for (int i = 1; i < hero.buffCount; i++) {
+                    if (timers.expiryOf(hero.buffs[i].timer) < timers.expiryOf(hero.buffs[soonest].timer)) soonest = i;
+                }
+                timers.cancel(hero.buffs[soonest].timer);
+                copy(hero.buffs + soonest + 1, hero.buffs + hero.buffCount, hero.buffs + soonest);
+                hero.buffCount--;
+            }
+            int timer = 0;
+            while (timers.scheduled(timer)) timer++;
+            timers.schedule(timer, expiryAfter(hero.buffRound, item.duration));
+            hero.buffs[hero.buffCount++] = {id, timer};
+            refreshBuffs();
+        }
+        hero.itemCounts[id]--;
+    }
+
+    void updateItems() {
+        if (hero.buffHeal > 0) {
+            for (int i = 0; i < hero.buffCount; i++) {
+                const Item& item = content.items[hero.buffs[i].id];
+                if (item.healAmount > 0) hero.base.pv = min(hero.base.pv + item.healAmount, hero.base.pv_max);
+            }
+        }
+        hero.buffRound++;
+        unsigned due = 0;
+        for (size_t timer; (timer = hero.buffTimers.popDue(hero.buffRound)) != Hero::MAX_BUFFS;) due |= 1u << timer;
+        if (!due) return;
+        int kept = 0;
+        for (int i = 0; i < hero.buffCount; i++) {
+            if (!(due >> hero.buffs[i].timer & 1)) hero.buffs[kept++] = hero.buffs[i];
+        }
+        hero.buffCount = kept;
+        refreshBuffs();
+    }
+
+    // heroTurn(); false when the hero ran away
+    template <typename Dice>
+    bool heroTurn(Dice& dice, HeroAction action, ItemId item) {
+        CreatureState& h = hero.base;
+        switch (action) {
+            case HeroAction::ATTACK: {
+                float damage = h.pa * (1.0f + float(dice.below(10))/10.0f);
+                damage = heroDamage(damage);
+                h.comboPoints++;
+                monsterTakes(dice, damage);
+                break;
+            }
+            case HeroAction::SPECIAL: {
+                if (h.comboPoints < 3) break;
+                int moveIndex = min(h.comboPoints - 3, int(hero.heroSpecialMoveCount) - 1);
+                const MoveDef& move = content.moves[hero.heroSpecialMoves[moveIndex]];
+                float damage = h.pa * move.multiplier * (1.0f + float(hero.successfulBlocks) / 10.0f);
+                monsterTakes(dice, heroDamage(damage));
+                h.comboPoints = 0;
+                break;
+            }
+            case HeroAction::BLOCK:
+                hero.isBlocking = true;
+                return true;
+            case HeroAction::ITEM:
+                useItem(item);
+                break;
+            case HeroAction::RUN: {
+                if (dice.chance(1, 4)) {
+                    hero.isBlocking = false;
+                    return false;
+                }
+                float damage = monster.pa * (1.0f + float(dice.below(10))/10.0f);
+                damage = calculateDamage(monster, damage, h.type);
+                monster.comboPoints++;
+                heroTakes(dice, damage*1.3);
+                break;
+            }
+        }
+        hero.isBlocking = false;
+        return true;
+    }
+
+    // monsterTurn()
+    template <typename Dice>
+    void monsterTurn(Dice& dice) {
+        CreatureState& h = hero.base;
+        if (dice.chance(1, 4)) {
+            if (monster.specialMoveCount > 0) {
+                const MoveDef& move = content.moves[monster.specialMoves[dice.below(monster.specialMoveCount)]];
+                float damage = monster.pa * move.multiplier;
+                StatusEffect effect = elementEffect(monster.type);
+                if (effect.id != EffectId::COUNT) {
+                    h.activeEffects[size_t(effect.id)] = effect;
+                    h.effectMask |= 1u << size_t(effect.id);
+                    h.effectTimers.schedule(size_t(effect.id), expiryAfter(h.effectRound, effect.duration));
+                    refreshEffects(h);
+                }
+                heroTakes(dice, calculateDamage(monster, damage, h.type));
+            }
+        } else {
+            float damage = monster.pa * (1.0f + float(dice.below(10))/10.0f);
+            damage = calculateDamage(monster, damage, h.type);
+            monster.comboPoints++;
+            heroTakes(dice, damage);
+        }
+        
+        updateEffects(h);
+        updateItems();
+        updateEffects(monster);
+    }
+
+    // One round of runBattle(). Dice is the state's own Rng, or anything else with
+    // below() and unit(), e.g. to enumerate the outcomes instead of sampling them.
+    template <typename Dice>
+    BattleOutcome round(Dice& dice, HeroAction action, ItemId item) {
+        if (!heroTurn(dice, action, item)) return BattleOutcome::ESCAPED;
+        if (monster.pv > 0 && hero.base.pv > 0) monsterTurn(dice);
+        return outcome();
+    }
+
+    BattleOutcome round(HeroAction action, ItemId item) {
+        return round(rng, action, item);
+    }
+
+    BattleOutcome outcome() const {
+        if (hero.base.pv <= 0) return BattleOutcome::LOST;
+        if (monster.pv <= 0) return BattleOutcome::WON;
+        return BattleOutcome::ONGOING;
+    }
+};
+
+static_assert(is_trivially_copyable<BattleState>::value, "search states are copied as raw bytes");
+
+BattleState captureBattle(const Hero& player, const Creature& monster) {
+    BattleState state;
+    player.saveTo(state.hero);
+    monster.saveTo(state.monster);
+    state.rng = player.getContext().rng;
+    state.blockSuccessRate = player.getContext().blockSuccessRate;
+    return state;
+}
+
+// Battle logs: the starting snapshot of a run, then one fixed-size record per battle,
+// hero choice, block answer and event, appended as the run is played. Feeding the
+// choices and block answers back to the rules reproduces the run; the events check it.
+const char LOG_MAGIC[8] = {'A', 'B', 'L', 'O', 'G', '\0', '\0', '\0'};
+const uint32_t LOG_VERSION = 1;
+
+enum class LogKind : uint8_t {
+    BATTLE,    // id = monster template, arg = level
+    CHOICE,    // code = HeroAction (0: turn skipped), id = item
+    BLOCK,     // code = answered | correct << 1, value = reaction ms
+    EVENT,     // code = BattleEventType, arg = source (0 hero, 1 monster), value
+    NEW_HERO   // the hero died and a fresh one takes over (simulations)
+};
+
+struct LogRecord {
+    LogKind kind;
+    uint8_t code;
+    uint16_t arg;
+    union {
+        float value;
+        uint32_t id;
+    };
+};
+
+struct LogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t scriptedBlocks;  // blocks came from scriptedBlock rather than a player
+    float blockSuccessRate;
+    PlayerSnapshot start;
+};
+
+static_assert(sizeof(LogRecord) == 8, "log records are 8 bytes");
+static_assert(is_trivially_copyable<LogHeader>::value, "log headers are copied as raw bytes");
+
+void displayBattle(const Hero& player, const Creature& monster, ostream& out);
+
+// Records a run while it is played: sits in front of the context's sink and block hook
+class BattleRecorder : public EventSink {
+private:
+    int fd = -1;
+    const Creature* hero = nullptr;
+    EventSink* next = nullptr;
+    BlockAttempt (*nextBlock)(BattleContext& ctx) = nullptr;
+    vector<LogRecord> pending;
+    
+    void push(LogKind kind, uint8_t code, uint16_t arg, uint32_t id) {
+        if (fd < 0) return;
+        LogRecord record;
+        record.kind = kind;
+        record.code = code;
+        record.arg = arg;
+        record.id = id;
+        pending.push_back(record);
+    }
+    
+    static BlockAttempt recordBlock(BattleContext& ctx) {
+        BattleRecorder& recorder = *static_cast<BattleRecorder*>(ctx.owner);
+        BlockAttempt attempt = recorder.nextBlock(ctx);
+        recorder.push(LogKind::BLOCK, attempt.answered | attempt.correct << 1, 0, 0);
+        if (recorder.recording()) recorder.pending.back().value = attempt.reactionMs;
+        return attempt;
+    }
+
+public:
+    BattleRecorder() = default;
+    BattleRecorder(const BattleRecorder&) = delete;
+    BattleRecorder& operator=(const BattleRecorder&) = delete;
+    ~BattleRecorder() { stop(); }
+    
+    // Starts a log of the hero's run from its current state; takes over the context's
+    // sink, block hook and owner until stop()
+    bool start(const string& path, Hero& player, int monstersDefeated, const Creature* monster) {
+        BattleContext& ctx = player.getContext();
+        LogHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+        header.version = LOG_VERSION;
+        header.recordSize = sizeof(LogRecord);
+        header.scriptedBlocks = ctx.attemptBlock == scriptedBlock;
+        header.blockSuccessRate = ctx.blockSuccessRate;
+        header.start = takeSnapshot(player, monstersDefeated, monster);
+        
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || !writeAll(fd, &header, sizeof(header))) return false;
+        hero = &player;
+        next = ctx.sink;
+        nextBlock = ctx.attemptBlock;
+        ctx.sink = this;
+        ctx.attemptBlock = recordBlock;
+        ctx.owner = this;
+        return true;
+    }
+    
+    bool recording() const { return fd >= 0; }
+    
+    void emit(const BattleEvent& event) override {
+        push(LogKind::EVENT, uint8_t(event.type), event.source != hero, 0);
+        if (recording()) pending.back().value = event.value;
+        next->emit(event);
+    }
+    
+    void battle(const Creature& monster) {
+        push(LogKind::BATTLE, 0, monster.getNiveau(), content.findMonster(monster.getName()));
+    }
+    
+    void choice(HeroAction action, ItemId item = 0) { push(LogKind::CHOICE, uint8_t(action), 0, item); }
+    void skippedTurn() { push(LogKind::CHOICE, 0, 0, 0); }
+    void newHero() { push(LogKind::NEW_HERO, 0, 0, 0); }
+    
+    // Appends the pending records to the file
+    void flush() {
+        if (fd < 0 || pending.empty()) return;
+        writeAll(fd, pending.data(), pending.size() * sizeof(LogRecord));
+        pending.clear();
+    }
+    
+    void stop() {
+        flush();
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+};
+
+// Lets a policy's choices into the log
+class RecordingPolicy : public BattlePolicy {
+private:
+    BattlePolicy& policy;
+    BattleRecorder& recorder;
+
+public:
+    RecordingPolicy(BattlePolicy& policy, BattleRecorder& recorder) : policy(policy), recorder(recorder) {}
+    
+    HeroAction choose(const Hero& player, const Creature& monster, ItemId& item) override {
+        HeroAction action = policy.choose(player, monster, item);
+        recorder.choice(action, item);
+        return action;
+    }
+};
+
+struct BattleLog {
+    LogHeader header;
+    vector<LogRecord> records;
+    
+    bool load(const string& path) {
+        ifstream file(path, ios::binary);
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+        if (memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)) != 0 || header.version != LOG_VERSION ||
+            header.recordSize != sizeof(LogRecord)) return false;
+        string rest((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        records.resize(rest.size() / sizeof(LogRecord));
+        memcpy(records.data(), rest.data(), records.size() * sizeof(LogRecord));
+        return true;
+    }
+};
+
+struct ReplayReport {
+    size_t battles = 0;
+    size_t choices = 0;
+    size_t events = 0;
+    bool diverged = false;
+    size_t record = 0;  // where the replay left the log
+    string reason;
+};
+
+// Plays a log back through the rules, checking every event against the recorded one.
+// With show set, the battle screen and text are printed as the player saw them.
+class BattleReplay : public EventSink {
+private:
+    const BattleLog& log;
+    size_t cursor = 0;
+    const Creature* hero = nullptr;
+    EventSink* echo;
+    ReplayReport report;
+    
+    void diverge(const string& reason) {
+        if (report.diverged) return;
+        report.diverged = true;
+        report.record = cursor;
+        report.reason = reason;
+    }
+    
+    // The next record, if it is of the expected kind
+    const LogRecord* take(LogKind kind) {
+        if (report.diverged || cursor >= log.records.size()) return nullptr;
+        const LogRecord& record = log.records[cursor];
+        if (record.kind != kind) return nullptr;
+        cursor++;
+        return &record;
+    }
+    
+    static BlockAttempt replayBlock(BattleContext& ctx) {
+        BattleReplay& replay = *static_cast<BattleReplay*>(ctx.owner);
+        BlockAttempt expected = {false, false, 0, float(BLOCK_TIMEOUT_MS)};
+        if (replay.log.header.scriptedBlocks) {
+            BlockAttempt attempt = scriptedBlock(ctx);
+            const LogRecord* record = replay.take(LogKind::BLOCK);
+            if (!record || record->code != (attempt.answered | attempt.correct << 1)) replay.diverge("block outcome differs");
+            return attempt;
+        }
+        // The challenge is drawn as it was when the player answered it
+        expected.correctAnswer = generateMathProblem(ctx.rng).second;
+        const LogRecord* record = replay.take(LogKind::BLOCK);
+        if (!record) {
+            replay.diverge("expected a block answer");
+            return expected;
+        }
+        expected.answered = record->code & 1;
+        expected.correct = record->code & 2;
+        expected.reactionMs = record->value;
+        return expected;
+    }
+    
+    void play(Hero& player, Creature& monster, bool show) {
+        countStat(Counter::BATTLES);
+        while (!report.diverged && monster.estVivant() && player.estVivant()) {
+            if (show) displayBattle(player, monster, cout);
+            const LogRecord* choice = take(LogKind::CHOICE);
+            if (!choice) return;  // the battle was cut short: input closed or turn limit
+            report.choices++;
+            countStat(Counter::TURNS);
+            
+            bool battleContinues = true;
+            if (choice->code == 0) player.setBlocking(false);
+            else battleContinues = heroTurn(player, monster, HeroAction(choice->code), choice->id);
+            if (!battleContinues) return;
+            if (!monster.estVivant()) {
+                claimVictory(player, monster);
+                return;
+            }
+            if (player.estVivant()) monsterTurn(player, monster);
+        }
+    }
+
+public:
+    BattleReplay(const BattleLog& log, EventSink* echo) : log(log), echo(echo) {}
+    
+    void emit(const BattleEvent& event) override {
+        if (echo) echo->emit(event);
+        report.events++;
+        const LogRecord* record = take(LogKind::EVENT);
+        if (!record) {
+            diverge(string("unexpected event ") + to_string(int(event.type)));
+        } else if (record->code != uint8_t(event.type) || record->arg != (event.source != hero) ||
+                   record->value != event.value) {
+            cursor--;
+            diverge("event " + to_string(int(event.type)) + " value " + to_string(event.value) +
+                    ", recorded " + to_string(int(record->code)) + " value " + to_string(record->value));
+        }
+    }
+    
+    ReplayReport run(bool show) {
+        BattleContext ctx = {this, replayBlock, log.header.blockSuccessRate, Rng()};
+        ctx.owner = this;
+        Hero player("");
+        player.setContext(ctx);
+        hero = &player;
+        int monstersDefeated = 0;
+        unique_ptr<Creature> resumed = restoreSnapshot(log.header.start, player, monstersDefeated);
+        string name = player.getName();
+        
+        while (!report.diverged && cursor < log.records.size()) {
+            if (take(LogKind::NEW_HERO)) {
+                player = Hero(name);
+                player.setContext(ctx);
+                giveStartingItems(player);
+                monstersDefeated = 0;
+                continue;
+            }
+            const LogRecord* battle = take(LogKind::BATTLE);
+            if (!battle) {
+                diverge("expected a battle");
+                break;
+            }
+            int monsterIndex = resumed ? 0 : ctx.rng.below(content.monsters.size());
+            int monsterLevel = 1 + (monstersDefeated / 3);
+            Creature monster = resumed ? *resumed : Creature(content.monsters[monsterIndex], monsterLevel);
+            monster.setContext(ctx);
+            resumed.reset();
+            if (battle->id != uint32_t(content.findMonster(monster.getName())) || battle->arg != monster.getNiveau()) {
+                cursor--;
+                diverge("monster differs: " + monster.getName());
+                break;
+            }
+            
+            report.battles++;
+            if (show) {
+                cout << "A level " << monster.getNiveau() << " " << content.elementName(monster.getType())
+                     << " " << monster.getName() << " appears!\n\n";
+            }
+            play(player, monster, show);
+            if (!monster.estVivant() && player.estVivant()) monstersDefeated++;
+        }
+        if (!report.diverged && cursor < log.records.size()) diverge("log continues past the replay");
+        return report;
+    }
+};
+
+int runReplay(const string& path, bool show) {
+    BattleLog log;
+    if (!log.load(path)) {
+        cerr << "Cannot read battle log " << path << "\n";
+        return 1;
+    }
+    TextSink text(cout);
+    BattleReplay replay(log, show ? &text : nullptr);
+    auto start = chrono::steady_clock::now();
+    ReplayReport report = replay.run(show);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    
+    cout << "Replayed " << report.battles << " battles, " << report.choices << " choices, "
+         << report.events << " events in " << seconds << "s ("
+         << fixed << setprecision(0) << report.events / seconds << " events/s)\n";
+    if (report.diverged) {
+        cout << "Diverged at record " << report.record << " of " << log.records.size() << ": " << report.reason << "\n";
+        return 2;
+    }
+    cout << "Matches the log\n";
+    return 0;
+}
+
+// Headless mode: plays endless campaigns with the scripted policy and reports throughput
+int runSimulation(int battles, uint64_t seed, const string& recordPath) {
+    CountingSink counter;
+    BattleContext ctx = {&counter, scriptedBlock, 0.5f, Rng(seed)};
+    ScriptedPolicy scripted;
+    
+    Hero player("Simulated Hero");
+    player.setContext(ctx);
+    giveStartingItems(player);
+    
+    BattleRecorder recorder;
+    if (!recordPath.empty() && !recorder.start(recordPath, player, 0, nullptr)) {
+        cerr << "Cannot write battle log " << recordPath << "\n";
+        return 1;
+    }
+    RecordingPolicy recordingPolicy(scripted, recorder);
+    BattlePolicy& policy = recorder.recording() ? static_cast<BattlePolicy&>(recordingPolicy) : scripted;
+    
+    int monstersDefeated = 0;
+    int victories = 0, deaths = 0, escapes = 0;
+    long long turns = 0;
+    
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < battles; i++) {
+        int monsterIndex = ctx.rng.below(content.monsters.size());
+        int monsterLevel = 1 + (monstersDefeated / 3);
+        Creature monster(content.monsters[monsterIndex], monsterLevel);
+        monster.setContext(ctx);
+        if (recorder.recording()) recorder.battle(monster);
+        
+        BattleResult result = runBattle(player, monster, policy);
+        turns += result.turns;
+        if (result.heroWon) {
+            claimVictory(player, monster);
+            monstersDefeated++;
+            victories++;
+        } else if (result.escaped) {
+            escapes++;
+        } else if (!player.estVivant()) {
+            deaths++;
+            if (recorder.recording()) recorder.newHero();
+            player = Hero("Simulated Hero");
+            player.setContext(ctx);
+            giveStartingItems(player);
+            monstersDefeated = 0;
+        }
+        if (recorder.recording() && i % 1024 == 0) recorder.flush();
+    }
+    recorder.stop();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    
+    cout << "Simulated " << battles << " battles in " << seconds << "s ("
+         << fixed << setprecision(0) << battles / seconds << " battles/s)\n"
+         << "Victories: " << victories << ", Deaths: " << deaths << ", Escapes: " << escapes << "\n"
+         << "Turns: " << turns << ", Hits: " << counter.count(BattleEventType::DAMAGE)
+         << ", Dodges: " << counter.count(BattleEventType::DODGE)
+         << ", Level ups: " << counter.count(BattleEventType::LEVEL_UP) << "\n";
+    return 0;
+}
+
+// Work-stealing pool: each worker pops from the back of its own deque and
+// steals from the front of the others' once it runs dry
+class WorkStealingPool {
+public:
+    using Task = function<void(int worker)>;
+
+private:
+    struct Queue {
+        mutex lock;
+        deque<Task> tasks;
+    };
+    vector<unique_ptr<Queue>> queues;
+    size_t nextQueue = 0;
+
+    bool pop(int worker, Task& task) {
+        Queue& queue = *queues[worker];
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tasks.empty()) return false;
+        task = move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(int thief, Task& task) {
+        for (size_t i = 1; i < queues.size(); i++) {
+            Queue& victim = *queues[(thief + i) % queues.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    explicit WorkStealingPool(int workers) {
+        for (int i = 0; i < max(workers, 1); i++) queues.push_back(make_unique<Queue>());
+    }
+
+    int size() const { return queues.size(); }
+
+    // Tasks are dealt round-robin; stealing evens out the imbalance
+    void submit(Task task) {
+        queues[nextQueue++ % queues.size()]->tasks.push_back(move(task));
+    }
+
+    // Runs every submitted task and returns once all workers are done
+    void run() {
+        auto work = [this](int worker) {
+            Task task;
+            while (pop(worker, task) || steal(worker, task)) {
+                task(worker);
+            }
+        };
+        vector<thread> threads;
+        for (int i = 1; i < size(); i++) threads.emplace_back(work, i);
+        work(0);
+        for (auto& t : threads) t.join();
+    }
+};
+
+// Distribution of battle outcomes for one monster/level cell
+struct CellStats {
+    static const int TURN_BINS = 64;   // last bin collects longer fights
+    static const int HP_BINS = 10;     // hero HP left as a fraction of max, on victory
+
+    long long battles = 0;
+    long long wins = 0;
+    long long escapes = 0;
+    long long turns = 0;
+    double hpLeft = 0.0;
+    long long turnHistogram[TURN_BINS] = {};
+    long long hpHistogram[HP_BINS] = {};
+
+    void add(const BattleResult& result, float pvMax) {
+        battles++;
+        turns += result.turns;
+        turnHistogram[min(result.turns, TURN_BINS - 1)]++;
+        if (result.escaped) escapes++;
+        if (result.heroWon) {
+            wins++;
+            float fraction = max(0.0f, result.heroPV) / pvMax;
+            hpLeft += fraction;
+            hpHistogram[min(int(fraction * HP_BINS), HP_BINS - 1)]++;
+        }
+    }
+
+    void merge(const CellStats& other) {
+        battles += other.battles;
+        wins += other.wins;
+        escapes += other.escapes;
+        turns += other.turns;
+        hpLeft += other.hpLeft;
+        for (int i = 0; i < TURN_BINS; i++) turnHistogram[i] += other.turnHistogram[i];
+        for (int i = 0; i < HP_BINS; i++) hpHistogram[i] += other.hpHistogram[i];
+    }
+
+    // Smallest turn count reached by the given fraction of battles
+    int turnPercentile(double p) const {
+        long long target = (long long)(p * battles), seen = 0;
+        for (int i = 0; i < TURN_BINS; i++) {
+            seen += turnHistogram[i];
+            if (seen > target) return i;
+        }
+        return TURN_BINS - 1;
+    }
+};
+
+struct BalanceConfig {
+    int battlesPerCell = 1000;
+    int maxLevel = 50;
+    int heroLevel = 0;          // 0 = same level as the monster
+    int threads = 0;            // 0 = all cores
+    float healBelow = 0.3f;
+    int specialAt = 3;
+    float blockSuccessRate = 0.5f;
+    uint64_t seed = 0;
+    bool json = false;
+    bool batchKernel = false;   // BatchBattles instead of runBattle(); needs healBelow = 0
+};
+
+// A fresh hero with the starting kit, levelled up to the requested level
+Hero makeLevelledHero(int level, BattleContext& ctx) {
+    Hero player("Balance Hero");
+    player.setContext(ctx);
+    giveStartingItems(player);
+    if (level > player.getNiveau()) {
+        player.addXP((level - player.getNiveau()) * 100.0f);
+    }
+    return player;
+}
+
+// Lockstep structure-of-arrays battle kernel for balance sweeps.
+// Battle k replays exactly what runBattle() does with Rng(seed, firstStream + k) for a
+// ScriptedPolicy with healBelow = 0 (attack, special move at specialAt+ combo points, no items,
+// no blocking). Each round advances every lane at once, four lanes per AVX2 step when the CPU
+// has it, one lane at a time otherwise; both paths produce identical results. Lanes are
+// refilled with the next battle as soon as theirs ends.
+class BatchBattles {
+public:
+    static const int MAX_MOVES = 4;  // move tables fill one SSE register
+
+private:
+    size_t width;
+    int specialAt;
+    int maxTurns;
+    
+    // Shared by every lane
+    float heroPA, heroPVStart, heroSpecialBonus;
+    float heroMoves[MAX_MOVES];    // padded with the last move
+    int heroMoveCount;
+    float heroTypeMultiplier;      // hero element vs monster element
+    float monsterPA, monsterPVStart;
+    float monsterMoves[MAX_MOVES]; // padded with the last move
+    int monsterMoveCount;
+    float monsterTypeMultiplier;   // monster element vs hero element
+    int monsterEffect;             // EffectId applied by the monster's special moves, -1 for none
+    int monsterEffectDuration;
+    float effectDamage[size_t(EffectId::COUNT)];
+    
+    // Per lane
+    vector<uint64_t> s0, s1, s2, s3;  // xoshiro256** state
+    vector<float> heroPV, monsterPV, heroEffectDamage;
+    vector<int32_t> heroCombo, turns, active;  // active is 0 or -1
+    vector<int32_t> effectDuration[size_t(EffectId::COUNT)];
+    vector<int64_t> battleOf;
+    vector<uint32_t> finished;  // lanes whose battle ended this round
+    
+    uint64_t seed, firstStream;
+    
+    // Scalar xoshiro256** step for lane i, applied only when take is set; returns a value in [0, n)
+    uint32_t draw(size_t i, bool take, uint32_t n) {
+        uint64_t a = s0[i], b = s1[i], c = s2[i], d = s3[i];
+        uint64_t result = ((b * 5) << 7 | (b * 5) >> 57) * 9;
+        uint64_t t = b << 17;
+        c ^= a;
+        d ^= b;
+        b ^= c;
+        a ^= d;
+        c ^= t;
+        d = (d << 45) | (d >> 19);
+        if (take) {
+            s0[i] = a;
+            s1[i] = b;
+            s2[i] = c;
+            s3[i] = d;
+        }
+        return uint32_t((uint64_t(uint32_t(result >> 32)) * n) >> 32);
+    }
+    
+    void roundScalar() {
+        for (size_t i = 0; i < width; i++) {
+            bool live = active[i];
+            
+            // Hero: special move at specialAt+ combo points, otherwise a basic attack
+            bool special = heroCombo[i] >= specialAt;
+            uint32_t variance = draw(i, live && !special, 10);
+            float attack = heroPA * (1.0f + float(variance) / 10.0f);
+            int move = max(min(heroCombo[i] - 3, heroMoveCount - 1), 0);
+            float specialDamage = heroPA * heroMoves[move] * heroSpecialBonus;
+            float damage = (special ? specialDamage : attack) * (heroTypeMultiplier * heroEffectDamage[i]);
+            uint32_t dodge = draw(i, live, 4);
+            if (live && dodge > 1) monsterPV[i] = monsterPV[i] - damage;
+            if (live) heroCombo[i] = special ? 0 : heroCombo[i] + 1;
+            
+            // Monster: 25% special move with its status effect, otherwise a basic attack
+            live = live && monsterPV[i] > 0;
+            bool monsterSpecial = draw(i, live, 4) == 0;
+            bool hasMove = monsterMoveCount > 0;
+            uint32_t roll = draw(i, live && (!monsterSpecial || hasMove), monsterSpecial ? max(monsterMoveCount, 1) : 10);
+            attack = monsterPA * (1.0f + float(roll) / 10.0f);
+            specialDamage = hasMove ? monsterPA * monsterMoves[min(roll, 3u)] : 0.0f;
+            damage = (monsterSpecial ? specialDamage : attack) * monsterTypeMultiplier;
+            if (live) heroPV[i] = heroPV[i] - damage;
+            if (live && monsterSpecial && monsterEffect >= 0) effectDuration[monsterEffect][i] = monsterEffectDuration;
+            
+            // End of round: status effects tick down
+            float product = 1.0f;
+            for (size_t e = 0; e < size_t(EffectId::COUNT); e++) {
+                int32_t& duration = effectDuration[e][i];
+                if (live && duration > 0) duration--;
+                if (duration > 0) product *= effectDamage[e];
+            }
+            heroEffectDamage[i] = product;
+            
+            bool wasActive = active[i];
+            turns[i] -= active[i];
+            active[i] = (wasActive && monsterPV[i] > 0 && heroPV[i] > 0 && turns[i] < maxTurns) ? -1 : 0;
+            if (wasActive && !active[i]) finished.push_back(i);
+        }
+    }
+    
+#if defined(__x86_64__)
+    __attribute__((target("avx2")))
+    static __m256i rotl64(__m256i x, int k) {
+        return _mm256_or_si256(_mm256_slli_epi64(x, k), _mm256_srli_epi64(x, 64 - k));
+    }
+    
+    // Four xoshiro256** steps at once; lanes outside take keep their state
+    __attribute__((target("avx2")))
+    static __m128i draw4(__m256i& a, __m256i& b, __m256i& c, __m256i& d, __m128i take, __m128i n) {
+        __m256i x = rotl64(_mm256_add_epi64(b, _mm256_slli_epi64(b, 2)), 7);
+        __m256i result = _mm256_add_epi64(x, _mm256_slli_epi64(x, 3));
+        __m256i t = _mm256_slli_epi64(b, 17);
+        __m256i c2 = _mm256_xor_si256(c, a);
+        __m256i d2 = _mm256_xor_si256(d, b);
+        __m256i b2 = _mm256_xor_si256(b, c2);
+        __m256i a2 = _mm256_xor_si256(a, d2);
+        c2 = _mm256_xor_si256(c2, t);
+        d2 = rotl64(d2, 45);
+        
+        __m256i take64 = _mm256_cvtepi32_epi64(take);
+        a = _mm256_blendv_epi8(a, a2, take64);
+        b = _mm256_blendv_epi8(b, b2, take64);
+        c = _mm256_blendv_epi8(c, c2, take64);
+        d = _mm256_blendv_epi8(d, d2, take64);
+        
+        __m256i scaled = _mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(result, 32), _mm256_cvtepu32_epi64(n)), 32);
+        __m256i packed = _mm256_permutevar8x32_epi32(scaled, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6));
+        return _mm256_castsi256_si128(packed);
+    }
+    
+    __attribute__((target("avx2")))
+    void roundAVX2() {
+        const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), ten = _mm_set1_ps(10.0f);
+        const __m128i ones = _mm_set1_epi32(-1);
+        const __m128 heroMoveTable = _mm_loadu_ps(heroMoves);
+        const __m128 monsterMoveTable = _mm_loadu_ps(monsterMoves);
+        const __m128i hasMove = _mm_set1_epi32(monsterMoveCount > 0 ? -1 : 0);
+        
+        for (size_t i = 0; i < width; i += 4) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)&s0[i]);
+            __m256i b = _mm256_loadu_si256((const __m256i*)&s1[i]);
+            __m256i c = _mm256_loadu_si256((const __m256i*)&s2[i]);
+            __m256i d = _mm256_loadu_si256((const __m256i*)&s3[i]);
+            __m128i live = _mm_loadu_si128((const __m128i*)&active[i]);
+            __m128i combo = _mm_loadu_si128((const __m128i*)&heroCombo[i]);
+            __m128 hp = _mm_loadu_ps(&heroPV[i]);
+            __m128 mp = _mm_loadu_ps(&monsterPV[i]);
+            __m128 heroEffect = _mm_loadu_ps(&heroEffectDamage[i]);
+            
+            // Hero
+            __m128i special = _mm_cmpgt_epi32(combo, _mm_set1_epi32(specialAt - 1));
+            __m128i variance = draw4(a, b, c, d, _mm_andnot_si128(special, live), _mm_set1_epi32(10));
+            __m128 attack = _mm_mul_ps(_mm_set1_ps(heroPA), _mm_add_ps(one, _mm_div_ps(_mm_cvtepi32_ps(variance), ten)));
+            __m128i move = _mm_max_epi32(_mm_min_epi32(_mm_sub_epi32(combo, _mm_set1_epi32(3)), _mm_set1_epi32(heroMoveCount - 1)), _mm_setzero_si128());
+            __m128 specialDamage = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(heroPA), _mm_permutevar_ps(heroMoveTable, move)), _mm_set1_ps(heroSpecialBonus));
+            __m128 damage = _mm_mul_ps(_mm_blendv_ps(attack, specialDamage, _mm_castsi128_ps(special)),
+                                       _mm_mul_ps(_mm_set1_ps(heroTypeMultiplier), heroEffect));
+            __m128i dodge = draw4(a, b, c, d, live, _mm_set1_epi32(4));
+            __m128i hit = _mm_and_si128(live, _mm_cmpgt_epi32(dodge, _mm_set1_epi32(1)));
+            mp = _mm_blendv_ps(mp, _mm_sub_ps(mp, damage), _mm_castsi128_ps(hit));
+            __m128i nextCombo = _mm_andnot_si128(special, _mm_sub_epi32(combo, ones));
+            combo = _mm_blendv_epi8(combo, nextCombo, live);
+            
+            // Monster
+            live = _mm_and_si128(live, _mm_castps_si128(_mm_cmpgt_ps(mp, zero)));
+            __m128i monsterSpecial = _mm_cmpeq_epi32(draw4(a, b, c, d, live, _mm_set1_epi32(4)), _mm_setzero_si128());
+            __m128i bound = _mm_blendv_epi8(_mm_set1_epi32(10), _mm_set1_epi32(max(monsterMoveCount, 1)), monsterSpecial);
+            __m128i takeRoll = _mm_and_si128(live, _mm_or_si128(_mm_andnot_si128(monsterSpecial, ones), hasMove));
+            __m128i roll = draw4(a, b, c, d, takeRoll, bound);
+            attack = _mm_mul_ps(_mm_set1_ps(monsterPA), _mm_add_ps(one, _mm_div_ps(_mm_cvtepi32_ps(roll), ten)));
+            specialDamage = _mm_and_ps(_mm_mul_ps(_mm_set1_ps(monsterPA), _mm_permutevar_ps(monsterMoveTable, _mm_min_epu32(roll, _mm_set1_epi32(3)))),
+                                       _mm_castsi128_ps(hasMove));
+            damage = _mm_mul_ps(_mm_blendv_ps(attack, specialDamage, _mm_castsi128_ps(monsterSpecial)), _mm_set1_ps(monsterTypeMultiplier));
+            hp = _mm_blendv_ps(hp, _mm_sub_ps(hp, damage), _mm_castsi128_ps(live));
+            if (monsterEffect >= 0) {
+                int32_t* slot = &effectDuration[monsterEffect][i];
+                __m128i duration = _mm_loadu_si128((const __m128i*)slot);
+                duration = _mm_blendv_epi8(duration, _mm_set1_epi32(monsterEffectDuration), _mm_and_si128(live, monsterSpecial));
+                _mm_storeu_si128((__m128i*)slot, duration);
+            }
+            
+            // End of round
+            __m128 product = one;
+            for (size_t e = 0; e < size_t(EffectId::COUNT); e++) {
+                int32_t* slot = &effectDuration[e][i];
+                __m128i duration = _mm_loadu_si128((const __m128i*)slot);
+                duration = _mm_add_epi32(duration, _mm_and_si128(live, _mm_cmpgt_epi32(duration, _mm_setzero_si128())));
+                _mm_storeu_si128((__m128i*)slot, duration);
+                __m128 stillActive = _mm_castsi128_ps(_mm_cmpgt_epi32(duration, _mm_setzero_si128()));
+                product = _mm_blendv_ps(product, _mm_mul_ps(product, _mm_set1_ps(effectDamage[e])), stillActive);
+            }
+            
+            __m128i wasActive = _mm_loadu_si128((const __m128i*)&active[i]);
+            __m128i turnCount = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)&turns[i]), wasActive);
+            __m128i stillActive = _mm_and_si128(wasActive, _mm_and_si128(
+                _mm_castps_si128(_mm_and_ps(_mm_cmpgt_ps(mp, zero), _mm_cmpgt_ps(hp, zero))),
+                _mm_cmplt_epi32(turnCount, _mm_set1_epi32(maxTurns))));
+            
+            _mm256_storeu_si256((__m256i*)&s0[i], a);
+            _mm256_storeu_si256((__m256i*)&s1[i], b);
+            _mm256_storeu_si256((__m256i*)&s2[i], c);
+            _mm256_storeu_si256((__m256i*)&s3[i], d);
+            _mm_storeu_si128((__m128i*)&heroCombo[i], combo);
+            _mm_storeu_ps(&heroPV[i], hp);
+            _mm_storeu_ps(&monsterPV[i], mp);
+            _mm_storeu_ps(&heroEffectDamage[i], product);
+            _mm_storeu_si128((__m128i*)&turns[i], turnCount);
+            _mm_storeu_si128((__m128i*)&active[i], stillActive);
+            
+            int ended = _mm_movemask_ps(_mm_castsi128_ps(_mm_andnot_si128(stillActive, wasActive)));
+            for (; ended; ended &= ended - 1) finished.push_back(i + __builtin_ctz(ended));
+        }
+    }
+#endif
+    
+    void startBattle(size_t lane, int64_t battle) {
+        uint64_t state[4];
+        Rng(seed, firstStream + battle).saveState(state);
+        s0[lane] = state[0];
+        s1[lane] = state[1];
+        s2[lane] = state[2];
+        s3[lane] = state[3];
+        heroPV[lane] = heroPVStart;
+        monsterPV[lane] = monsterPVStart;
+        heroEffectDamage[lane] = 1.0f;
+        heroCombo[lane] = 0;
+        turns[lane] = 0;
+        active[lane] = -1;
+        for (auto& duration : effectDuration) duration[lane] = 0;
+        battleOf[lane] = battle;
+    }
+
+public:
+    // hero must have no active effects or item buffs
+    BatchBattles(const MonsterTemplate& templ, int level, const Hero& hero, int specialAt = 3, size_t lanes = 256)
+        : width((max<size_t>(lanes, 4) + 3) & ~size_t(3)), specialAt(max(specialAt, 3)), maxTurns(1000) {
+        heroPA = hero.getPA();
+        heroPVStart = hero.getPV();
+        heroSpecialBonus = 1.0f + float(hero.getSuccessfulBlocks()) / 10.0f;
+        const auto& moves = hero.getHeroSpecialMoves();
+        heroMoveCount = min<int>(moves.size(), MAX_MOVES);
+        for (int m = 0; m < MAX_MOVES; m++) heroMoves[m] = heroMoveCount ? content.moves[moves[min(m, heroMoveCount - 1)]].multiplier : 0.0f;
+        heroTypeMultiplier = effectiveness(hero.getType(), templ.type);
+        
+        Creature monster(templ, level);
+        monsterPA = monster.getPA();
+        monsterPVStart = monster.getPV();
+        monsterMoveCount = min<int>(templ.specialMoves.size(), MAX_MOVES);
+        for (int m = 0; m < MAX_MOVES; m++) monsterMoves[m] = monsterMoveCount ? content.moves[templ.specialMoves[min(m, monsterMoveCount - 1)]].multiplier : 0.0f;
+        monsterTypeMultiplier = effectiveness(templ.type, hero.getType());
+        
+        // The same effects Creature::performSpecialMove applies
+        StatusEffect effect = elementEffect(templ.type);
+        monsterEffect = effect.id != EffectId::COUNT && monsterMoveCount > 0 ? int(effect.id) : -1;
+        monsterEffectDuration = effect.duration;
+        fill(begin(effectDamage), end(effectDamage), 1.0f);
+        for (size_t t = 0; t < ELEMENT_COUNT; t++) {
+            StatusEffect other = elementEffect(MonsterType(t));
+            if (other.id != EffectId::COUNT) effectDamage[size_t(other.id)] = other.damageMultiplier;
+        }
+        
+        for (auto* lane : {&s0, &s1, &s2, &s3}) lane->resize(width);
+        for (auto* lane : {&heroPV, &monsterPV, &heroEffectDamage}) lane->resize(width);
+        for (auto* lane : {&heroCombo, &turns, &active}) lane->resize(width);
+        for (auto& lane : effectDuration) lane.resize(width);
+        battleOf.resize(width);
+        finished.reserve(width);
+    }
+    
+    // The kernel replays the rules only for packs with at most MAX_MOVES special moves
+    // per side; error names the first entry with more
+    static bool supportsContent(string& error) {
+        if (content.heroMoves.size() > size_t(MAX_MOVES)) {
+            error = "the hero has " + to_string(content.heroMoves.size()) + " special moves";
+            return false;
+        }
+        for (const MonsterTemplate& monster : content.monsters) {
+            if (monster.specialMoves.size() <= size_t(MAX_MOVES)) continue;
+            error = content.names[monster.name] + " has " + to_string(monster.specialMoves.size()) + " special moves";
+            return false;
+        }
+        return true;
+    }
+    
+    static bool simdAvailable() {
+#if defined(__x86_64__)
+        return __builtin_cpu_supports("avx2");
+#else
+        return false;
+#endif
+    }
+    
+    // Plays count battles, battle k drawing from Rng(seed, firstStream + k)
+    vector<BattleResult> run(uint64_t seed, uint64_t firstStream, size_t count, bool simd = true) {
+        this->seed = seed;
+        this->firstStream = firstStream;
+        simd = simd && simdAvailable();
+        
+        vector<BattleResult> results(count);
+        size_t next = 0, running = 0;
+        for (size_t lane = 0; lane < width; lane++) {
+            if (next < count) {
+                startBattle(lane, next++);
+                running++;
+            } else {
+                active[lane] = 0;
+                battleOf[lane] = -1;
+            }
+        }
+        
+        while (running > 0) {
+            finished.clear();
+#if defined(__x86_64__)
+            if (simd) roundAVX2();
+            else roundScalar();
+#else
+            roundScalar();
+#endif
+            for (uint32_t lane : finished) {
+                bool won = monsterPV[lane] <= 0 && heroPV[lane] > 0;
+                results[battleOf[lane]] = {won, false, turns[lane], heroPV[lane]};
+                if (next < count) startBattle(lane, next++);
+                else running--;
+            }
+        }
+        return results;
+    }
+};
+
+// Runs the same battles through runBattle() and both batch kernel paths and compares them
+int runBatchComparison(size_t battlesPerCell, uint64_t seed) {
+    string error;
+    if (!BatchBattles::supportsContent(error)) {
+        cerr << "The batch kernel supports at most " << BatchBattles::MAX_MOVES << " special moves per side: " << error << "\n";
+        return 1;
+    }
+    NullSink sink;
+    BattleContext ctx = {&sink, scriptedBlock, 0.0f, Rng()};
+    ScriptedPolicy policy;
+    policy.healBelow = 0.0f;
+    double objectSeconds = 0.0, scalarSeconds = 0.0, simdSeconds = 0.0;
+    size_t battles = 0, mismatches = 0;
+    
+    auto same = [](const BattleResult& x, const BattleResult& y) {
+        return x.heroWon == y.heroWon && x.turns == y.turns && x.heroPV == y.heroPV;
+    };
+    
+    for (size_t m = 0; m < content.monsters.size(); m++) {
+        for (int level = 1; level <= 10; level++) {
+            Hero prototype = makeLevelledHero(level, ctx);
+            uint64_t firstStream = (m * 10 + level) * battlesPerCell;
+            
+            vector<BattleResult> expected(battlesPerCell);
+            auto start = chrono::steady_clock::now();
+            for (size_t i = 0; i < battlesPerCell; i++) {
+                ctx.rng.reseed(seed, firstStream + i);
+                Hero player = prototype;
+                Creature monster(content.monsters[m], level);
+                monster.setContext(ctx);
+                expected[i] = runBattle(player, monster, policy);
+            }
+            objectSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            
+            BatchBattles batch(content.monsters[m], level, prototype);
+            start = chrono::steady_clock::now();
+            vector<BattleResult> scalar = batch.run(seed, firstStream, battlesPerCell, false);
+            scalarSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            start = chrono::steady_clock::now();
+            vector<BattleResult> simd = batch.run(seed, firstStream, battlesPerCell, true);
+            simdSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            
+            for (size_t i = 0; i < battlesPerCell; i++) {
+                if (!same(scalar[i], expected[i]) || !same(simd[i], expected[i])) mismatches++;
+            }
+            battles += battlesPerCell;
+        }
+    }
+    
+    cout << fixed << setprecision(0)
+         << "Object engine:        " << battles / objectSeconds << " battles/s\n"
+         << "Batch kernel, scalar: " << battles / scalarSeconds << " battles/s\n"
+         << "Batch kernel, " << (BatchBattles::simdAvailable() ? "AVX2:   " : "scalar: ") << battles / simdSeconds << " battles/s\n"
+         << "Mismatching battles: " << mismatches << " of " << battles << "\n";
+    return mismatches == 0 ? 0 : 1;
+}
+
+void writeBalanceCSV(ostream& out, const vector<CellStats>& cells, int maxLevel) {
+    out << "monster,type,level,battles,win_rate,escape_rate,turns_mean,turns_p10,turns_p50,turns_p90,hp_left_mean\n";
+    out << fixed << setprecision(4);
+    for (size_t m = 0; m < content.monsters.size(); m++) {
+        for (int level = 1; level <= maxLevel; level++) {
+            const CellStats& c = cells[m * maxLevel + level - 1];
+            out << content.names[content.monsters[m].name] << "," << content.elementName(content.monsters[m].type) << ","
+                << level << "," << c.battles << ","
+                << double(c.wins) / c.battles << "," << double(c.escapes) / c.battles << ","
+                << double(c.turns) / c.battles << ","
+                << c.turnPercentile(0.1) << "," << c.turnPercentile(0.5) << "," << c.turnPercentile(0.9) << ","
+                << (c.wins ? c.hpLeft / c.wins : 0.0) << "\n";
+        }
+    }
+}
+
+void writeBalanceJSON(ostream& out, const vector<CellStats>& cells, int maxLevel) {
+    out << fixed << setprecision(4) << "[\n";
+    for (size_t m = 0; m < content.monsters.size(); m++) {
+        for (int level = 1; level <= maxLevel; level++) {
+            const CellStats& c = cells[m * maxLevel + level - 1];
+            out << "  {\"monster\": \"" << content.names[content.monsters[m].name] << "\", \"type\": \""
+                << content.elementName(content.monsters[m].type) << "\", \"level\": " << level
+                << ", \"battles\": " << c.battles
+                << ", \"win_rate\": " << double(c.wins) / c.battles
+                << ", \"escape_rate\": " << double(c.escapes) / c.battles
+                << ", \"turns_mean\": " << double(c.turns) / c.battles
+                << ", \"hp_left_mean\": " << (c.wins ? c.hpLeft / c.wins : 0.0)
+                << ", \"turns_histogram\": [";
+            for (int i = 0; i < CellStats::TURN_BINS; i++) out << (i ? ", " : "") << c.turnHistogram[i];
+            out << "], \"hp_left_histogram\": [";
+            for (int i = 0; i < CellStats::HP_BINS; i++) out << (i ? ", " : "") << c.hpHistogram[i];
+            bool last = m + 1 == content.monsters.size() && level == maxLevel;
+            out << "]}" << (last ? "\n" : ",\n");
+        }
+    }
+    out << "]\n";
+}
+
+// Monte Carlo sweep of the hero against every monster template at levels 1..maxLevel.
+// Battle i of a cell always uses RNG stream (seed, cell * battlesPerCell + i), so the
+// matrix is identical whatever the thread count.
+int runBalance(const BalanceConfig& config, ostream& out) {
+    int threads = config.threads > 0 ? config.threads : max(1u, thread::hardware_concurrency());
+    int cellCount = content.monsters.size() * config.maxLevel;
+    const int chunk = 250;  // battles per task
+
+    vector<vector<CellStats>> perWorker(threads, vector<CellStats>(cellCount));
+    WorkStealingPool pool(threads);
+    
+    for (int cell = 0; cell < cellCount; cell++) {
+        for (int first = 0; first < config.battlesPerCell; first += chunk) {
+            int last = min(first + chunk, config.battlesPerCell);
+            pool.submit([&, cell, first, last](int worker) {
+                NullSink sink;
+                BattleContext ctx = {&sink, scriptedBlock, config.blockSuccessRate, Rng()};
+                ScriptedPolicy policy;
+                policy.healBelow = config.healBelow;
+                policy.specialAt = config.specialAt;
+                
+                const MonsterTemplate& templ = content.monsters[cell / config.maxLevel];
+                int level = cell % config.maxLevel + 1;
+                Hero prototype = makeLevelledHero(config.heroLevel > 0 ? config.heroLevel : level, ctx);
+                CellStats& stats = perWorker[worker][cell];
+                
+                if (config.batchKernel) {
+                    BatchBattles batch(templ, level, prototype, config.specialAt);
+                    uint64_t firstStream = uint64_t(cell) * config.battlesPerCell + first;
+                    for (const auto& result : batch.run(config.seed, firstStream, last - first)) {
+                        stats.add(result, prototype.getPVMax());
+                    }
+                    return;
+                }
+                
+                for (int i = first; i < last; i++) {
+                    ctx.rng.reseed(config.seed, uint64_t(cell) * config.battlesPerCell + i);
+                    Hero player = prototype;
+                    Creature monster(templ, level);
+                    monster.setContext(ctx);
+                    stats.add(runBattle(player, monster, policy), player.getPVMax());
+                }
+            });
+        }
+    }
+    
+    auto start = chrono::steady_clock::now();
+    pool.run();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    
+    vector<CellStats> cells(cellCount);
+    for (const auto& worker : perWorker) {
+        for (int cell = 0; cell < cellCount; cell++) cells[cell].merge(worker[cell]);
+    }
+    
+    if (config.json) writeBalanceJSON(out, cells, config.maxLevel);
+    else writeBalanceCSV(out, cells, config.maxLevel);
+    
+    long long total = (long long)cellCount * config.battlesPerCell;
+    cerr << "Simulated " << total << " battles on " << threads << " threads in " << seconds << "s ("
+         << fixed << setprecision(0) << total / seconds << " battles/s)\n";
+    return 0;
+}
+
+struct TunerConfig {
+    int generations = 30;
+    int population = 24;
+    int battlesPerCell = 200;
+    int levels = 10;            // hero levels 1..levels, each against every monster of its level
+    int threads = 0;            // 0 = all cores
+    int extraItems = 1;         // of each item missing from the starting kit, so buffs get tuned too
+    float winFirst = 0.95f, winLast = 0.75f;     // target win rate at level 1 and at the last level
+    float turnsFirst = 6.0f, turnsLast = 10.0f;  // target mean battle length, in rounds
+    float turnsWeight = 0.25f;  // weight of the relative battle length error against the win rate one
+    float mutation = 0.15f;     // log-normal sigma of a mutated gene
+    float blockSuccessRate = 0.5f;
+    uint64_t seed = 0;
+};
+
+// Genetic search over the content pack's numbers: monster base HP and attack, monster
+// move multipliers, level scaling and the heal/buff values of the items the hero carries.
+// Candidates are played one after the other, each over battles spread on every core,
+// and every candidate of a generation meets the same dice (battle i of cell c uses
+// stream (generation, c, i)), so differences in fitness come from the parameters.
+class BalanceTuner {
+public:
+    // A tuned number in the global content pack, with the range it is kept in
+    struct Parameter {
+        float* value;
+        float low, high;
+        string label;
+    };
+
+    // Per hero level, averaged over the monsters
+    struct LevelResult {
+        double winRate = 0.0, turns = 0.0;
+    };
+
+private:
+    const TunerConfig& config;
+    vector<Parameter> parameters;
+    size_t cellCount;
+
+    float targetWin(int level) const {
+        float t = config.levels > 1 ? float(level - 1) / (config.levels - 1) : 0.0f;
+        return config.winFirst + (config.winLast - config.winFirst) * t;
+    }
+
+    float targetTurns(int level) const {
+        float t = config.levels > 1 ? float(level - 1) / (config.levels - 1) : 0.0f;
+        return config.turnsFirst + (config.turnsLast - config.turnsFirst) * t;
+    }
+
+    void add(float& value, float low, float high, string label) {
+        parameters.push_back({&value, low, high, move(label)});
+    }
+
+    // Kit of the tuning hero: the starting items plus extraItems of every other item
+    vector<int> kit() const {
+        vector<int> counts(content.items.size(), config.extraItems);
+        for (const auto& [item, quantity] : content.startingItems) counts[item] = quantity;
+        return counts;
+    }
+
+public:
+    explicit BalanceTuner(const TunerConfig& config) : config(config), cellCount(content.monsters.size() * config.levels) {
+        for (MonsterTemplate& monster : content.monsters) {
+            const string& name = content.names[monster.name];
+            add(monster.baseHP, monster.baseHP / 4, monster.baseHP * 4, name + " HP");
+            add(monster.baseAttack, monster.baseAttack / 4, monster.baseAttack * 4, name + " attack");
+        }
+        // Monster moves only; the hero's special moves stay as designed
+        vector<bool> heroMove(content.moves.size());
+        for (MoveId id : content.heroMoves) heroMove[id] = true;
+        for (MoveId id = 0; id < content.moves.size(); id++) {
+            if (!heroMove[id]) add(content.moves[id].multiplier, 0.5f, 4.0f, content.moveName(id));
+        }
+        add(content.hpPerLevel, 0.05f, 2.0f, "HP per level");
+        add(content.attackPerLevel, 0.05f, 2.0f, "attack per level");
+        vector<int> counts = kit();
+        for (Item& item : content.items) {
+            if (counts[item.id] <= 0) continue;
+            const string& name = content.names[item.name];
+            if (item.healAmount > 0) add(item.healAmount, item.healAmount / 4, item.healAmount * 4, name + " heal");
+            if (item.attackBuff > 1) add(item.attackBuff, 1.0f, 3.0f, name + " attack buff");
+            // Beyond 2 the defense factor (2 - buff) would turn hits into healing
+            if (item.defenseBuff > 1) add(item.defenseBuff, 1.0f, 1.9f, name + " defense buff");
+        }
+    }
+
+    const vector<Parameter>& getParameters() const { return parameters; }
+
+    vector<float> current() const {
+        vector<float> genome;
+        for (const Parameter& p : parameters) genome.push_back(*p.value);
+        return genome;
+    }
+
+    void apply(const vector<float>& genome) const {
+        for (size_t i = 0; i < parameters.size(); i++) *parameters[i].value = genome[i];
+    }
+
+    // Plays every (monster, level) cell with the global content and returns the mean
+    // squared error against the target curves; levels gets the per-level averages
+    double evaluate(uint64_t round, vector<LevelResult>* levels = nullptr) const {
+        struct Cell {
+            int wins = 0;
+            long long turns = 0;
+        };
+        vector<Cell> cells(cellCount);
+        vector<int> counts = kit();
+        int threads = config.threads > 0 ? config.threads : max(1u, thread::hardware_concurrency());
+        WorkStealingPool pool(threads);
+        
+        for (size_t cell = 0; cell < cellCount; cell++) {
+            pool.submit([&, cell](int) {
+                NullSink sink;
+                BattleContext ctx = {&sink, scriptedBlock, config.blockSuccessRate, Rng()};
+                ScriptedPolicy policy;
+                policy.useBuffs = true;
+                const MonsterTemplate& templ = content.monsters[cell / config.levels];
+                int level = cell % config.levels + 1;
+                
+                Hero prototype("Tuning Hero");
+                prototype.setContext(ctx);
+                for (ItemId id = 0; id < counts.size(); id++) prototype.addItem(id, counts[id]);
+                if (level > 1) prototype.addXP((level - 1) * 100.0f);
+                
+                Cell& result = cells[cell];
+                uint64_t firstStream = (round * cellCount + cell) * config.battlesPerCell;
+                for (int i = 0; i < config.battlesPerCell; i++) {
+                    ctx.rng.reseed(config.seed, firstStream + i);
+                    Hero player = prototype;
+                    Creature monster(templ, level);
+                    monster.setContext(ctx);
+                    BattleResult battle = runBattle(player, monster, policy);
+                    result.wins += battle.heroWon;
+                    result.turns += battle.turns;
+                }
+            });
+        }
+        pool.run();
+        
+        if (levels) levels->assign(config.levels, LevelResult());
+        double error = 0.0;
+        for (size_t cell = 0; cell < cellCount; cell++) {
+            int level = cell % config.levels + 1;
+            double winRate = double(cells[cell].wins) / config.battlesPerCell;
+            double turns = double(cells[cell].turns) / config.battlesPerCell;
+            double turnsError = (turns - targetTurns(level)) / targetTurns(level);
+            error += (winRate - targetWin(level)) * (winRate - targetWin(level)) + config.turnsWeight * turnsError * turnsError;
+            if (levels) {
+                (*levels)[level - 1].winRate += winRate / content.monsters.size();
+                (*levels)[level - 1].turns += turns / content.monsters.size();
+            }
+        }
+        return error / cellCount;
+    }
+
+    void writeCurve(ostream& out, const vector<LevelResult>& levels) const {
+        out << fixed << setprecision(3) << "level,win_rate,target_win_rate,turns_mean,target_turns\n";
+        for (int level = 1; level <= config.levels; level++) {
+            out << level << "," << levels[level - 1].winRate << "," << targetWin(level) << ","
+                << levels[level - 1].turns << "," << targetTurns(level) << "\n";
+        }
+    }
+
+    // Elitist GA: the two best survive, the rest are uniform crossovers of tournament
+    // winners with each gene mutated by a log-normal factor at rate 1/5
+    vector<float> run(ostream& progress) {
+        Rng rng(config.seed, UINT64_MAX);
+        auto gaussian = [&] {
+            float u = max(rng.unit(), 1e-7f);
+            return sqrt(-2.0f * log(u)) * cos(6.2831853f * rng.unit());
+        };
+        auto mutate = [&](vector<float>& genome, float rate) {
+            for (size_t i = 0; i < genome.size(); i++) {
+                if (rng.unit() >= rate) continue;
+                genome[i] = clamp(genome[i] * exp(config.mutation * gaussian()), parameters[i].low, parameters[i].high);
+            }
+        };
+        
+        int size = max(config.population, 4);
+        vector<vector<float>> population(size, current());
+        for (int i = 1; i < size; i++) mutate(population[i], 1.0f);
+        vector<double> fitness(size);
+        vector<int> order(size);
+        
+        for (int generation = 0; generation < config.generations; generation++) {
+            auto start = chrono::steady_clock::now();
+            for (int i = 0; i < size; i++) {
+                apply(population[i]);
+                fitness[i] = evaluate(generation);
+            }
+            iota(order.begin(), order.end(), 0);
+            sort(order.begin(), order.end(), [&](int a, int b) { return fitness[a] < fitness[b]; });
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            progress << "Generation " << generation + 1 << ": best error " << fixed << setprecision(5) << fitness[order[0]]
+                << ", median " << fitness[order[size / 2]] << " (" << setprecision(2) << seconds << "s)\n";
+            
+            auto tournament = [&]() -> const vector<float>& {
+                int best = rng.below(size);
+                for (int k = 0; k < 2; k++) {
+                    int other = rng.below(size);
+                    if (fitness[other] < fitness[best]) best = other;
+                }
+                return population[best];
+            };
+            vector<vector<float>> next = {population[order[0]], population[order[1]]};
+            while (int(next.size()) < size) {
+                const vector<float>& a = tournament();
+                const vector<float>& b = tournament();
+                vector<float> child(a.size());
+                for (size_t i = 0; i < child.size(); i++) child[i] = rng.below(2) ? a[i] : b[i];
+                mutate(child, 0.2f);
+                next.push_back(move(child));
+            }
+            population = move(next);
+        }
+        // The best of the last generation; population[0] is it, carried over as the first elite
+        return population[0];
+    }
+};
+
+// Tunes the loaded content pack towards the target curves and writes the result as a
+// content pack; the curves before and after are measured on battles the search never saw
+int runTuner(const TunerConfig& config, ostream& out) {
+    BalanceTuner tuner(config);
+    vector<float> original = tuner.current();
+    const uint64_t holdout = config.generations;  // battle streams no generation used
+    
+    vector<BalanceTuner::LevelResult> levels;
+    double before = tuner.evaluate(holdout, &levels);
+    cerr << "Tuning " << tuner.getParameters().size() << " parameters over " << content.monsters.size() << " monsters x "
+         << config.levels << " levels x " << config.battlesPerCell << " battles, population " << config.population
+         << "\nBefore (error " << fixed << setprecision(5) << before << "):\n";
+    tuner.writeCurve(cerr, levels);
+    
+    auto start = chrono::steady_clock::now();
+    vector<float> best = tuner.run(cerr);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    tuner.apply(best);
+    double after = tuner.evaluate(holdout, &levels);
+    cerr << "After " << setprecision(1) << seconds << "s (error " << setprecision(5) << after << "):\n";
+    tuner.writeCurve(cerr, levels);
+    
+    cerr << "Changes:\n" << defaultfloat << setprecision(4);
+    for (size_t i = 0; i < best.size(); i++) {
+        if (best[i] != original[i]) cerr << "  " << tuner.getParameters()[i].label << ": " << original[i] << " -> " << best[i] << "\n";
+    }
+    writeContent(out, content);
+    return 0;
+}
+
+struct MctsConfig {
+    int iterations = 20000;   // rollouts per decision, shared by the workers
+    int thinkMs = 50;         // stop early at this deadline
+    int threads = 0;          // 0 = all cores
+    float exploration = 0.5f; // UCB1 constant
+    int maxRolloutTurns = 200;
+    uint64_t seed = 0;
+};
+
+// Monte Carlo tree search over the hero's actions, root-parallel: every worker grows
+// its own tree from a copy of the captured BattleState and the root visit counts are
+// summed. The tree is open-loop: nodes are action sequences, and each iteration
+// replays them on a state whose RNG is reseeded, which samples the dodge, damage,
+// special move and block outcomes. Rollouts follow the scripted policy.
+class MctsPolicy : public BattlePolicy {
+public:
+    // Action slots: the four plain actions, then one per item id
+    static const int PLAIN_ACTIONS = 4;
+    static const int ACTIONS = PLAIN_ACTIONS + STATE_MAX_ITEMS;
+
+    static HeroAction actionOf(int slot, ItemId& item) {
+        static const HeroAction plain[PLAIN_ACTIONS] = {HeroAction::ATTACK, HeroAction::SPECIAL,
+                                                        HeroAction::BLOCK, HeroAction::RUN};
+        if (slot < PLAIN_ACTIONS) return plain[slot];
+        item = slot - PLAIN_ACTIONS;
+        return HeroAction::ITEM;
+    }
+
+    // A special move without combo points and an item not held only waste the turn
+    static int legalActions(const BattleState& state, uint8_t* slots) {
+        int count = 0;
+        slots[count++] = 0;
+        if (state.hero.base.comboPoints >= 3) slots[count++] = 1;
+        slots[count++] = 2;
+        slots[count++] = 3;
+        for (size_t id = 0; id < min(STATE_MAX_ITEMS, content.items.size()); id++) {
+            if (state.hero.itemCounts[id] > 0) slots[count++] = PLAIN_ACTIONS + id;
+        }
+        return count;
+    }
+
+private:
+    struct Node {
+        uint32_t firstChild = 0;  // children are contiguous; 0 = not expanded
+        uint8_t childCount = 0;
+        uint8_t action = 0;
+        uint32_t visits = 0;
+        float value = 0.0f;       // sum of rewards
+    };
+
+    MctsConfig config;
+    int threads;
+    vector<vector<Node>> trees;  // one per worker, reused across decisions
+    uint64_t decisions = 0;
+
+    // HP carries over to the next battle, so a win with more HP left is worth more;
+    // running away keeps the hero alive but earns nothing
+    static float reward(BattleOutcome outcome, const BattleState& state) {
+        float hp = max(state.hero.base.pv, 0.0f) / state.hero.base.pv_max;
+        switch (outcome) {
+            case BattleOutcome::WON: return 0.5f + 0.5f * hp;
+            case BattleOutcome::ESCAPED: return 0.25f * hp;
+            default: return 0.0f;
+        }
+    }
+
+    static BattleOutcome step(BattleState& state, int slot) {
+        ItemId item = 0;
+        HeroAction action = actionOf(slot, item);
+        return state.round(action, item);
+    }
+
+    // The scripted policy's choices: heal below 30% HP, special at 3 combo points
+    BattleOutcome rollout(BattleState& state) const {
+        for (int turn = 0; turn < config.maxRolloutTurns; turn++) {
+            const HeroState& hero = state.hero;
+            int slot = hero.base.comboPoints >= 3 ? 1 : 0;
+            if (hero.base.pv < hero.base.pv_max * 0.3f) {
+                for (size_t id = 0; id < min(STATE_MAX_ITEMS, content.items.size()); id++) {
+                    if (hero.itemCounts[id] > 0 && content.items[id].healAmount > 0) {
+                        slot = PLAIN_ACTIONS + id;
+                        break;
+                    }
+                }
+            }
+            BattleOutcome outcome = step(state, slot);
+            if (outcome != BattleOutcome::ONGOING) return outcome;
+        }
+        return BattleOutcome::ONGOING;
+    }
+
+    uint32_t select(const vector<Node>& tree, const Node& parent) const {
+        float logVisits = log(float(parent.visits));
+        uint32_t best = parent.firstChild;
+        float bestScore = -1.0f;
+        for (uint32_t c = parent.firstChild; c < parent.firstChild + parent.childCount; c++) {
+            const Node& child = tree[c];
+            if (child.visits == 0) return c;
+            float score = child.value / child.visits + config.exploration * sqrt(logVisits / child.visits);
+            if (score > bestScore) {
+                bestScore = score;
+                best = c;
+            }
+        }
+        return best;
+    }
+
+    void search(vector<Node>& tree, const BattleState& root, uint64_t stream, int iterations,
+                chrono::steady_clock::time_point deadline) const {
+        tree.clear();
+        tree.emplace_back();
+        uint32_t path[1024];
+        for (int i = 0; i < iterations; i++) {
+            if ((i & 63) == 0 && i > 0 && chrono::steady_clock::now() >= deadline) break;
+            BattleState state = root;
+            state.rng.reseed(config.seed ^ stream, i);
+            
+            int depth = 0;
+            uint32_t node = 0;
+            path[depth++] = node;
+            BattleOutcome outcome = BattleOutcome::ONGOING;
+            while (outcome == BattleOutcome::ONGOING && depth < 1024) {
+                if (tree[node].firstChild == 0) {
+                    uint8_t slots[ACTIONS];
+                    int count = legalActions(state, slots);
+                    uint32_t first = tree.size();
+                    for (int c = 0; c < count; c++) {
+                        tree.emplace_back();
+                        tree.back().action = slots[c];
+                    }
+                    tree[node].firstChild = first;
+                    tree[node].childCount = count;
+                }
+                uint32_t child = select(tree, tree[node]);
+                bool leaf = tree[child].visits == 0;
+                outcome = step(state, tree[child].action);
+                node = child;
+                path[depth++] = node;
+                if (leaf) break;
+            }
+            if (outcome == BattleOutcome::ONGOING) outcome = rollout(state);
+            
+            float value = reward(outcome, state);
+            for (int d = 0; d < depth; d++) {
+                tree[path[d]].visits++;
+                tree[path[d]].value += value;
+            }
+        }
+    }
+
+public:
+    explicit MctsPolicy(const MctsConfig& config)
+        : config(config), threads(config.threads > 0 ? config.threads : max(1u, thread::hardware_concurrency())),
+          trees(threads) {}
+
+    // The most visited root action over all workers
+    HeroAction choose(const Hero& player, const Creature& monster, ItemId& item) override {
+        BattleState root = captureBattle(player, monster);
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(config.thinkMs);
+        uint64_t decision = decisions++;
+        
+        WorkStealingPool pool(threads);
+        for (int w = 0; w < threads; w++) {
+            int iterations = config.iterations / threads + (w < config.iterations % threads);
+            pool.submit([this, &root, w, iterations, decision, deadline](int) {
+                search(trees[w], root, decision * threads + w, iterations, deadline);
+            });
+        }
+        pool.run();
+        
+        uint32_t visits[ACTIONS] = {};
+        for (const auto& tree : trees) {
+            const Node& top = tree[0];
+            for (uint32_t c = top.firstChild; c < top.firstChild + top.childCount; c++) {
+                visits[tree[c].action] += tree[c].visits;
+            }
+        }
+        int best = int(max_element(visits, visits + ACTIONS) - visits);
+        return actionOf(best, item);
+    }
+};
+
+// Same fields, RNG included: the search model and the rules agree on this turn
+bool sameBattle(const BattleState& a, const BattleState& b) {
+    auto sameCreature = [](const CreatureState& x, const CreatureState& y) {
+        if (x.pv != y.pv || x.pv_max != y.pv_max || x.pa != y.pa || x.comboPoints != y.comboPoints ||
+            x.effectMask != y.effectMask || x.effectDamageMultiplier != y.effectDamageMultiplier ||
+            x.effectDefenseMultiplier != y.effectDefenseMultiplier) return false;
+        for (unsigned mask = x.effectMask; mask; mask &= mask - 1) {
+            if (x.effectTurnsLeft(__builtin_ctz(mask)) != y.effectTurnsLeft(__builtin_ctz(mask))) return false;
+        }
+        return true;
+    };
+    if (!sameCreature(a.hero.base, b.hero.base) || !sameCreature(a.monster, b.monster)) return false;
+    if (a.hero.isBlocking != b.hero.isBlocking || a.hero.successfulBlocks != b.hero.successfulBlocks ||
+        a.hero.buffCount != b.hero.buffCount || a.hero.buffAttack != b.hero.buffAttack ||
+        a.hero.buffDefense != b.hero.buffDefense) return false;
+    for (int i = 0; i < a.hero.buffCount; i++) {
+        if (a.hero.buffs[i].id != b.hero.buffs[i].id || a.hero.buffTurnsLeft(i) != b.hero.buffTurnsLeft(i)) return false;
+    }
+    if (!equal(begin(a.hero.itemCounts), end(a.hero.itemCounts), begin(b.hero.itemCounts))) return false;
+    uint64_t x[4], y[4];
+    a.rng.saveState(x);
+    b.rng.saveState(y);
+    return equal(x, x + 4, y);
+}
+
+// A --sim style run played by the search agent. Every real turn is also stepped on
+// the captured BattleState; a mismatch means the two copies of the rules drifted apart.
+int runMcts(int battles, uint64_t seed, const MctsConfig& config) {
+    CountingSink counter;
+    BattleContext ctx = {&counter, scriptedBlock, 0.5f, Rng(seed)};
+    MctsPolicy agent(config);
+    
+    Hero player("MCTS Hero");
+    player.setContext(ctx);
+    giveStartingItems(player);
+    
+    int monstersDefeated = 0;
+    int victories = 0, deaths = 0, escapes = 0;
+    long long turns = 0, mismatches = 0;
+    double thinkTotal = 0, thinkMax = 0;
+    
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < battles; i++) {
+        int monsterIndex = ctx.rng.below(content.monsters.size());
+        int monsterLevel = 1 + (monstersDefeated / 3);
+        Creature monster(content.monsters[monsterIndex], monsterLevel);
+        monster.setContext(ctx);
+        countStat(Counter::BATTLES);
+        
+        bool escaped = false;
+        for (int turn = 0; turn < 1000 && monster.estVivant() && player.estVivant(); turn++) {
+            auto thinkStart = chrono::steady_clock::now();
+            ItemId item = 0;
+            HeroAction action = agent.choose(player, monster, item);
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - thinkStart).count();
+            thinkTotal += ms;
+            thinkMax = max(thinkMax, ms);
+            
+            BattleState predicted = captureBattle(player, monster);
+            predicted.round(action, item);
+            turns++;
+            countStat(Counter::TURNS);
+            if (!heroTurn(player, monster, action, item)) {
+                escaped = true;
+            } else if (monster.estVivant() && player.estVivant()) {
+                monsterTurn(player, monster);
+            }
+            if (!sameBattle(predicted, captureBattle(player, monster))) mismatches++;
+            if (escaped) break;
+        }
+        
+        if (!monster.estVivant() && player.estVivant()) {
+            claimVictory(player, monster);
+            monstersDefeated++;
+            victories++;
+        } else if (escaped) {
+            escapes++;
+        } else if (!player.estVivant()) {
+            deaths++;
+            player = Hero("MCTS Hero");
+            player.setContext(ctx);
+            giveStartingItems(player);
+            monstersDefeated = 0;
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    
+    cout << "MCTS agent played " << battles << " battles in " << seconds << "s ("
+         << config.iterations << " rollouts/decision)\n"
+         << "Victories: " << victories << ", Deaths: " << deaths << ", Escapes: " << escapes << "\n"
+         << "Turns: " << turns << ", Blocks: " << player.getSuccessfulBlocks() << " (current hero)\n"
+         << fixed << setprecision(2)
+         << "Decision time: " << (turns ? thinkTotal / turns : 0.0) << " ms mean, " << thinkMax << " ms max\n"
+         << "Model mismatches: " << mismatches << "\n";
+    return mismatches == 0 ? 0 : 1;
+}
+
+// Draws for walking every chance outcome of a round instead of sampling one: the
+// recorded choices are replayed, a new draw takes its first option, and next()
+// advances to the following path like an odometer. chance() has two options, and so
+// does unit(), which is only the block roll: success (blockRate) and failure.
+class ChanceTape {
+private:
+    static const int MAX_DRAWS = 16;
+    uint32_t choices[MAX_DRAWS];
+    uint32_t options[MAX_DRAWS];
+    int count = 0;
+    int pos = 0;
+    float blockRate;
+    double probability = 1.0;
+
+    uint32_t draw(uint32_t n) {
+        if (pos == count) {
+            choices[count] = 0;
+            options[count++] = n;
+        }
+        return choices[pos++];
+    }
+
+public:
+    explicit ChanceTape(float blockRate) : blockRate(blockRate) {}
+
+    uint32_t below(uint32_t n) {
+        probability /= n;
+        return draw(n);
+    }
+
+    bool chance(uint32_t k, uint32_t n) {
+        bool hit = draw(2) == 0;
+        probability *= hit ? double(k) / n : double(n - k) / n;
+        return hit;
+    }
+
+    float unit() {
+        bool success = draw(2) == 0;
+        probability *= success ? blockRate : 1.0f - blockRate;
+        return success ? 0.0f : 1.0f;
+    }
+
+    double pathProbability() const { return probability; }
+
+    // False once every path has been taken
+    bool next() {
+        count = pos;
+        while (count > 0 && ++choices[count - 1] == options[count - 1]) count--;
+        pos = 0;
+        probability = 1.0;
+        return count > 0;
+    }
+};
+
+// A battle state with HP in buckets: what the solver memoizes on. The monster's
+// effects and combo points never matter to the rules here, so they are left out.
+struct SolverKey {
+    int32_t heroHP, monsterHP;
+    uint8_t comboPoints, isBlocking, successfulBlocks, buffCount;
+    uint8_t effects[size_t(EffectId::COUNT)];     // hero effect durations
+    uint8_t buffs[Hero::MAX_BUFFS][2];            // item id, turns left
+    uint8_t items[STATE_MAX_ITEMS];
+
+    bool operator==(const SolverKey& other) const { return memcmp(this, &other, sizeof(*this)) == 0; }
+    bool operator<(const SolverKey& other) const { return memcmp(this, &other, sizeof(*this)) < 0; }
+};
+
+static_assert(sizeof(SolverKey) == 8 + 4 + size_t(EffectId::COUNT) + 2 * Hero::MAX_BUFFS + STATE_MAX_ITEMS,
+              "solver keys have no padding, so they hash and compare as bytes");
+
+struct SolverKeyHash {
+    size_t operator()(const SolverKey& key) const {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&key);
+        uint64_t h = 0xCBF29CE484222325ULL;
+        for (size_t i = 0; i < sizeof(key); i++) h = (h ^ bytes[i]) * 0x100000001B3ULL;
+        return h ^ (h >> 32);
+    }
+};
+
+// Exact expectimax over one battle: the hero takes the action with the highest win
+// probability, and every chance outcome (damage variance, dodge, the monster's
+// special move and its pick, the block roll) is walked with its probability, the
+// hero's and the monster's turn separately so identical halfway states are merged.
+// HP lives on a grid of hpBuckets steps of each side's max HP: after a round it moves
+// to the grid point above or below with the odds that keep its expected value (never
+// below one step while alive). A round that can leave the state unchanged is solved
+// in closed form. Longer cycles (combo points or effects going round while no HP
+// bucket changes) are found as strongly connected components during the search
+// (Tarjan) and each is settled by value iteration once its root is done.
+class ExpectimaxSolver {
+public:
+    enum class Status : uint8_t { ON_STACK, SOLVED };
+
+    struct Entry {
+        float value = 0.0f;  // win probability with optimal play
+        uint8_t action = 0;  // MctsPolicy action slot
+        Status status = Status::ON_STACK;
+        uint32_t index = 0, low = 0;  // search order, for finding cycles
+    };
+
+    static const int MAX_ROUNDS = 1000;  // deeper paths count as lost, like runBattle()'s turn limit
+    static const int MAX_SWEEPS = 10000;
+    static constexpr double TOLERANCE = 1e-6;
+
+private:
+    struct Branch {
+        double probability;
+        BattleState state;
+    };
+
+    // One action from a state: its win probability through finished states, and the
+    // chance of moving to each state still open
+    struct Outcome {
+        double fixed = 0.0;
+        double stay = 0.0;
+        vector<pair<Entry*, double>> open;
+    };
+
+    struct OpenState {
+        Entry* entry;
+        uint8_t slots[MctsPolicy::ACTIONS];
+        vector<Outcome> outcomes;
+    };
+
+    struct Child {
+        SolverKey key;
+        double probability;
+        uint32_t state;  // index into childStates, which has the HP before the grid
+        float heroPV, monsterPV;
+
+        bool operator<(const Child& other) const { return key < other.key; }
+    };
+
+    unordered_map<SolverKey, Entry, SolverKeyHash> table;
+    int hpBuckets;
+    size_t maxStates;
+    float heroStep = 1.0f, monsterStep = 1.0f;
+    int comboCap = 3;
+    int depth = 0;
+    uint32_t nextIndex = 0;
+    vector<OpenState> path;  // states whose component is not finished
+    bool overflow = false;
+
+    // evaluate()'s scratch space, reused so a call allocates nothing once warm. The
+    // hero's branches are done with before any child is visited; children and their
+    // states are stacks, each call working past the entries of the calls below it.
+    vector<Branch> halfway;
+    vector<pair<uint64_t, uint32_t>> halfwayOrder;  // (hash, index) of each branch
+    vector<Child> children;
+    vector<BattleState> childStates;
+
+    // Equal for states sameBattle() finds the same
+    static uint64_t battleHash(const BattleState& state) {
+        uint32_t heroPV, monsterPV;
+        memcpy(&heroPV, &state.hero.base.pv, sizeof(heroPV));
+        memcpy(&monsterPV, &state.monster.pv, sizeof(monsterPV));
+        uint64_t rng[4];
+        state.rng.saveState(rng);
+        uint64_t words[] = {uint64_t(heroPV) << 32 | monsterPV,
+                            uint64_t(uint32_t(state.hero.base.comboPoints)) << 32 | uint32_t(state.hero.successfulBlocks),
+                            uint64_t(state.hero.base.effectMask) << 32 | uint32_t(state.hero.buffCount),
+                            rng[0], rng[1], rng[2], rng[3]};
+        uint64_t h = 0xCBF29CE484222325ULL;
+        for (uint64_t word : words) h = (h ^ word) * 0x100000001B3ULL;
+        return h ^ (h >> 32);
+    }
+
+    // Folds repeated branches into their first occurrence, keeping the first
+    // occurrences in order and adding the probabilities in that order
+    void mergeHalfway() {
+        halfwayOrder.clear();
+        for (uint32_t i = 0; i < halfway.size(); i++) halfwayOrder.push_back({battleHash(halfway[i].state), i});
+        sort(halfwayOrder.begin(), halfwayOrder.end());
+        for (size_t i = 0; i < halfwayOrder.size();) {
+            size_t j = i;
+            while (j < halfwayOrder.size() && halfwayOrder[j].first == halfwayOrder[i].first) j++;
+            for (size_t a = i; a < j; a++) {
+                Branch& first = halfway[halfwayOrder[a].second];
+                if (first.probability < 0) continue;
+                for (size_t b = a + 1; b < j; b++) {
+                    Branch& repeat = halfway[halfwayOrder[b].second];
+                    if (repeat.probability < 0 || !sameBattle(first.state, repeat.state)) continue;
+                    first.probability += repeat.probability;
+                    repeat.probability = -1.0;  // merged
+                }
+            }
+            i = j;
+        }
+        halfway.erase(remove_if(halfway.begin(), halfway.end(), [](const Branch& b) { return b.probability < 0; }),
+                      halfway.end());
+    }
+
+    // The grid points around pv and the odds of the upper one
+    static void bucket(float pv, float step, float& low, float& high, double& upper) {
+        float k = floor(pv / step);
+        low = max(k, 1.0f) * step;
+        high = (k + 1) * step;
+        upper = k < 1.0f ? 1.0 : double(pv - low) / step;
+        if (pv == low) upper = 0.0;
+    }
+
+    // Every chance outcome of one action, sorted into finished and open states
+    void evaluate(const BattleState& state, const SolverKey& key, int slot, Outcome& outcome, uint32_t& low) {
+        ItemId item = 0;
+        HeroAction action = MctsPolicy::actionOf(slot, item);
+        double& value = outcome.fixed;
+        
+        halfway.clear();
+        ChanceTape heroTape(state.blockSuccessRate);
+        do {
+            BattleState next = state;
+            if (!next.heroTurn(heroTape, action, item)) continue;  // ran away
+            double p = heroTape.pathProbability();
+            if (next.hero.base.pv <= 0) continue;
+            if (next.monster.pv <= 0) {
+                value += p;
+                continue;
+            }
+            halfway.push_back({p, next});
+        } while (heroTape.next());
+        mergeHalfway();
+        
+        size_t base = children.size(), stateBase = childStates.size();
+        for (const Branch& branch : halfway) {
+            ChanceTape monsterTape(state.blockSuccessRate);
+            do {
+                BattleState next = branch.state;
+                next.monsterTurn(monsterTape);
+                if (next.outcome() == BattleOutcome::LOST) continue;
+                normalize(next);
+                double p = branch.probability * monsterTape.pathProbability();
+                float heroLow, heroHigh, monsterLow, monsterHigh;
+                double heroUp, monsterUp;
+                bucket(next.hero.base.pv, heroStep, heroLow, heroHigh, heroUp);
+                bucket(next.monster.pv, monsterStep, monsterLow, monsterHigh, monsterUp);
+                uint32_t index = childStates.size();
+                childStates.push_back(next);
+                for (int h = 0; h < 2; h++) {
+                    double ph = h ? heroUp : 1.0 - heroUp;
+                    for (int m = 0; m < 2 && ph > 0; m++) {
+                        double pm = m ? monsterUp : 1.0 - monsterUp;
+                        if (pm <= 0) continue;
+                        next.hero.base.pv = h ? heroHigh : heroLow;
+                        next.monster.pv = m ? monsterHigh : monsterLow;
+                        children.push_back({keyOf(next), p * ph * pm, index, next.hero.base.pv, next.monster.pv});
+                    }
+                }
+            } while (monsterTape.next());
+        }
+        
+        size_t end = children.size();
+        sort(children.begin() + base, children.end());
+        for (size_t i = base; i < end;) {
+            double p = 0.0;
+            size_t j = i;
+            for (; j < end && children[j].key == children[i].key; j++) p += children[j].probability;
+            if (children[i].key == key) outcome.stay += p;
+            else {
+                BattleState next = childStates[children[i].state];  // visit() grows childStates
+                next.hero.base.pv = children[i].heroPV;
+                next.monster.pv = children[i].monsterPV;
+                if (Entry* child = visit(next, low)) {
+                    if (child->status == Status::SOLVED) value += p * child->value;
+                    else outcome.open.push_back({child, p});
+                }
+            }
+            i = j;
+        }
+        childStates.resize(stateBase);
+        children.resize(base);
+    }
+
+public:
+    ExpectimaxSolver(int hpBuckets, size_t maxStates) : hpBuckets(hpBuckets), maxStates(maxStates) {}
+
+    // Caps combo points where more stop mattering; HP is left to the grid
+    void normalize(BattleState& state) const {
+        state.hero.base.comboPoints = min(state.hero.base.comboPoints, comboCap);
+        state.monster.comboPoints = 0;
+    }
+
+    // normalize() and one draw of the grid point, for playing on the solver's model
+    void normalize(BattleState& state, Rng& rng) const {
+        normalize(state);
+        for (auto [pv, step] : {pair<float*, float>{&state.hero.base.pv, heroStep}, {&state.monster.pv, monsterStep}}) {
+            if (*pv <= 0) continue;
+            float low, high;
+            double upper;
+            bucket(*pv, step, low, high, upper);
+            *pv = rng.unit() < upper ? high : low;
+        }
+    }
+
+    SolverKey keyOf(const BattleState& state) const {
+        SolverKey key;
+        memset(&key, 0, sizeof(key));
+        key.heroHP = int32_t(lround(max(state.hero.base.pv, 0.0f) / heroStep));
+        key.monsterHP = int32_t(lround(max(state.monster.pv, 0.0f) / monsterStep));
+        key.comboPoints = state.hero.base.comboPoints;
+        key.isBlocking = state.hero.isBlocking;
+        key.successfulBlocks = min(state.hero.successfulBlocks, 255);
+        key.buffCount = state.hero.buffCount;
+        for (unsigned mask = state.hero.base.effectMask; mask; mask &= mask - 1) {
+            int i = __builtin_ctz(mask);
+            key.effects[i] = state.hero.base.effectTurnsLeft(i);
+        }
+        for (int i = 0; i < state.hero.buffCount; i++) {
+            key.buffs[i][0] = state.hero.buffs[i].id;
+            key.buffs[i][1] = state.hero.buffTurnsLeft(i);
+        }
+        for (size_t id = 0; id < STATE_MAX_ITEMS; id++) key.items[id] = min(state.hero.itemCounts[id], 255);
+        return key;
+    }
+
+    // The starting state of a battle, at full HP on the grid; sets the bucket sizes
+    BattleState start(const Hero& player, const Creature& monster) {
+        BattleState state = captureBattle(player, monster);
+        heroStep = state.hero.base.pv_max / hpBuckets;
+        monsterStep = state.monster.pv_max / hpBuckets;
+        comboCap = 3 + max<int>(state.hero.heroSpecialMoveCount, 1) - 1;
+        state.hero.base.pv = hpBuckets * heroStep;
+        state.monster.pv = hpBuckets * monsterStep;
+        normalize(state);
+        return state;
+    }
+
+private:
+    // Best action of an open state given the current values; returns how much its
+    // value moved
+    static double settle(OpenState& open) {
+        float best = -1.0f;
+        uint8_t bestAction = 0;
+        for (size_t a = 0; a < open.outcomes.size(); a++) {
+            const Outcome& outcome = open.outcomes[a];
+            double value = outcome.fixed;
+            for (auto [entry, p] : outcome.open) value += p * entry->value;
+            if (outcome.stay > 0) value = outcome.stay < 1.0 ? value / (1.0 - outcome.stay) : 0.0;  // repeat it until something changes
+            if (value > best) {
+                best = value;
+                bestAction = open.slots[a];
+            }
+        }
+        double change = fabs(best - open.entry->value);
+        open.entry->value = best;
+        open.entry->action = bestAction;
+        return change;
+    }
+
+    // The table entry of a state, solved unless it closes a cycle back to a state
+    // still open; low is lowered to the earliest open state reached. Null past the
+    // depth or state limit, which count as lost.
+    Entry* visit(const BattleState& state, uint32_t& low) {
+        auto [it, inserted] = table.try_emplace(keyOf(state));
+        Entry& entry = it->second;
+        if (!inserted) {
+            if (entry.status == Status::ON_STACK) low = min(low, entry.low);
+            return &entry;
+        }
+        if (table.size() > maxStates) overflow = true;
+        if (overflow || depth >= MAX_ROUNDS) {
+            entry.status = Status::SOLVED;
+            return nullptr;
+        }
+        
+        entry.index = entry.low = nextIndex++;
+        size_t first = path.size();
+        OpenState open = {&entry, {}, {}};
+        int count = MctsPolicy::legalActions(state, open.slots);
+        open.outcomes.resize(count);
+        SolverKey key = keyOf(state);
+        depth++;
+        path.emplace_back();
+        for (int a = 0; a < count; a++) evaluate(state, key, open.slots[a], open.outcomes[a], entry.low);
+        depth--;
+        settle(open);
+        path[first] = move(open);
+        low = min(low, entry.low);
+        if (entry.low != entry.index) return &entry;
+        
+        // Root of a component: its states start from values that counted the way
+        // back as lost, so they only go up from here
+        if (path.size() - first > 1) {
+            for (int sweep = 0; sweep < MAX_SWEEPS; sweep++) {
+                double change = 0.0;
+                for (size_t i = path.size(); i-- > first;) change = max(change, settle(path[i]));
+                if (change < TOLERANCE) break;
+            }
+        }
+        for (size_t i = first; i < path.size(); i++) path[i].entry->status = Status::SOLVED;
+        path.resize(first);
+        return &entry;
+    }
+
+public:
+    // Win probability of a state on the grid under optimal play
+    float solve(const BattleState& state) {
+        uint32_t low = UINT32_MAX;
+        Entry* entry = visit(state, low);
+        return entry ? entry->value : 0.0f;
+    }
+
+    const Entry* find(const BattleState& state) const {
+        auto it = table.find(keyOf(state));
+        return it == table.end() || it->second.status != Status::SOLVED ? nullptr : &it->second;
+    }
+
+    size_t size() const { return table.size(); }
+    bool overflowed() const { return overflow; }
+    const unordered_map<SolverKey, Entry, SolverKeyHash>& entries() const { return table; }
+};
+
+// Policy tables written by --solve --table: a header, then one record per solved
+// state of every monster/level cell, in no particular order
+const char POLICY_MAGIC[8] = {'A', 'B', 'P', 'O', 'L', 'I', 'C', 'Y'};
+const uint32_t POLICY_VERSION = 1;
+
+struct PolicyHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t count;
+    int32_t hpBuckets;
+    uint32_t reserved;
+};
+
+struct PolicyRecord {
+    uint16_t monster;        // index into content.monsters
+    uint16_t level;
+    uint8_t action;          // MctsPolicy action slot
+    uint8_t reserved[3];
+    float winProbability;
+    SolverKey state;
+};
+
+static_assert(is_trivially_copyable<PolicyRecord>::value, "policy records are written as raw bytes");
+
+struct SolverConfig {
+    int maxLevel = 5;
+    int heroLevel = 0;          // 0 = same level as the monster
+    int threads = 0;            // 0 = all cores
+    int hpBuckets = 10;
+    int maxItems = 0;           // of each starting item the hero may use
+    size_t maxStates = 1000000; // per cell; larger cells are reported unsolved
+    float blockSuccessRate = 0.5f;
+    int verify = 0;             // battles per cell played with the table, as a check
+    uint64_t seed = 0;
+    string tablePath;
+};
+
+string actionName(int slot) {
+    static const char* const plain[MctsPolicy::PLAIN_ACTIONS] = {"attack", "special", "block", "run"};
+    if (slot < MctsPolicy::PLAIN_ACTIONS) return plain[slot];
+    return "item:" + content.items[slot - MctsPolicy::PLAIN_ACTIONS].getName();
+}
+
+// Optimal win probability and opening action for every monster and level, as CSV.
+// Cells are solved in parallel, each with its own transposition table.
+int runSolver(const SolverConfig& config, ostream& out) {
+    struct CellResult {
+        float winProbability = 0.0f;
+        int action = 0;
+        size_t states = 0;
+        bool solved = false;
+        int heroLevel = 0;
+        double simulated = 0.0;
+        vector<PolicyRecord> policy;
+    };
+    
+    int threads = config.threads > 0 ? config.threads : max(1u, thread::hardware_concurrency());
+    int cellCount = content.monsters.size() * config.maxLevel;
+    vector<CellResult> cells(cellCount);
+    WorkStealingPool pool(threads);
+    
+    for (int cell = 0; cell < cellCount; cell++) {
+        pool.submit([&, cell](int) {
+            NullSink sink;
+            BattleContext ctx = {&sink, scriptedBlock, config.blockSuccessRate, Rng()};
+            int monsterIndex = cell / config.maxLevel;
+            int level = cell % config.maxLevel + 1;
+            Hero player = makeLevelledHero(config.heroLevel > 0 ? config.heroLevel : level, ctx);
+            Creature monster(content.monsters[monsterIndex], level);
+            monster.setContext(ctx);
             
-            cout << "Used " << item.name << "!\n";
+            ExpectimaxSolver solver(config.hpBuckets, config.maxStates);
+            BattleState start = solver.start(player, monster);
+            for (int& count : start.hero.itemCounts) count = min(count, config.maxItems);
             
-            // Apply instant healing
-            if (item.healAmount > 0 && item.duration == 0) {
-                float oldHP = pv;
-                pv = min(pv + item.healAmount, pv_max);
-                cout << "Healed for " << (pv - oldHP) << " HP!\n";
+            CellResult& result = cells[cell];
+            result.heroLevel = player.getNiveau();
+            result.winProbability = solver.solve(start);
+            result.solved = !solver.overflowed();
+            result.states = solver.size();
+            if (!result.solved) return;
+            result.action = solver.find(start)->action;
+            
+            if (!config.tablePath.empty()) {
+                result.policy.reserve(solver.size());
+                for (const auto& [key, entry] : solver.entries()) {
+                    PolicyRecord record = {};
+                    record.monster = monsterIndex;
+                    record.level = level;
+                    record.action = entry.action;
+                    record.winProbability = entry.value;
+                    record.state = key;
+                    result.policy.push_back(record);
+                }
+            }
+            
+            // Sampled battles on the same bucketed model, following the table
+            int wins = 0;
+            for (int i = 0; i < config.verify; i++) {
+                BattleState state = start;
+                state.rng.reseed(config.seed, uint64_t(cell) * config.verify + i);
+                BattleOutcome outcome = BattleOutcome::ONGOING;
+                while (outcome == BattleOutcome::ONGOING) {
+                    const ExpectimaxSolver::Entry* entry = solver.find(state);
+                    ItemId item = 0;
+                    HeroAction action = MctsPolicy::actionOf(entry ? entry->action : 0, item);
+                    outcome = state.round(action, item);
+                    solver.normalize(state, state.rng);
+                }
+                wins += outcome == BattleOutcome::WON;
+            }
+            if (config.verify > 0) result.simulated = double(wins) / config.verify;
+        });
+    }
+    
+    auto start = chrono::steady_clock::now();
+    pool.run();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    
+    out << "monster,level,hero_level,win_probability,first_action,states" << (config.verify ? ",simulated" : "") << "\n";
+    size_t totalStates = 0, records = 0;
+    int solvedCells = 0;
+    string unsolved;
+    for (int cell = 0; cell < cellCount; cell++) {
+        const CellResult& result = cells[cell];
+        const string& monster = content.names[content.monsters[cell / config.maxLevel].name];
+        totalStates += result.states;
+        records += result.policy.size();
+        if (result.solved) solvedCells++;
+        else unsolved += (unsolved.empty() ? "" : ", ") + monster + " level " + to_string(cell % config.maxLevel + 1);
+        out << monster << "," << cell % config.maxLevel + 1 << "," << result.heroLevel << ",";
+        if (result.solved) out << fixed << setprecision(6) << result.winProbability << "," << actionName(result.action);
+        else out << ",unsolved";
+        out << "," << result.states;
+        if (config.verify) out << "," << setprecision(4) << result.simulated;
+        out << defaultfloat << "\n";
+    }
+    
+    if (!config.tablePath.empty()) {
+        PolicyHeader header = {};
+        memcpy(header.magic, POLICY_MAGIC, sizeof(header.magic));
+        header.version = POLICY_VERSION;
+        header.recordSize = sizeof(PolicyRecord);
+        header.count = records;
+        header.hpBuckets = config.hpBuckets;
+        int fd = open(config.tablePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = fd >= 0 && writeAll(fd, &header, sizeof(header));
+        for (int cell = 0; ok && cell < cellCount; cell++) {
+            ok = writeAll(fd, cells[cell].policy.data(), cells[cell].policy.size() * sizeof(PolicyRecord));
+        }
+        if (fd >= 0) ok = close(fd) == 0 && ok;
+        if (!ok) {
+            cerr << "Cannot write policy table " << config.tablePath << "\n";
+            return 1;
+        }
+    }
+    
+    cerr << "Solved " << solvedCells << " of " << cellCount << " cells (" << totalStates << " states) on " << threads
+         << " threads in " << seconds << "s\n";
+    if (!unsolved.empty()) cerr << "Unsolved past " << config.maxStates << " states: " << unsolved << "\n";
+    return 0;
+}
+
+enum class Side : uint8_t { PARTY, MONSTERS };
+
+// Timed events of an encounter on a binary min-heap: scheduling and popping are
+// O(log n) in the events pending, whatever the number of actors. Ties go to the event
+// scheduled first. Events name an entity by id and generation, so those of entities
+// that died in the meantime are recognised and dropped when they come up.
+class InitiativeQueue {
+public:
+    enum class Kind : uint8_t {
+        TURN,     // the entity acts
+        SPECIAL,  // a monster's special move lands, after its wind-up
+        EXPIRY    // a condition may run out (see Team::expire)
+    };
+
+    struct Event {
+        uint64_t time;
+        uint32_t sequence;
+        uint32_t entity;
+        uint16_t generation;
+        Side side;
+        Kind kind;
+        uint8_t condition;
+    };
+
+private:
+    vector<Event> events;
+    uint32_t nextSequence = 0;
+
+    static bool later(const Event& a, const Event& b) {
+        return a.time != b.time ? a.time > b.time : int32_t(a.sequence - b.sequence) > 0;
+    }
+
+public:
+    void schedule(Event event) {
+        event.sequence = nextSequence++;
+        events.push_back(event);
+        push_heap(events.begin(), events.end(), later);
+    }
+
+    Event pop() {
+        pop_heap(events.begin(), events.end(), later);
+        Event event = events.back();
+        events.pop_back();
+        return event;
+    }
+
+    bool empty() const { return events.empty(); }
+    size_t size() const { return events.size(); }
+    void clear() { events.clear(); }
+};
+
+// One side of a multi-enemy encounter as component arrays: entity row i is element i
+// of every array, with no Creature object and no virtual call behind it. Dead entities
+// are removed by moving the last row into their slot; the hero, when on this side, is
+// row 0 and never moves. Rows change, so anything kept across turns (the initiative
+// queue) holds the entity's id, which rowOf() maps back while it lives.
+class Team {
+public:
+    // Conditions: the status effects, then two speed changes
+    static const int HASTE = int(EffectId::COUNT);
+    static const int SLOW = HASTE + 1;
+    static const int CONDITIONS = SLOW + 1;
+    static constexpr float HASTE_SPEED = 1.5f;
+    static constexpr float SLOW_SPEED = 0.5f;
+
+    // Time for one turn of a speed 100 actor
+    static const uint64_t TURN_TICKS = 1000;
+
+    vector<float> pv, pvMax, pa;
+    vector<int32_t> niveau;
+    vector<MonsterType> type;
+    vector<int32_t> comboPoints;
+    vector<int32_t> templ;                      // index into content.monsters, -1 for the hero
+    vector<float> speed;                        // 100 = one turn per TURN_TICKS
+    vector<uint8_t> conditionMask;              // bit c set until conditionEnds[c]
+    vector<float> effectDamage, effectDefense;  // products over the active effects
+    vector<float> tempo;                        // speed multiplier from haste and slow
+    vector<uint64_t> conditionEnds[CONDITIONS];
+    vector<uint32_t> entity;                    // id of each row
+
+private:
+    vector<int32_t> rows;         // row of each id, -1 once dead
+    vector<uint16_t> generations; // bumped when an id is freed
+    vector<uint32_t> freeIds;
+
+    // Each effect comes from one element's special moves, always with the same strength
+    static inline const array<StatusEffect, size_t(EffectId::COUNT)> effectDefaults = [] {
+        array<StatusEffect, size_t(EffectId::COUNT)> effects = {};
+        for (size_t t = 0; t < ELEMENT_COUNT; t++) {
+            StatusEffect effect = elementEffect(MonsterType(t));
+            if (effect.id != EffectId::COUNT) effects[size_t(effect.id)] = effect;
+        }
+        return effects;
+    }();
+
+    void refreshConditions(size_t i) {
+        effectDamage[i] = 1.0f;
+        effectDefense[i] = 1.0f;
+        for (unsigned mask = conditionMask[i] & ((1u << HASTE) - 1); mask; mask &= mask - 1) {
+            const StatusEffect& effect = effectDefaults[__builtin_ctz(mask)];
+            effectDamage[i] *= effect.damageMultiplier;
+            effectDefense[i] *= effect.defenseMultiplier;
+        }
+        tempo[i] = (conditionMask[i] & (1u << HASTE) ? HASTE_SPEED : 1.0f) *
+                   (conditionMask[i] & (1u << SLOW) ? SLOW_SPEED : 1.0f);
+    }
+
+public:
+    size_t size() const { return pv.size(); }
+    bool empty() const { return pv.empty(); }
+    bool isHero(size_t i) const { return templ[i] < 0; }
+
+    // Row of a living entity, -1 if it has died since the event naming it was scheduled
+    int32_t rowOf(uint32_t id, uint16_t generation) const {
+        return generations[id] == generation ? rows[id] : -1;
+    }
+    uint16_t generationOf(size_t i) const { return generations[entity[i]]; }
+
+    size_t add(float health, float attack, int level, MonsterType element, int32_t templateIndex, float initiative) {
+        uint32_t id;
+        if (freeIds.empty()) {
+            id = rows.size();
+            rows.push_back(0);
+            generations.push_back(0);
+        } else {
+            id = freeIds.back();
+            freeIds.pop_back();
+        }
+        rows[id] = size();
+        entity.push_back(id);
+        pv.push_back(health);
+        pvMax.push_back(health);
+        pa.push_back(attack);
+        niveau.push_back(level);
+        type.push_back(element);
+        comboPoints.push_back(0);
+        templ.push_back(templateIndex);
+        speed.push_back(initiative);
+        conditionMask.push_back(0);
+        effectDamage.push_back(1.0f);
+        effectDefense.push_back(1.0f);
+        tempo.push_back(1.0f);
+        for (auto& ends : conditionEnds) ends.push_back(0);
+        return size() - 1;
+    }
+
+    // A monster from its template, scaled like the Creature constructor does
+    size_t spawn(int32_t templateIndex, int level) {
+        const MonsterTemplate& t = content.monsters[templateIndex];
+        return add(content.monsterHP(t, level), content.monsterAttack(t, level), level, t.type, templateIndex, t.speed);
+    }
+
+    void remove(size_t i) {
+        size_t last = size() - 1;
+        uint32_t id = entity[i];
+        rows[entity[last]] = i;
+        rows[id] = -1;
+        generations[id]++;
+        freeIds.push_back(id);
+        
+        entity[i] = entity[last];
+        pv[i] = pv[last];
+        pvMax[i] = pvMax[last];
+        pa[i] = pa[last];
+        niveau[i] = niveau[last];
+        type[i] = type[last];
+        comboPoints[i] = comboPoints[last];
+        templ[i] = templ[last];
+        speed[i] = speed[last];
+        conditionMask[i] = conditionMask[last];
+        effectDamage[i] = effectDamage[last];
+        effectDefense[i] = effectDefense[last];
+        tempo[i] = tempo[last];
+        for (auto& ends : conditionEnds) ends[i] = ends[last];
+        entity.pop_back();
+        pv.pop_back();
+        pvMax.pop_back();
+        pa.pop_back();
+        niveau.pop_back();
+        type.pop_back();
+        comboPoints.pop_back();
+        templ.pop_back();
+        speed.pop_back();
+        conditionMask.pop_back();
+        effectDamage.pop_back();
+        effectDefense.pop_back();
+        tempo.pop_back();
+        for (auto& ends : conditionEnds) ends.pop_back();
+    }
+
+    // Time between two turns of row i at its current speed
+    uint64_t interval(size_t i) const {
+        return uint64_t(TURN_TICKS * 100.0f / max(speed[i] * tempo[i], 1.0f));
+    }
+
+    // Starts (or restarts) a condition for a number of row i's turns; returns when it
+    // ends, for the caller to schedule the expiry
+    uint64_t addCondition(size_t i, int condition, int turns, uint64_t now) {
+        conditionEnds[condition][i] = now + turns * interval(i);
+        conditionMask[i] |= 1u << condition;
+        refreshConditions(i);
+        return conditionEnds[condition][i];
+    }
+
+    // An expiry event came up; a condition restarted since then runs on
+    void expire(size_t i, int condition, uint64_t now) {
+        if (!(conditionMask[i] & (1u << condition)) || conditionEnds[condition][i] > now) return;
+        conditionMask[i] &= ~(1u << condition);
+        refreshConditions(i);
+    }
+
+    // Between waves, when no expiry is pending any more
+    void clearConditions() {
+        for (size_t i = 0; i < size(); i++) {
+            conditionMask[i] = 0;
+            refreshConditions(i);
+        }
+    }
+
+    // Damage dealt by row i, as Creature::calculateDamage()
+    float damage(size_t i, float baseDamage, MonsterType targetType) const {
+        return baseDamage * effectiveness(type[i], targetType) * effectDamage[i];
+    }
+
+    // Row i takes a hit: monsters and allies dodge 2 in 4 and apply their defense
+    // effects, the hero takes it whole, as Hero::subitDegat() without a block. True if
+    // it died.
+    bool takeHit(size_t i, float degat, Rng& rng) {
+        if (isHero(i)) {
+            pv[i] -= degat;
+        } else if (rng.below(4) > 1) {
+            pv[i] -= degat * effectDefense[i];
+        } else {
+            countStat(Counter::DODGES);
+        }
+        return pv[i] <= 0;
+    }
+};
+
+struct WaveConfig {
+    int waves = 100;         // 0 = until the hero falls
+    int firstWave = 5;       // monsters in the first wave
+    int growth = 2;          // extra monsters in each following wave
+    int allies = 3;          // recruited at the hero's level before every wave
+    int maxRounds = 1000;    // per wave, in speed 100 turns, like runBattle()'s turn limit
+    float healBelow = 0.3f;  // the hero drinks a potion under this share of max HP
+    uint64_t seed = 0;
+};
+
+// Endless dungeon waves: the hero and allied monsters against a growing horde, in
+// initiative order. Everyone acts as often as their speed allows, from a random start
+// within their first turn. A party member attacks a random monster or, with 3+ combo
+// points, uses a special move that hits every monster (the hero's also hastes the
+// party). A monster attacks a random party member or, 1 time in 4, winds up a special
+// move that lands half a turn later on the whole party with its element's effect (ice
+// also slows). Effects end on their own scheduled events, so nothing scans for them.
+// The hero is a real Hero for levels, XP and potions; its row is synced around them.
+class WaveEncounter {
+private:
+    using Event = InitiativeQueue::Event;
+    using Kind = InitiativeQueue::Kind;
+
+    const WaveConfig& config;
+    Hero& player;
+    Rng& rng;
+    Team party, monsters;
+    InitiativeQueue queue;
+    uint64_t now = 0;
+
+public:
+    int monstersDefeated = 0;
+    int wavesCleared = 0;
+    long long heroTurns = 0;
+    long long entityTurns = 0;
+    size_t largestField = 0;
+
+    WaveEncounter(const WaveConfig& config, Hero& player, Rng& rng) : config(config), player(player), rng(rng) {
+        party.add(player.getPV(), player.getPA(), player.getNiveau(), player.getType(), -1, 100.0f);
+    }
+
+    const Team& getParty() const { return party; }
+    const Team& getMonsters() const { return monsters; }
+
+private:
+    Team& team(Side side) { return side == Side::PARTY ? party : monsters; }
+
+    void schedule(Side side, size_t i, uint64_t time, Kind kind, int condition = 0) {
+        Team& t = team(side);
+        queue.schedule({time, 0, t.entity[i], t.generationOf(i), side, kind, uint8_t(condition)});
+    }
+
+    void addCondition(Side side, size_t i, int condition, int turns) {
+        schedule(side, i, team(side).addCondition(i, condition, turns, now), Kind::EXPIRY, condition);
+    }
+
+    // The Hero is the reference for everything but the row's HP during a wave
+    void pullHero() {
+        party.pv[0] = player.getPV();
+        party.pvMax[0] = player.getPVMax();
+        party.pa[0] = player.getPA();
+        party.niveau[0] = player.getNiveau();
+    }
+
+    void pushHero() { player.setPV(party.pv[0]); }
+
+    void defeated(size_t i) {
+        pushHero();
+        player.addXP(victoryXP(monsters.niveau[i], monsters.type[i]));
+        if (rng.below(2) == 0) player.addItem(rng.below(content.items.size()), 1);
+        pullHero();
+        monsters.remove(i);
+        monstersDefeated++;
+    }
+
+    // Instant healing only; over-time items need the per-turn item updates of a duel
+    bool drinkPotion() {
+        if (party.pv[0] >= party.pvMax[0] * config.healBelow) return false;
+        for (ItemId id : player.getAvailableItems()) {
+            const Item& item = content.items[id];
+            if (item.healAmount <= 0 || item.duration > 0) continue;
+            pushHero();
+            player.useItem(id);
+            pullHero();
+            return true;
+        }
+        return false;
+    }
+
+    void partyTurn(size_t i) {
+        if (party.isHero(i)) {
+            heroTurns++;
+            if (drinkPotion()) return;
+        }
+        
+        const vector<MoveId>& moves = party.isHero(i) ? content.heroMoves : content.monsters[party.templ[i]].specialMoves;
+        if (party.comboPoints[i] >= 3 && !moves.empty()) {
+            int moveIndex = min(party.comboPoints[i] - 3, int(moves.size()) - 1);
+            float damage = party.pa[i] * content.moves[moves[moveIndex]].multiplier;
+            if (party.isHero(i)) damage *= 1.0f + float(player.getSuccessfulBlocks()) / 10.0f;
+            for (size_t m = monsters.size(); m-- > 0;) {
+                if (monsters.takeHit(m, party.damage(i, damage, monsters.type[m]), rng)) defeated(m);
+            }
+            party.comboPoints[i] = 0;
+            if (party.isHero(i)) {
+                for (size_t p = 0; p < party.size(); p++) addCondition(Side::PARTY, p, Team::HASTE, 2);
+            }
+            return;
+        }
+        
+        size_t target = rng.below(monsters.size());
+        float damage = party.damage(i, party.pa[i] * (1.0f + float(rng.below(10))/10.0f), monsters.type[target]);
+        party.comboPoints[i]++;
+        if (monsters.takeHit(target, damage, rng)) defeated(target);
+    }
+
+    // A party member takes a hit; false once the hero has fallen
+    bool hitParty(size_t p, float damage) {
+        if (!party.takeHit(p, damage, rng)) return true;
+        if (p == 0) return false;
+        party.remove(p);
+        return true;
+    }
+
+    bool monsterTurn(size_t i) {
+        if (rng.below(4) == 0) {  // 25% chance for special move
+            if (!content.monsters[monsters.templ[i]].specialMoves.empty()) {
+                schedule(Side::MONSTERS, i, now + monsters.interval(i) / 2, Kind::SPECIAL);
+            }
+            return true;
+        }
+        size_t target = rng.below(party.size());
+        float damage = monsters.damage(i, monsters.pa[i] * (1.0f + float(rng.below(10))/10.0f), party.type[target]);
+        monsters.comboPoints[i]++;
+        return hitParty(target, damage);
+    }
+
+    bool monsterSpecial(size_t i) {
+        const vector<MoveId>& moves = content.monsters[monsters.templ[i]].specialMoves;
+        float damage = monsters.pa[i] * content.moves[moves[rng.below(moves.size())]].multiplier;
+        StatusEffect effect = elementEffect(monsters.type[i]);
+        for (size_t p = party.size(); p-- > 0;) {
+            if (effect.id != EffectId::COUNT) addCondition(Side::PARTY, p, int(effect.id), effect.duration);
+            if (monsters.type[i] == MonsterType::ICE) addCondition(Side::PARTY, p, Team::SLOW, effect.duration);
+            if (!hitParty(p, monsters.damage(i, damage, party.type[p]))) return false;
+        }
+        return true;
+    }
+
+public:
+    // Plays one wave; false if the hero fell or it ran past maxRounds
+    bool playWave(int wave) {
+        while (int(party.size()) <= config.allies) {
+            party.spawn(rng.below(content.monsters.size()), player.getNiveau());
+        }
+        int count = config.firstWave + config.growth * (wave - 1);
+        int level = 1 + (wave - 1) / 3;
+        for (int i = 0; i < count; i++) monsters.spawn(rng.below(content.monsters.size()), level);
+        largestField = max(largestField, party.size() + monsters.size());
+        countStat(Counter::BATTLES);
+        
+        for (Side side : {Side::PARTY, Side::MONSTERS}) {
+            Team& t = team(side);
+            for (size_t i = 0; i < t.size(); i++) schedule(side, i, now + rng.below(t.interval(i)), Kind::TURN);
+        }
+        long long heroTurnsBefore = heroTurns;
+        uint64_t deadline = now + config.maxRounds * Team::TURN_TICKS;
+        bool heroStands = true;
+        while (heroStands && !monsters.empty() && !queue.empty()) {
+            Event event = queue.pop();
+            if (event.time > deadline) break;
+            now = event.time;
+            Team& t = team(event.side);
+            int32_t i = t.rowOf(event.entity, event.generation);
+            if (i < 0) continue;
+            
+            switch (event.kind) {
+                case Kind::TURN:
+                    entityTurns++;
+                    if (event.side == Side::PARTY) partyTurn(i);
+                    else heroStands = monsterTurn(i);
+                    schedule(event.side, i, now + t.interval(i), Kind::TURN);  // acting never moves the actor's row
+                    break;
+                case Kind::SPECIAL:
+                    heroStands = monsterSpecial(i);
+                    break;
+                case Kind::EXPIRY:
+                    t.expire(i, event.condition, now);
+                    break;
+            }
+        }
+        queue.clear();
+        party.clearConditions();
+        countStat(Counter::TURNS, heroTurns - heroTurnsBefore);
+        pushHero();
+        if (!heroStands || !monsters.empty()) return false;
+        wavesCleared++;
+        return true;
+    }
+};
+
+// Headless --waves run: waves until the hero falls (or config.waves are cleared),
+// then the final statistics and the entity throughput
+int runWaves(const WaveConfig& config) {
+    NullSink sink;
+    BattleContext ctx = {&sink, scriptedBlock, 0.5f, Rng(config.seed)};
+    Hero player("Wave Hero");
+    player.setContext(ctx);
+    giveStartingItems(player);
+    
+    WaveEncounter encounter(config, player, ctx.rng);
+    auto start = chrono::steady_clock::now();
+    for (int wave = 1; config.waves == 0 || wave <= config.waves; wave++) {
+        if (!encounter.playWave(wave)) break;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    
+    cout << "Waves Cleared: " << encounter.wavesCleared << "\n"
+         << "Monsters Defeated: " << encounter.monstersDefeated << "\n"
+         << "Final Level: " << player.getNiveau() << (player.estVivant() ? "" : " (fallen)") << "\n"
+         << "Hero turns: " << encounter.heroTurns << ", Entity turns: " << encounter.entityTurns
+         << ", Largest field: " << encounter.largestField << " entities\n"
+         << fixed << setprecision(0) << encounter.entityTurns / seconds << " entity turns/s ("
+         << setprecision(3) << seconds << "s)\n";
+    return 0;
+}
+
+// One scripted input of a stress case: a battle menu choice (0 and 6+ are invalid
+// ones), an item id for choice 4 (possibly past the last item), or an item handed
+// to the hero, quantity 0 included
+struct StressStep {
+    enum Kind : uint8_t { CHOICE, GIVE };
+    Kind kind;
+    uint8_t value;    // menu choice, or quantity given
+    uint16_t item;
+};
+
+struct StressFailure {
+    const char* invariant = nullptr;
+    size_t step = 0;  // index of the step after which it broke
+};
+
+// Bounds the buff totals can reach with the loaded content, MAX_BUFFS buffs at most
+struct StressBounds {
+    float attackLow = 1.0f, attackHigh = 1.0f;
+    float defenseLow = 1.0f, defenseHigh = 1.0f;
+    float healHigh = 0.0f;
+
+    StressBounds() {
+        for (const Item& item : content.items) {
+            if (item.duration <= 0) continue;
+            // Clamped at 0: a pack with negative factors fails the sign checks instead
+            attackLow = min(attackLow, max(0.0f, item.attackBuff));
+            attackHigh = max(attackHigh, item.attackBuff);
+            defenseLow = min(defenseLow, max(0.0f, 2.0f - item.defenseBuff));
+            defenseHigh = max(defenseHigh, 2.0f - item.defenseBuff);
+            healHigh = max(healHigh, item.healAmount);
+        }
+        attackLow = pow(attackLow, Hero::MAX_BUFFS);
+        attackHigh = pow(attackHigh, Hero::MAX_BUFFS);
+        defenseLow = pow(defenseLow, Hero::MAX_BUFFS);
+        defenseHigh = pow(defenseHigh, Hero::MAX_BUFFS);
+        healHigh *= Hero::MAX_BUFFS;
+    }
+};
+
+// The rules' invariants; the name of the first one broken, null if all hold
+const char* checkInvariants(const Hero& hero, const Creature& monster, const StressBounds& bounds) {
+    const float slack = 1e-3f;
+    for (const Creature* c : {static_cast<const Creature*>(&hero), &monster}) {
+        if (!isfinite(c->getPV())) return "HP is finite";
+        if (c->getPV() > c->getPVMax() + slack) return "HP <= max HP";
+        if (c->getComboPoints() < 0) return "combo points >= 0";
+        if (c->getEffectMask() >> size_t(EffectId::COUNT)) return "effect mask within the effects";
+        for (unsigned mask = c->getEffectMask(); mask; mask &= mask - 1) {
+            if (c->getEffect(EffectId(__builtin_ctz(mask))).duration <= 0) return "active effects have turns left";
+        }
+    }
+    if (hero.getBuffCount() < 0 || hero.getBuffCount() > Hero::MAX_BUFFS) return "buff count within the pool";
+    for (int i = 0; i < hero.getBuffCount(); i++) {
+        const ActiveBuff& buff = hero.getBuffs()[i];
+        if (buff.id >= content.items.size()) return "buffs are items";
+        int turnsLeft = hero.buffTurnsLeft(i);
+        if (turnsLeft <= 0 || turnsLeft > content.items[buff.id].duration) return "buff turns within the item's duration";
+    }
+    if (hero.getBuffAttack() < bounds.attackLow * (1 - slack) || hero.getBuffAttack() > bounds.attackHigh * (1 + slack)) {
+        return "attack buff within bounds";
+    }
+    if (hero.getBuffDefense() <= 0.0f) return "defense buff never turns damage into healing";
+    if (hero.getBuffDefense() < bounds.defenseLow * (1 - slack) || hero.getBuffDefense() > bounds.defenseHigh * (1 + slack)) {
+        return "defense buff within bounds";
+    }
+    if (hero.getBuffHeal() < 0.0f || hero.getBuffHeal() > bounds.healHigh + slack) return "heal per turn within bounds";
+    for (ItemId id = 0; id < content.items.size(); id++) {
+        if (hero.getItemCount(id) < 0) return "item counts >= 0";
+    }
+    if (hero.getXP() < 0.0f || hero.getXP() >= 100.0f) return "XP below the next level";
+    if (hero.getSuccessfulBlocks() < 0) return "successful blocks >= 0";
+    return nullptr;
+}
+
+struct StressConfig {
+    long long turns = 10000000;
+    int caseTurns = 256;        // hero turns per case at most
+    int threads = 0;            // 0 = all cores
+    float blockSuccessRate = 0.5f;
+    long long replayCase = -1;  // --stress-case: play one case with the battle text
+    uint64_t seed = 0;
+};
+
+// Random stress cases: case i draws its inputs from Rng(seed, 2i) and the battles
+// from Rng(seed, 2i + 1), so dropping inputs leaves the dice of the rest alone
+class StressRunner {
+private:
+    const StressConfig& config;
+    StressBounds bounds;
+
+    StressStep randomStep(Rng& rng) const {
+        uint32_t items = content.items.size();
+        uint32_t roll = rng.below(16);
+        if (roll < 2) {
+            return {StressStep::GIVE, uint8_t(rng.below(2)), uint16_t(rng.below(items))};
+        }
+        if (roll < 4) {
+            // Item indices at the edges: first, last, one and two past the end
+            const uint32_t edges[] = {0, items - 1, items, items + 1};
+            return {StressStep::CHOICE, 4, uint16_t(roll == 2 ? edges[rng.below(4)] : rng.below(items + 2))};
+        }
+        if (roll == 4) return {StressStep::CHOICE, uint8_t(rng.below(2) ? 0 : 6 + rng.below(250)), 0};
+        return {StressStep::CHOICE, uint8_t(1 + rng.below(5)), 0};
+    }
+
+    // A hero of a random level holding a random kit, zero counts included
+    void setUp(Hero& hero, Rng& rng) const {
+        int levels = rng.below(30);
+        if (levels > 0) hero.addXP(levels * 100.0f);
+        for (ItemId id = 0; id < content.items.size(); id++) {
+            if (rng.below(2)) hero.addItem(id, rng.below(4));
+        }
+    }
+
+public:
+    explicit StressRunner(const StressConfig& config) : config(config) {}
+
+    // Plays case index with its generated steps, or with the given ones when replaying
+    // a reduced list; stops at the first broken invariant. Returns hero turns played.
+    long long play(uint64_t index, vector<StressStep>* steps, bool generate, StressFailure& failure, EventSink& sink) const {
+        Rng inputs(config.seed, 2 * index);
+        BattleContext ctx = {&sink, scriptedBlock, config.blockSuccessRate, Rng(config.seed, 2 * index + 1)};
+        Hero hero("Stress Hero");
+        hero.setContext(ctx);
+        setUp(hero, inputs);
+        int monstersDefeated = 0;
+        auto spawn = [&] {
+            Creature monster(content.monsters[ctx.rng.below(content.monsters.size())], 1 + (monstersDefeated / 3));
+            monster.setContext(ctx);
+            return monster;
+        };
+        Creature monster = spawn();
+        
+        size_t count = generate ? config.caseTurns : steps->size();
+        long long turns = 0;
+        for (size_t s = 0; s < count && hero.estVivant(); s++) {
+            StressStep step = generate ? randomStep(inputs) : (*steps)[s];
+            if (generate && steps) steps->push_back(step);
+            
+            if (step.kind == StressStep::GIVE) {
+                hero.addItem(step.item, step.value);
+            } else {
+                turns++;
+                bool battleContinues = true;
+                if (step.value == 4) heroTurn(hero, monster, HeroAction::ITEM, step.item);
+                else if (step.value >= 1 && step.value <= 5) battleContinues = heroTurn(hero, monster, HeroAction(step.value));
+                else hero.setBlocking(false);  // invalid choice, turn skipped
+                
+                if ((failure.invariant = checkInvariants(hero, monster, bounds))) {
+                    failure.step = s;
+                    return turns;
+                }
+                if (battleContinues && monster.estVivant() && hero.estVivant()) monsterTurn(hero, monster);
+                if (!monster.estVivant() && battleContinues) {
+                    claimVictory(hero, monster);
+                    monstersDefeated++;
+                }
+                if (!battleContinues || !monster.estVivant()) monster = spawn();
+            }
+            if ((failure.invariant = checkInvariants(hero, monster, bounds))) {
+                failure.step = s;
+                return turns;
+            }
+        }
+        return turns;
+    }
+
+    // Drops chunks of steps (then single steps) while some invariant still breaks
+    vector<StressStep> minimize(uint64_t index, vector<StressStep> steps) const {
+        NullSink sink;
+        auto fails = [&](vector<StressStep>& candidate) {
+            StressFailure failure;
+            play(index, &candidate, false, failure, sink);
+            return failure.invariant != nullptr;
+        };
+        size_t chunks = 2;
+        while (steps.size() > 1) {
+            size_t size = (steps.size() + chunks - 1) / chunks;
+            bool reduced = false;
+            for (size_t start = 0; start < steps.size(); start += size) {
+                vector<StressStep> candidate(steps.begin(), steps.begin() + start);
+                candidate.insert(candidate.end(), steps.begin() + min(start + size, steps.size()), steps.end());
+                if (fails(candidate)) {
+                    steps = move(candidate);
+                    chunks = max<size_t>(chunks - 1, 2);
+                    reduced = true;
+                    break;
+                }
             }
-            
-            // Add to active items if it has duration
-            if (item.duration > 0) {
-                activeItems.push_back(item);
-                cout << "Effect will last for " << item.duration << " turns.\n";
+            if (reduced) continue;
+            if (size == 1) break;
+            chunks = min(chunks * 2, steps.size());
+        }
+        return steps;
+    }
+};
+
+string describeStep(const StressStep& step) {
+    if (step.kind == StressStep::GIVE) return "give " + to_string(step.value) + " x item " + to_string(step.item);
+    if (step.value == 4) return "use item " + to_string(step.item);
+    if (step.value >= 1 && step.value <= 5) {
+        static const char* const names[] = {"attack", "special", "block", "", "run"};
+        return names[step.value - 1];
+    }
+    return "invalid choice " + to_string(step.value);
+}
+
+// Millions of random turns through Hero/Creature on every core, checking the
+// invariants after each hero and monster turn. The first failing case (lowest
+// index) is reported with its inputs minimized.
+int runStress(const StressConfig& config) {
+    StressRunner runner(config);
+    if (config.replayCase >= 0) {
+        TextSink text(cout);
+        StressFailure failure;
+        runner.play(config.replayCase, nullptr, true, failure, text);
+        if (failure.invariant) cout << "\nBroken: " << failure.invariant << " at step " << failure.step << "\n";
+        else cout << "\nAll invariants held\n";
+        return failure.invariant ? 1 : 0;
+    }
+    
+    // Cases are handed out in blocks until the turns played reach the budget. Blocks
+    // are played whole, so the cases played are always 0..cases-1 and the first
+    // failure among them does not depend on the thread timing.
+    int threads = config.threads > 0 ? config.threads : max(1u, thread::hardware_concurrency());
+    const uint64_t casesPerBlock = 64;
+    atomic<uint64_t> nextCase{0};
+    atomic<long long> turns{0};
+    atomic<uint64_t> firstFailure{UINT64_MAX};
+    
+    WorkStealingPool pool(threads);
+    for (int t = 0; t < threads; t++) {
+        pool.submit([&](int) {
+            NullSink sink;
+            while (turns.load(memory_order_relaxed) < config.turns) {
+                uint64_t first = nextCase.fetch_add(casesPerBlock);
+                if (first > firstFailure.load(memory_order_relaxed)) break;
+                for (uint64_t index = first; index < first + casesPerBlock; index++) {
+                    if (index > firstFailure.load(memory_order_relaxed)) break;
+                    StressFailure failure;
+                    turns += runner.play(index, nullptr, true, failure, sink);
+                    if (!failure.invariant) continue;
+                    uint64_t seen = firstFailure.load();
+                    while (index < seen && !firstFailure.compare_exchange_weak(seen, index)) {}
+                    break;
+                }
             }
-            
-            item.quantity--;
+        });
+    }
+    auto start = chrono::steady_clock::now();
+    pool.run();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    
+    cout << "Stressed " << turns.load() << " turns on " << threads << " threads in " << fixed << setprecision(3)
+         << seconds << "s (" << setprecision(0) << turns.load() / seconds << " turns/s)\n";
+    if (firstFailure == UINT64_MAX) {
+        cout << "All invariants held over " << nextCase.load() << " cases\n";
+        return 0;
+    }
+    
+    uint64_t index = firstFailure;
+    NullSink sink;
+    vector<StressStep> steps;
+    StressFailure failure;
+    runner.play(index, &steps, true, failure, sink);
+    vector<StressStep> minimal = runner.minimize(index, steps);
+    cout << "Case " << index << " broke \"" << failure.invariant << "\" at step " << failure.step << "\n"
+         << "Minimized to " << minimal.size() << " of " << steps.size() << " steps:";
+    for (const StressStep& step : minimal) cout << " " << describeStep(step) << ";";
+    cout << "\nReplay with --stress --stress-case " << index << " --seed " << config.seed << "\n";
+    return 1;
+}
+
+// The if-chain calculateDamage used before the effectiveness table, kept as a benchmark baseline
+float chainedTypeMultiplier(MonsterType type, MonsterType targetType) {
+    float multiplier = 1.0f;
+    if (type == MonsterType::FIRE && targetType == MonsterType::ICE) multiplier = 1.5f;
+    if (type == MonsterType::ICE && targetType == MonsterType::FIRE) multiplier = 0.5f;
+    if (type == MonsterType::POISON && targetType == MonsterType::UNDEAD) multiplier = 0.5f;
+    if (type == MonsterType::FIRE && targetType == MonsterType::UNDEAD) multiplier = 1.25f;
+    if (type == MonsterType::ICE && targetType == MonsterType::POISON) multiplier = 1.25f;
+    return multiplier;
+}
+
+// Hardware cache-miss counter for the calling thread, when perf_event is available
+class CacheMissCounter {
+private:
+    int fd = -1;
+
+public:
+    CacheMissCounter() {
+        perf_event_attr attr = {};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    CacheMissCounter(const CacheMissCounter&) = delete;
+    CacheMissCounter& operator=(const CacheMissCounter&) = delete;
+    ~CacheMissCounter() {
+        if (fd >= 0) close(fd);
+    }
+    
+    bool available() const { return fd >= 0; }
+    
+    void start() {
+        if (fd < 0) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    
+    uint64_t stop() {
+        uint64_t count = 0;
+        if (fd < 0) return 0;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) count = 0;
+        return count;
+    }
+};
+
+struct BenchResult {
+    string name;
+    long long iterations;
+    double nsPerOp;
+    double allocsPerOp;
+    double cacheMissesPerOp;  // negative without perf_event
+};
+
+// Writes into the void, for timing rendering code without the terminal
+class NullBuffer : public streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char*, streamsize count) override { return count; }
+};
+
+// Times fn over iterations calls, counting heap allocations and cache misses
+template <typename Fn>
+BenchResult benchmark(const string& label, long long iterations, Fn fn) {
+    static CacheMissCounter cacheMisses;
+    iterations = max(iterations, 1LL);
+    uint64_t allocationsBefore = threadAllocations;
+    cacheMisses.start();
+    auto start = chrono::steady_clock::now();
+    for (long long i = 0; i < iterations; i++) fn(i);
+    double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    uint64_t misses = cacheMisses.stop();
+    uint64_t allocations = threadAllocations - allocationsBefore;
+    return {label, iterations, ns / iterations, double(allocations) / iterations,
+            cacheMisses.available() ? double(misses) / iterations : -1.0};
+}
+
+void writeBenchmarks(const vector<BenchResult>& results, bool json, ostream& out) {
+    if (json) {
+        out << "{\"benchmarks\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const BenchResult& r = results[i];
+            out << "  {\"name\": \"" << r.name << "\", \"iterations\": " << r.iterations
+                << fixed << setprecision(3) << ", \"ns_per_op\": " << r.nsPerOp
+                << ", \"allocs_per_op\": " << r.allocsPerOp << ", \"cache_misses_per_op\": ";
+            if (r.cacheMissesPerOp < 0) out << "null";
+            else out << r.cacheMissesPerOp;
+            out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
         }
+        out << "]}\n";
+        return;
     }
+    out << left << setw(44) << "benchmark" << right << setw(14) << "time/op" << setw(12) << "allocs/op"
+        << setw(14) << "misses/op" << "\n";
+    for (const auto& r : results) {
+        bool slow = r.nsPerOp >= 1e6;
+        out << left << setw(44) << r.name << right << fixed << setprecision(2)
+            << setw(11) << (slow ? r.nsPerOp / 1e6 : r.nsPerOp) << (slow ? " ms" : " ns")
+            << setw(12) << r.allocsPerOp << setw(14);
+        if (r.cacheMissesPerOp < 0) out << "n/a";
+        else out << r.cacheMissesPerOp;
+        out << "\n";
+    }
+}
+
+// Micro-benchmarks of the combat hot path. Cheap calls run iterations times, rendering
+// and string building a hundredth of that, bulk operations once.
+int runBenchmarks(long long iterations, bool json, ostream& out) {
+    vector<BenchResult> results;
+    long long heavy = max(iterations / 100, 1LL);
     
-    void updateActiveItems() {
-        vector<int> expiredIndexes;
+    // Random attacker/defender pairs so the branches cannot be predicted
+    Rng rng(1);
+    vector<MonsterType> types(4096);
+    for (auto& type : types) type = MonsterType(rng.below(ELEMENT_COUNT));
+    size_t mask = types.size() - 1;
+    volatile float sink = 0.0f;
+    
+    results.push_back(benchmark("element multiplier (if-chain)", iterations, [&](long long i) {
+        sink = sink + chainedTypeMultiplier(types[i & mask], types[(i + 1) & mask]);
+    }));
+    results.push_back(benchmark("element multiplier (table)", iterations, [&](long long i) {
+        sink = sink + effectiveness(types[i & mask], types[(i + 1) & mask]);
+    }));
+    
+    NullSink nullSink;
+    BattleContext ctx = {&nullSink, scriptedBlock, 0.5f, Rng(1)};
+    Creature attacker(content.monsters[1], 5);
+    attacker.setContext(ctx);
+    Hero hero("Bench");
+    hero.setContext(ctx);
+    giveStartingItems(hero);
+    
+    results.push_back(benchmark("Creature::attaque", iterations, [&](long long) {
+        sink = sink + attacker.attaque(hero);
+    }));
+    results.push_back(benchmark("Creature::calculateDamage", iterations, [&](long long i) {
+        sink = sink + attacker.calculateDamage(10.0f, types[i & mask]);
+    }));
+    results.push_back(benchmark("Hero::calculateDamage", iterations, [&](long long i) {
+        sink = sink + hero.calculateDamage(10.0f, types[i & mask]);
+    }));
+    
+    // Effects last for the whole run
+    const int forever = 1 << 30;
+    for (int effects : {0, 1, 4}) {
+        Creature target(content.monsters[2], 5);
+        target.setContext(ctx);
+        for (int e = 0; e < effects; e++) target.addStatusEffect(EffectId(e), forever, 0.9f, 0.8f);
+        results.push_back(benchmark("Creature::subitDegat (" + to_string(effects) + (effects == 1 ? " effect)" : " effects)"), iterations, [&](long long) {
+            target.subitDegat(10.0f);
+        }));
+        if (effects == 4) {
+            results.push_back(benchmark("Creature::updateStatusEffects (4 effects)", iterations, [&](long long) {
+                target.updateStatusEffects();
+            }));
+        }
+    }
+    
+    // Buffs expire after a few turns, so each use is followed by its ticks
+    Hero buffed("Buffed");
+    buffed.setContext(ctx);
+    ItemId salve = content.findItem("Healing Salve") >= 0 ? content.findItem("Healing Salve") : 0;
+    results.push_back(benchmark("Hero::useItem + updateActiveItems", iterations, [&](long long i) {
+        if ((i & 3) == 0) {
+            buffed.addItem(salve, 1);
+            buffed.useItem(salve);
+        }
+        buffed.updateActiveItems();
+    }));
+    results.push_back(benchmark("Hero::addItem", iterations, [&](long long i) {
+        buffed.addItem(i % content.items.size(), 1);
+    }));
+    results.push_back(benchmark("Creature construction", iterations, [&](long long i) {
+        Creature monster(content.monsters[i % content.monsters.size()], 1 + (i & 7));
+        sink = sink + monster.getPV();
+    }));
+    results.push_back(benchmark("generateMathProblem", heavy, [&](long long) {
+        sink = sink + generateMathProblem(ctx.rng).second;
+    }));
+    
+    // A 10k-monster dungeon wave against a hero who outlasts it
+    WaveConfig waveConfig;
+    waveConfig.firstWave = 10000;
+    Hero champion = makeLevelledHero(100000, ctx);
+    WaveEncounter encounter(waveConfig, champion, ctx.rng);
+    results.push_back(benchmark("wave of " + to_string(waveConfig.firstWave) + " monsters", 1, [&](long long) {
+        encounter.playWave(1);
+    }));
+    
+    NullBuffer nullBuffer;
+    ostream nullStream(&nullBuffer);
+    hero.addStatusEffect(EffectId::BURN, forever, 0.9f, 1.0f);
+    hero.useItem(salve);
+    results.push_back(benchmark("displayBattle (null stream)", heavy, [&](long long) {
+        displayBattle(hero, attacker, nullStream);
+    }));
+    
+    // A designer-sized content pack: 100k monsters and 100k items
+    const int packEntries = 100000;
+    string packText;
+    packText.reserve(packEntries * 120);
+    for (int e = 0; e < int(ELEMENT_COUNT); e++) packText += "element|Element " + to_string(e) + "\n";
+    for (int m = 0; m < 64; m++) packText += "move|Move " + to_string(m) + "|1." + to_string(m % 10) + "\n";
+    for (int i = 0; i < packEntries; i++) {
+        packText += "monster|Monster " + to_string(i) + "|Element " + to_string(i % ELEMENT_COUNT) + "|" +
+                    to_string(10 + i % 40) + "|" + to_string(3 + i % 7) + "|Move " + to_string(i % 64) +
+                    ",Move " + to_string((i + 1) % 64) + "\n";
+        packText += "item|Item " + to_string(i) + "|Restores " + to_string(i % 20) + " HP|" + to_string(i % 4) +
+                    "|" + to_string(i % 20) + "|1.25|1\n";
+    }
+    packText += "hero|Move 0,Move 1\n";
+    ContentPack pack;
+    string error;
+    bool loaded = false;
+    results.push_back(benchmark("load pack (" + to_string(2 * packEntries) + " entries)", 1, [&](long long) {
+        loaded = loadContent(packText, pack, error);
+    }));
+    if (!loaded) {
+        cerr << "Content pack benchmark: " << error << "\n";
+        return 1;
+    }
+    
+    // Checkpointing a host's worth of profiles, mid-battle
+    const size_t profileCount = 10000;
+    vector<PlayerSnapshot> profiles(profileCount);
+    for (size_t i = 0; i < profileCount; i++) {
+        hero.addXP(float(i % 7) * 10.0f);
+        profiles[i] = takeSnapshot(hero, i % 30, &attacker);
+        copyName(profiles[i].hero.base.name, "Hero " + to_string(i));
+    }
+    string path = "/tmp/abattler-bench-" + to_string(getpid()) + ".snap";
+    bool saved = false;
+    results.push_back(benchmark("save " + to_string(profileCount) + " profiles", 1, [&](long long) {
+        saved = writeSnapshots(path, profiles.data(), profiles.size());
+    }));
+    
+    size_t restored = 0;
+    results.push_back(benchmark("map + restore " + to_string(profileCount) + " profiles", 1, [&](long long) {
+        MappedSnapshots mapped;
+        if (!saved || !mapped.open(path)) return;
+        Hero loadedHero("");
+        loadedHero.setContext(ctx);
+        for (size_t i = 0; i < mapped.size(); i++) {
+            int defeated = 0;
+            restored += restoreSnapshot(mapped[i], loadedHero, defeated) != nullptr;
+        }
+    }));
+    unlink(path.c_str());
+    if (restored != profileCount) {
+        cerr << "Snapshot round trip failed\n";
+        return 1;
+    }
+    
+    // A server's worth of finished runs: index build and leaderboard queries
+    const size_t runCount = 1000000;
+    string historyPath = "/tmp/abattler-bench-" + to_string(getpid()) + ".history";
+    {
+        HistoryHeader header = {};
+        memcpy(header.magic, HISTORY_MAGIC, sizeof(header.magic));
+        header.version = HISTORY_VERSION;
+        header.recordSize = sizeof(RunRecord);
+        vector<RunRecord> runs(runCount);
+        for (size_t i = 0; i < runCount; i++) {
+            runs[i] = makeRunRecord("Hero " + to_string(rng.below(100000)), rng.below(200), 1 + rng.below(60), rng.below(500),
+                                    RunMode::SERVER);
+            runs[i].sequence = i;
+            runs[i].checksum = runChecksum(runs[i]);
+        }
+        int fd = open(historyPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            writeAll(fd, &header, sizeof(header));
+            writeAll(fd, runs.data(), runs.size() * sizeof(RunRecord));
+            close(fd);
+        }
+    }
+    size_t indexedRuns = 0;
+    results.push_back(benchmark("index " + to_string(runCount) + " runs", 1, [&](long long) {
+        reindexHistory(historyPath, indexedRuns);
+    }));
+    RunHistory history;
+    if (indexedRuns == runCount && history.open(historyPath)) {
+        results.push_back(benchmark("top 10 of " + to_string(runCount) + " runs", heavy, [&](long long i) {
+            sink = sink + history.top(HistoryKey(i % 3), 10).size();
+        }));
+        results.push_back(benchmark("player history in " + to_string(runCount) + " runs", heavy, [&](long long i) {
+            sink = sink + history.playerRuns("Hero " + to_string(i % 100000), 10).size();
+        }));
+    }
+    unlink(historyPath.c_str());
+    unlink((historyPath + ".idx").c_str());
+    if (indexedRuns != runCount) {
+        cerr << "Run history indexing failed\n";
+        return 1;
+    }
+    
+    writeBenchmarks(results, json, out);
+    return 0;
+}
+
+void displayBattle(const Hero& player, const Creature& monster, ostream& out = cout) {
+    out << string(50, '=') << "\n\n";
+    
+    // Display player status
+    out << "=== " << player.getName() << " ===\n"
+         << "Level: " << player.getNiveau() << "\n"
+         << "HP: " << player.getPV() << "/" << player.getPVMax() << "\n"
+         << "Attack: " << player.getPA() << "\n"
+         << "Combo Points: " << player.getComboPoints() << "\n"
+         << "Stance: " << (player.getIsBlocking() ? "Blocking" : "Normal") << "\n";
+    
+    auto playerEffects = player.getActiveEffects();
+    if (!playerEffects.empty()) {
+        out << "Status Effects:\n";
+        for (const auto& effect : playerEffects) {
+            out << "  - " << effect << "\n";
+        }
+    }
+    
+    auto activeItems = player.getActiveItemsList();
+    if (!activeItems.empty()) {
+        out << "Active Items:\n";
+        for (const auto& item : activeItems) {
+            out << "  - " << item << "\n";
+        }
+    }
+    
+    auto inventory = player.getInventoryList();
+    if (!inventory.empty()) {
+        out << "Inventory:\n";
+        for (int i = 0; i < inventory.size(); i++) {
+            out << "  " << (i+1) << ". " << inventory[i] << "\n";
+        }
+    }
+    
+    out << "\n" << string(25, '-') << "\n\n";
+    
+    // Display monster status
+    out << "=== " << monster.getName() << " ===\n"
+         << "Type: " << content.elementName(monster.getType()) << "\n"
+         << "Level: " << monster.getNiveau() << "\n"
+         << "HP: " << monster.getPV() << "/" << monster.getPVMax() << "\n"
+         << "Attack: " << monster.getPA() << "\n";
+    
+    auto monsterEffects = monster.getActiveEffects();
+    if (!monsterEffects.empty()) {
+        out << "Status Effects:\n";
+        for (const auto& effect : monsterEffects) {
+            out << "  - " << effect << "\n";
+        }
+    }
+    
+    out << "\n" << string(50, '=') << "\n";
+}
+
+// Battle screen for terminals. The panel is formatted into a fixed character grid,
+// diffed against the frame already on screen, and only the changed runs are sent with
+// ANSI cursor addressing, in a single write(). Game text scrolls in a region below it.
+// Nothing is allocated once the renderer exists.
+class FrameRenderer {
+public:
+    static const int ROWS = 20;
+    static const int PANE_WIDTH = 40;  // bytes per pane; two panes per row
+
+private:
+    int fd;
+    char frame[ROWS][2][PANE_WIDTH];
+    char shown[ROWS][2][PANE_WIDTH];
+    bool shownValid = false;
+    char out[ROWS * 2 * (PANE_WIDTH + 16) + 64];
+    size_t outLen = 0;
+
+    static bool isContinuation(char c) { return (c & 0xC0) == 0x80; }
+
+    void append(const char* data, size_t n) {
+        n = min(n, sizeof(out) - outLen);
+        memcpy(out + outLen, data, n);
+        outLen += n;
+    }
+
+    void flushOut() {
+        cout.flush();  // keep ordering with text already written through cout
+        size_t done = 0;
+        while (done < outLen) {
+            ssize_t n = write(fd, out + done, outLen - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += n;
+        }
+        outLen = 0;
+    }
+
+    __attribute__((format(printf, 4, 5)))
+    void put(int row, int pane, const char* format, ...) {
+        char text[PANE_WIDTH + 1];
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+        n = min(max(n, 0), PANE_WIDTH);
+        while (n > 0 && n < PANE_WIDTH && isContinuation(text[n])) n--;  // don't cut a UTF-8 character
+        memcpy(frame[row][pane], text, n);
+        memset(frame[row][pane] + n, ' ', PANE_WIDTH - n);
+    }
+
+    void fill(int row, char c) {
+        memset(frame[row], c, sizeof(frame[row]));
+    }
+
+    void putEffects(int row, int pane, const Creature& creature) {
+        unsigned mask = creature.getEffectMask();
+        if (!mask) return;
+        put(row++, pane, "Status Effects:");
+        for (; mask && row < 13; mask &= mask - 1) {
+            const StatusEffect& effect = creature.getEffect(EffectId(__builtin_ctz(mask)));
+            char dmg[16] = "", def[16] = "";
+            if (effect.damageMultiplier != 1.0f) snprintf(dmg, sizeof(dmg), " ATK x%.2f", effect.damageMultiplier);
+            if (effect.defenseMultiplier != 1.0f) snprintf(def, sizeof(def), " DEF x%.2f", effect.defenseMultiplier);
+            put(row++, pane, "  %s%s%s [%d]", effect.name(), dmg, def, effect.duration);
+        }
+    }
+
+public:
+    explicit FrameRenderer(int fd) : fd(fd) {}
+
+    // Clears the terminal and keeps scrolling text below the panel
+    void begin() {
+        char setup[48];
+        int n = snprintf(setup, sizeof(setup), "\x1b[2J\x1b[%dr\x1b[%d;1H", ROWS + 1, ROWS + 1);
+        append(setup, n);
+        flushOut();
+        shownValid = false;
+    }
+
+    // Gives the whole terminal back to plain scrolling output
+    void end() {
+        append("\x1b[r\x1b[2J\x1b[H", 10);
+        flushOut();
+        shownValid = false;
+    }
+
+    // Clears the text area under the panel
+    void clearLog() {
+        char clear[32];
+        int n = snprintf(clear, sizeof(clear), "\x1b[%d;1H\x1b[J", ROWS + 1);
+        append(clear, n);
+        flushOut();
+    }
+
+    void render(const Hero& player, const Creature& monster) {
+        for (int row = 0; row < ROWS; row++) {
+            memset(frame[row], ' ', sizeof(frame[row]));
+        }
+        fill(0, '=');
+        fill(ROWS - 1, '=');
         
-        // Update and track expired items
-        for (int i = 0; i < activeItems.size(); i++) {
-            Item& item = activeItems[i];
-            
-            // Apply over-time effects
-            if (item.healAmount > 0) {
-                float oldHP = pv;
-                pv = min(pv + item.healAmount, pv_max);
-                cout << item.name << " healed for " << (pv - oldHP) << " HP!\n";
+        put(1, 0, "=== %s ===", player.getName().c_str());
+        put(2, 0, "Level: %d", player.getNiveau());
+        put(3, 0, "HP: %g/%g", player.getPV(), player.getPVMax());
+        put(4, 0, "Attack: %g", player.getPA());
+        put(5, 0, "Combo Points: %d", player.getComboPoints());
+        put(6, 0, "Stance: %s", player.getIsBlocking() ? "Blocking" : "Normal");
+        putEffects(8, 0, player);
+        
+        int row = 13;
+        for (int i = 0; i < player.getBuffCount(); i++) {
+            const ActiveBuff& buff = player.getBuffs()[i];
+            if (row == 13) put(row++, 0, "Active Items:");
+            if (row >= ROWS - 1) break;
+            put(row++, 0, "  %s (%d turns)", content.items[buff.id].getName().c_str(), player.buffTurnsLeft(i));
+        }
+        
+        put(1, 1, "=== %s ===", monster.getName().c_str());
+        put(2, 1, "Type: %s", content.elementName(monster.getType()).c_str());
+        put(3, 1, "Level: %d", monster.getNiveau());
+        put(4, 1, "HP: %g/%g", monster.getPV(), monster.getPVMax());
+        put(5, 1, "Attack: %g", monster.getPA());
+        putEffects(8, 1, monster);
+        
+        row = 13;
+        int number = 1;
+        for (ItemId id = 0; id < content.items.size(); id++) {
+            if (player.getItemCount(id) <= 0) continue;
+            if (row == 13) put(row++, 1, "Inventory:");
+            if (row >= ROWS - 1) break;
+            put(row++, 1, "  %d. %s (x%d)", number++, content.items[id].getName().c_str(), player.getItemCount(id));
+        }
+        
+        append("\x1b" "7", 2);  // save cursor
+        for (int r = 0; r < ROWS; r++) {
+            for (int pane = 0; pane < 2; pane++) {
+                const char* now = frame[r][pane];
+                const char* before = shown[r][pane];
+                int first = 0, last = PANE_WIDTH;
+                if (shownValid) {
+                    while (first < PANE_WIDTH && now[first] == before[first]) first++;
+                    if (first == PANE_WIDTH) continue;
+                    while (now[last - 1] == before[last - 1]) last--;
+                }
+                // Widen the run to whole UTF-8 characters
+                while (first > 0 && (isContinuation(now[first]) || isContinuation(before[first]))) first--;
+                while (last < PANE_WIDTH && (isContinuation(now[last]) || isContinuation(before[last]))) last++;
+                
+                int column = pane * PANE_WIDTH + 1;
+                for (int i = 0; i < first; i++) column += !isContinuation(now[i]);
+                char move[16];
+                int n = snprintf(move, sizeof(move), "\x1b[%d;%dH", r + 1, column);
+                append(move, n);
+                append(now + first, last - first);
             }
-            
-            item.duration--;
-            if (item.duration <= 0) {
-                expiredIndexes.push_back(i);
+        }
+        append("\x1b" "8", 2);  // restore cursor
+        flushOut();
+        
+        memcpy(shown, frame, sizeof(frame));
+        shownValid = true;
+    }
+};
+
+// Set when the battle screen is drawn with FrameRenderer
+FrameRenderer* screen = nullptr;
+
+void showBattle(const Hero& player, const Creature& monster) {
+    PhaseTimer timer(Phase::RENDER);
+    if (screen) screen->render(player, monster);
+    else displayBattle(player, monster);
+}
+
+void clearScreen() {
+    if (screen) screen->clearLog();
+    else cout << string(100, '\n');
+}
+
+void pause(int milliseconds) {
+    PhaseTimer timer(Phase::PAUSE);
+    this_thread::sleep_for(chrono::milliseconds(milliseconds));
+}
+
+void displayGameTitle() {
+    cout << R"(
+ █████        ██████   █████  ████████ ████████ ██      ███████ 
+██   ██       ██   ██ ██   ██    ██       ██    ██      ██      
+███████ █████ ██████  ███████    ██  🦊   ██    ██      █████   
+██   ██       ██   ██ ██   ██    ██       ██    ██      ██      
+██   ██       ██████  ██   ██    ██       ██    ███████ ███████ 
+    )" << "\n";
+}
+
+void displayTutorial() {
+    cout << "\n=== GAME TUTORIAL ===\n"
+         << "1. COMBAT BASICS:\n"
+         << "   - Attack to build combo points\n"
+         << "   - Use special moves when you have 3+ combo points\n"
+         << "   - Block with correct math answers to reduce damage\n"
+         << "   - Use items to heal or gain temporary buffs\n\n"
+         << "2. ELEMENT SYSTEM:\n"
+         << "   - Fire beats Ice\n"
+         << "   2 Ice > Poison\n"
+         << "   - Fire > Undead\n"
+         << "   D Poison is weak vs Undead\n\n"
+         << "3. STATUS EFFECTS:\n"
+         << "   - Burn: Reduces attack power\n"
+         << "   - Frozen: Reduces defense\n"
+         << "   - Poison: Reduces both attack and defense\n"
+         << "   - Curse: Severely reduces both stats\n\n"
+         << "4. ITEMS:\n"
+         << "   - Health Potion: Instant healing\n"
+         << "   - Healing Salve: Healing over time\n"
+         << "   - Warrior's Elixir: Temporary attack boost\n"
+         << "   - Stone Skin Potion: Temporary defense boost\n"
+         << "   - Battle Flask: Temporary attack and defense boost\n\n"
+         << "Press Enter to continue...";
+    waitForEnter();
+}
+
+const char* const battleMenu =
+    "\nYour turn! Choose action:\n"
+    "1. Attack (Build combo)\n"
+    "2. Special Move (Requires 3+ combo points)\n"
+    "3. Block Stance\n"
+    "4. Use Item\n"
+    "5. Try to Run\n"
+    "Choice: ";
+
+// One connected player. The battle advances as lines and timers arrive; nothing blocks.
+struct Session {
+    enum class State {
+        NAME,       // waiting for the hero's name
+        CHOICE,     // waiting for a menu choice
+        ITEM,       // waiting for an inventory slot
+        BLOCK,      // waiting for the block challenge answer
+        WAITING,    // a timer drives the next step; input stays queued
+        VICTORY,    // waiting for Enter
+        CLOSING     // close once the output is flushed
+    };
+    
+    // What the pending timer does when it fires
+    enum class Timer { NONE, MONSTER_TURN, PLAYER_PROMPT, BLOCK_TIMEOUT, NEXT_BATTLE };
+    
+    int fd;
+    State state = State::NAME;
+    Timer timer = Timer::NONE;
+    uint64_t timerToken = 0;
+    string in, out;
+    ostringstream text;
+    TextSink sink;
+    BattleContext ctx;
+    unique_ptr<Hero> player;
+    unique_ptr<Creature> monster;
+    int monstersDefeated = 0;
+    
+    chrono::steady_clock::time_point promptedAt;  // for the input wait stats
+    int blockAnswer = 0;
+    chrono::steady_clock::time_point blockStart;
+    bool blockPrepared = false;
+    BlockAttempt preparedBlock = {};
+    
+    Session(int fd, uint64_t seed, uint64_t stream)
+        : fd(fd), sink(text), ctx{&sink, preparedBlockAttempt, 0.0f, Rng(seed, stream)} {
+        ctx.owner = this;
+    }
+    
+    // The answer is collected before the monster's turn resolves; a block the
+    // session did not prepare for (a backstab while still in stance) counts as unanswered
+    static BlockAttempt preparedBlockAttempt(BattleContext& ctx) {
+        Session& session = *static_cast<Session*>(ctx.owner);
+        if (!session.blockPrepared) return {false, false, 0, float(BLOCK_TIMEOUT_MS)};
+        session.blockPrepared = false;
+        return session.preparedBlock;
+    }
+};
+
+// Line-oriented game server on TCP or a Unix socket. One epoll loop drives every
+// session; a timer heap replaces pause() and the block challenge timeout.
+class BattleServer {
+private:
+    struct TimerEntry {
+        chrono::steady_clock::time_point when;
+        int fd;
+        uint64_t token;
+        bool operator>(const TimerEntry& other) const { return when > other.when; }
+    };
+    
+    int epfd = -1;
+    int listenFd = -1;
+    unordered_map<int, unique_ptr<Session>> sessions;
+    priority_queue<TimerEntry, vector<TimerEntry>, greater<TimerEntry>> timers;
+    uint64_t nextToken = 1;
+    uint64_t nextStream = 0;
+    uint64_t seed;
+    int turnDelayMs;
+    
+    string historyPath;  // finished runs are appended here
+    
+    // Saved profiles, checkpointed at each prompt and written out every few seconds
+    string savePath;
+    unordered_map<string, PlayerSnapshot> profiles;
+    bool profilesDirty = false;
+    chrono::steady_clock::time_point nextFlush;
+    static const int FLUSH_INTERVAL_MS = 5000;
+    
+    static const size_t MAX_LINE = 256;
+    
+    void watch(int fd, uint32_t events, int op) {
+        epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = fd;
+        epoll_ctl(epfd, op, fd, &ev);
+    }
+    
+    void schedule(Session& s, Session::Timer what, int delayMs) {
+        s.timer = what;
+        s.timerToken = nextToken++;
+        timers.push({chrono::steady_clock::now() + chrono::milliseconds(delayMs), s.fd, s.timerToken});
+    }
+    
+    void send(Session& s, const string& data) {
+        s.out += data;
+    }
+    
+    // Moves the text rendered by the session's sink into its output buffer
+    void flushText(Session& s) {
+        s.out += s.text.str();
+        s.text.str("");
+    }
+    
+    void writeOut(Session& s) {
+        while (!s.out.empty()) {
+            ssize_t n = ::send(s.fd, s.out.data(), s.out.size(), MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n <= 0) {
+                s.state = Session::State::CLOSING;
+                s.out.clear();
+                break;
+            }
+            s.out.erase(0, n);
+        }
+        watch(s.fd, uint32_t(EPOLLIN) | (s.out.empty() ? 0u : uint32_t(EPOLLOUT)), EPOLL_CTL_MOD);
+    }
+    
+    void closeSession(int fd) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        sessions.erase(fd);
+    }
+    
+    void startBattle(Session& s) {
+        int monsterIndex = s.ctx.rng.below(content.monsters.size());
+        int monsterLevel = 1 + (s.monstersDefeated / 3);
+        s.monster = make_unique<Creature>(content.monsters[monsterIndex], monsterLevel);
+        s.monster->setContext(s.ctx);
+        countStat(Counter::BATTLES);
+        
+        ostringstream intro;
+        intro << "\nA level " << s.monster->getNiveau() << " "
+              << content.elementName(s.monster->getType()) << " "
+              << s.monster->getName() << " appears!\n\n";
+        send(s, intro.str());
+        promptPlayer(s);
+    }
+    
+    void checkpoint(Session& s) {
+        if (savePath.empty()) return;
+        PlayerSnapshot snapshot = takeSnapshot(*s.player, s.monstersDefeated, s.monster.get());
+        profiles[profileKey(s.player->getName())] = snapshot;
+        profilesDirty = true;
+    }
+    
+    void flushProfiles() {
+        vector<PlayerSnapshot> records;
+        records.reserve(profiles.size());
+        for (const auto& [name, snapshot] : profiles) records.push_back(snapshot);
+        if (!writeSnapshots(savePath, records.data(), records.size())) {
+            cerr << "Cannot save profiles to " << savePath << ": " << strerror(errno) << "\n";
+        }
+        profilesDirty = false;
+    }
+    
+    void promptPlayer(Session& s) {
+        checkpoint(s);
+        countStat(Counter::TURNS);
+        {
+            PhaseTimer timer(Phase::RENDER);
+            displayBattle(*s.player, *s.monster, s.text);
+        }
+        flushText(s);
+        send(s, battleMenu);
+        s.state = Session::State::CHOICE;
+        s.promptedAt = chrono::steady_clock::now();
+    }
+    
+    // After the hero acted: victory, escape or the monster's turn
+    void afterHeroTurn(Session& s, bool battleContinues) {
+        flushText(s);
+        if (!battleContinues) {
+            s.state = Session::State::WAITING;
+            schedule(s, Session::Timer::NEXT_BATTLE, turnDelayMs);
+        } else if (!s.monster->estVivant()) {
+            claimVictory(*s.player, *s.monster);
+            s.monstersDefeated++;
+            checkpoint(s);
+            flushText(s);
+            send(s, "\nPress Enter to continue...");
+            s.state = Session::State::VICTORY;
+            s.promptedAt = chrono::steady_clock::now();
+        } else {
+            s.state = Session::State::WAITING;
+            schedule(s, Session::Timer::MONSTER_TURN, turnDelayMs);
+        }
+    }
+    
+    void beginMonsterTurn(Session& s) {
+        {
+            PhaseTimer timer(Phase::RENDER);
+            displayBattle(*s.player, *s.monster, s.text);
+        }
+        flushText(s);
+        if (!s.player->getIsBlocking()) {
+            resolveMonsterTurn(s);
+            return;
+        }
+        auto [problem, answer] = generateMathProblem(s.ctx.rng);
+        s.blockAnswer = answer;
+        s.blockStart = chrono::steady_clock::now();
+        send(s, "\nQuick! Solve this problem to block effectively!\n" + problem +
+                " = ? (" + to_string(BLOCK_TIMEOUT_MS / 1000) + " seconds to answer!)\n");
+        s.state = Session::State::BLOCK;
+        schedule(s, Session::Timer::BLOCK_TIMEOUT, BLOCK_TIMEOUT_MS);
+    }
+    
+    void answerBlock(Session& s, bool answered, const string& input) {
+        auto elapsed = chrono::steady_clock::now() - s.blockStart;
+        recordPhase(Phase::BLOCK_WAIT, elapsed);
+        float reactionMs = chrono::duration<float, milli>(elapsed).count();
+        bool correct = false;
+        if (answered) {
+            try {
+                correct = stoi(input) == s.blockAnswer;
+            } catch (...) {
             }
         }
+        s.preparedBlock = {answered, correct, s.blockAnswer, reactionMs};
+        s.blockPrepared = true;
+        resolveMonsterTurn(s);
+    }
+    
+    void resolveMonsterTurn(Session& s) {
+        monsterTurn(*s.player, *s.monster);
+        s.blockPrepared = false;
+        flushText(s);
         
-        // Remove expired items (in reverse order to maintain indexes)
-        for (int i = expiredIndexes.size() - 1; i >= 0; i--) {
-            cout << activeItems[expiredIndexes[i]].name << " effect has worn off!\n";
-            activeItems.erase(activeItems.begin() + expiredIndexes[i]);
+        if (!s.player->estVivant()) {
+            if (profiles.erase(profileKey(s.player->getName()))) profilesDirty = true;
+            ostringstream summary;
+            summary << "\nGAME OVER\n\nFinal Statistics:\n"
+                    << "Monsters Defeated: " << s.monstersDefeated << "\n"
+                    << "Final Level: " << s.player->getNiveau() << "\n"
+                    << "Successful Blocks: " << s.player->getSuccessfulBlocks() << "\n\n";
+            send(s, summary.str());
+            recordRun(historyPath, *s.player, s.monstersDefeated, RunMode::SERVER);
+            s.state = Session::State::CLOSING;
+            s.timer = Session::Timer::NONE;
+            return;
         }
+        s.state = Session::State::WAITING;
+        schedule(s, Session::Timer::PLAYER_PROMPT, turnDelayMs);
     }
     
-    float calculateDamage(float baseDamage, MonsterType targetType) override {
-        float multiplier = Creature::calculateDamage(baseDamage, targetType);
-        
-        // Apply item buffs
-        for (const auto& item : activeItems) {
-            multiplier *= item.attackBuff;
+    static int parseNumber(const string& line) {
+        try {
+            return stoi(line);
+        } catch (...) {
+            return 0;
         }
-        
-        return multiplier;
     }
-
-    void subitDegat(float degat) override {
-        if (isBlocking) {
-            cout << "\nQuick! Solve this problem to block effectively!\n";
-            auto [problem, correct_answer] = generateMathProblem();
-            cout << problem << " = ? (5 seconds to answer!)\n";
-            
-            int user_answer;
-            bool answered = getAnswerWithTimeout(user_answer, 5);
-            
-            if (answered && user_answer == correct_answer) {
-                cout << "Correct! Perfect block!\n";
-                successful_blocks++;
-                float reducedDamage = degat * 0.3f;
-                
-                // Apply item defense buffs to blocked damage
-                for (const auto& item : activeItems) {
-                    reducedDamage *= (2.0f - item.defenseBuff);
+    
+    void onLine(Session& s, const string& line) {
+        if (line == "quit") {
+            s.state = Session::State::CLOSING;
+            return;
+        }
+        if (line == "stats" && statsEnabled) {
+            ostringstream report;
+            report << "\n";
+            writeStats(report);
+            send(s, report.str());
+            return;
+        }
+        if (s.state == Session::State::CHOICE || s.state == Session::State::ITEM ||
+            s.state == Session::State::VICTORY) {
+            recordPhase(Phase::INPUT_WAIT, chrono::steady_clock::now() - s.promptedAt);
+        }
+        switch (s.state) {
+            case Session::State::NAME: {
+                s.player = make_unique<Hero>(line.empty() ? string("Hero") : line);
+                s.player->setContext(s.ctx);
+                auto saved = profiles.find(profileKey(s.player->getName()));
+                if (saved == profiles.end()) {
+                    giveStartingItems(*s.player);
+                    flushText(s);
+                    startBattle(s);
+                    break;
                 }
-                
-                pv = pv - reducedDamage;
-                cout << name << " blocked most of the damage! Only took " << reducedDamage << " damage!\n";
-            } else {
-                if (!answered) cout << "Time's up! Block failed!\n";
-                else cout << "Wrong answer! Block failed!\n";
-                cout << "The correct answer was: " << correct_answer << "\n";
-                
-                float finalDamage = degat;
-                // Apply item defense buffs to failed block
-                for (const auto& item : activeItems) {
-                    finalDamage *= (2.0f - item.defenseBuff);
+                s.monster = restoreSnapshot(saved->second, *s.player, s.monstersDefeated);
+                send(s, "Welcome back, " + s.player->getName() + "!\n");
+                if (s.monster) {
+                    countStat(Counter::BATTLES);
+                    promptPlayer(s);
+                } else {
+                    startBattle(s);
                 }
-                pv = pv - finalDamage;
-                cout << name << " took " << finalDamage << " damage!\n";
+                break;
             }
-        } else {
-            float finalDamage = degat;
-            // Apply item defense buffs
-            for (const auto& item : activeItems) {
-                finalDamage *= (2.0f - item.defenseBuff);
+            case Session::State::CHOICE: {
+                int choice = parseNumber(line);
+                switch (choice) {
+                    case 1:
+                    case 2:
+                    case 3:
+                    case 5:
+                        afterHeroTurn(s, heroTurn(*s.player, *s.monster, HeroAction(choice)));
+                        break;
+                    case 4: {
+                        size_t available = s.player->getAvailableItems().size();
+                        if (available == 0) {
+                            send(s, "No items in inventory!\n");
+                            s.player->setBlocking(false);
+                            afterHeroTurn(s, true);
+                        } else {
+                            send(s, "Choose item to use (1-" + to_string(available) + "): ");
+                            s.state = Session::State::ITEM;
+                            s.promptedAt = chrono::steady_clock::now();
+                        }
+                        break;
+                    }
+                    default:
+                        send(s, "Invalid choice! Turn skipped.\n");
+                        s.player->setBlocking(false);
+                        afterHeroTurn(s, true);
+                }
+                break;
             }
-            pv = pv - finalDamage;
-            cout << name << " took " << finalDamage << " damage!\n";
+            case Session::State::ITEM: {
+                int itemChoice = parseNumber(line);
+                auto available = s.player->getAvailableItems();
+                if (itemChoice > 0 && itemChoice <= int(available.size())) {
+                    heroTurn(*s.player, *s.monster, HeroAction::ITEM, available[itemChoice - 1]);
+                } else {
+                    send(s, "Invalid item choice!\n");
+                    s.player->setBlocking(false);
+                }
+                afterHeroTurn(s, true);
+                break;
+            }
+            case Session::State::BLOCK:
+                answerBlock(s, true, line);
+                break;
+            case Session::State::VICTORY:
+                startBattle(s);
+                break;
+            case Session::State::WAITING:
+            case Session::State::CLOSING:
+                break;
         }
     }
-
-    string performHeroSpecialMove(Creature& target) {
-        if (comboPoints < 3) {
-            return "Not enough combo points! (Need 3, have " + to_string(comboPoints) + ")";
+    
+    // Handles complete lines while the session is waiting for input
+    void processInput(Session& s) {
+        while (s.state != Session::State::WAITING && s.state != Session::State::CLOSING) {
+            size_t newline = s.in.find('\n');
+            if (newline == string::npos) break;
+            string line = s.in.substr(0, newline);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            s.in.erase(0, newline + 1);
+            onLine(s, line);
         }
-        
-        int moveIndex = min((comboPoints - 3), (int)heroSpecialMoves.size() - 1);
-        auto [moveName, multiplier] = heroSpecialMoves[moveIndex];
-        float damage = pa * multiplier * (1.0f + float(successful_blocks) / 10.0f);
-        
-        target.subitDegat(calculateDamage(damage, target.getType()));
-        resetCombo();
-        return moveName;
     }
-
-    void addXP(float gained_xp) {
-        xp += gained_xp;
-        cout << "\nGained " << gained_xp << " XP!\n";
-        
-        while (xp >= 100.0) {
-            niveau++;
-            pv_max += 10;
-            pa += 3;
-            xp -= 100.0;
-            cout << "\nLEVEL UP! You are now level " << niveau << "!\n";
-            cout << "Max HP increased by 5!\n";
-            cout << "Attack increased by 2!\n";
-            
-            pv = pv_max;
-            cout << "You've been fully healed!\n";
+    
+    void onTimer(Session& s) {
+        Session::Timer what = s.timer;
+        s.timer = Session::Timer::NONE;
+        switch (what) {
+            case Session::Timer::MONSTER_TURN:
+                beginMonsterTurn(s);
+                break;
+            case Session::Timer::PLAYER_PROMPT:
+                promptPlayer(s);
+                break;
+            case Session::Timer::BLOCK_TIMEOUT:
+                answerBlock(s, false, "");
+                break;
+            case Session::Timer::NEXT_BATTLE:
+                startBattle(s);
+                break;
+            case Session::Timer::NONE:
+                break;
         }
-        
-        cout << "XP Progress: " << xp << "/100\n";
     }
     
-    vector<string> getInventoryList() const {
-        vector<string> list;
-        for (const auto& item : inventory) {
-            if (item.quantity > 0) {
-                list.push_back(item.getDescription());
-            }
+    // Flushes output, closes finished sessions and drains queued input
+    void settle(int fd) {
+        auto it = sessions.find(fd);
+        if (it == sessions.end()) return;
+        Session& s = *it->second;
+        processInput(s);
+        writeOut(s);
+        if (s.state == Session::State::CLOSING && s.out.empty()) closeSession(fd);
+    }
+    
+    void acceptClients() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) break;
+            auto session = make_unique<Session>(fd, seed, nextStream++);
+            Session& s = *session;
+            sessions[fd] = move(session);
+            watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+            send(s, "Welcome to A-Battle!\nEnter your hero's name: ");
+            writeOut(s);
         }
-        return list;
     }
     
-    vector<string> getActiveItemsList() const {
-        vector<string> list;
-        for (const auto& item : activeItems) {
-            list.push_back(item.name + " (" + to_string(item.duration) + " turns remaining)");
+    void readClient(Session& s) {
+        char chunk[4096];
+        while (true) {
+            ssize_t n = recv(s.fd, chunk, sizeof(chunk), 0);
+            if (n > 0) {
+                s.in.append(chunk, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            s.state = Session::State::CLOSING;  // peer closed or failed
+            s.out.clear();
+            break;
+        }
+        if (s.in.size() > MAX_LINE && s.in.find('\n') == string::npos) {
+            s.state = Session::State::CLOSING;
+            s.out.clear();
         }
-        return list;
     }
-};
 
-void displayBattle(const Hero& player, const Creature& monster) {
-    cout << string(50, '=') << "\n\n";
+public:
+    BattleServer(uint64_t seed, int turnDelayMs) : seed(seed), turnDelayMs(turnDelayMs) {}
     
-    // Display player status
-    cout << "=== " << player.getName() << " ===\n"
-         << "Level: " << player.getNiveau() << "\n"
-         << "HP: " << player.getPV() << "/" << player.getPVMax() << "\n"
-         << "Attack: " << player.getPA() << "\n"
-         << "Combo Points: " << player.getComboPoints() << "\n"
-         << "Stance: " << (player.getIsBlocking() ? "Blocking" : "Normal") << "\n";
+    // Loads the profiles saved at path and checkpoints players there from now on
+    void setHistory(const string& path) { historyPath = path; }
     
-    auto playerEffects = player.getActiveEffects();
-    if (!playerEffects.empty()) {
-        cout << "Status Effects:\n";
-        for (const auto& effect : playerEffects) {
-            cout << "  - " << effect << "\n";
+    size_t loadProfiles(const string& path) {
+        savePath = path;
+        MappedSnapshots saved;
+        if (!saved.open(path)) return 0;
+        profiles.reserve(saved.size());
+        for (size_t i = 0; i < saved.size(); i++) {
+            profiles[readName(saved[i].hero.base.name)] = saved[i];
         }
+        return profiles.size();
     }
     
-    auto activeItems = player.getActiveItemsList();
-    if (!activeItems.empty()) {
-        cout << "Active Items:\n";
-        for (const auto& item : activeItems) {
-            cout << "  - " << item << "\n";
+    // address is a TCP port (bound to host) or, when it contains a '/', a Unix socket path
+    bool listenOn(const string& address, const string& host) {
+        if (address.find('/') != string::npos) {
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            if (address.size() >= sizeof(addr.sun_path)) return false;
+            strcpy(addr.sun_path, address.c_str());
+            unlink(address.c_str());
+            listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listenFd < 0 || bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0) return false;
+        } else {
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            char* end;
+            long port = strtol(address.c_str(), &end, 10);
+            if (end == address.c_str() || *end != '\0' || port < 0 || port > 65535) {
+                errno = EINVAL;
+                return false;
+            }
+            addr.sin_port = htons(uint16_t(port));
+            if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) return false;
+            listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int yes = 1;
+            setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            if (listenFd < 0 || bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0) return false;
         }
+        if (listen(listenFd, SOMAXCONN) < 0) return false;
+        
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        watch(listenFd, EPOLLIN, EPOLL_CTL_ADD);
+        return epfd >= 0;
     }
     
-    auto inventory = player.getInventoryList();
-    if (!inventory.empty()) {
-        cout << "Inventory:\n";
-        for (int i = 0; i < inventory.size(); i++) {
-            cout << "  " << (i+1) << ". " << inventory[i] << "\n";
+    void run() {
+        epoll_event events[256];
+        while (true) {
+            int timeoutMs = -1;
+            if (!timers.empty()) {
+                auto wait = timers.top().when - chrono::steady_clock::now();
+                timeoutMs = max<long long>(0, chrono::ceil<chrono::milliseconds>(wait).count());
+            }
+            if (profilesDirty && (timeoutMs < 0 || timeoutMs > FLUSH_INTERVAL_MS)) timeoutMs = FLUSH_INTERVAL_MS;
+            int n = epoll_wait(epfd, events, 256, timeoutMs);
+            if (n < 0 && errno != EINTR) break;
+            
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                if (fd == listenFd) {
+                    acceptClients();
+                    continue;
+                }
+                auto it = sessions.find(fd);
+                if (it == sessions.end()) continue;
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) readClient(*it->second);
+                settle(fd);
+            }
+            
+            auto now = chrono::steady_clock::now();
+            while (!timers.empty() && timers.top().when <= now) {
+                TimerEntry entry = timers.top();
+                timers.pop();
+                auto it = sessions.find(entry.fd);
+                if (it == sessions.end() || it->second->timerToken != entry.token) continue;  // stale
+                onTimer(*it->second);
+                settle(entry.fd);
+            }
+            
+            if (profilesDirty && now >= nextFlush) {
+                flushProfiles();
+                nextFlush = now + chrono::milliseconds(FLUSH_INTERVAL_MS);
+            }
         }
     }
+};
+
+int runServer(const string& address, const string& host, uint64_t seed, int turnDelayMs, const string& savePath,
+              const string& historyPath) {
+    // Idle players each hold a socket
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
     
-    cout << "\n" << string(25, '-') << "\n\n";
+    BattleServer server(seed, turnDelayMs);
+    server.setHistory(historyPath);
+    if (!savePath.empty()) {
+        size_t loaded = server.loadProfiles(savePath);
+        cerr << "Loaded " << loaded << " profiles from " << savePath << "\n";
+    }
+    if (!server.listenOn(address, host)) {
+        cerr << "Cannot listen on " << address << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+    cerr << "Battle server listening on " << address << "\n";
+    server.run();
+    return 0;
+}
+
+void writeFinalStatistics(ostream& out, const Hero& player, int monstersDefeated) {
+    out << "Final Statistics:\n"
+        << "Monsters Defeated: " << monstersDefeated << "\n"
+        << "Final Level: " << player.getNiveau() << "\n"
+        << "Successful Blocks: " << player.getSuccessfulBlocks() << "\n\n";
+}
+
+// Shows the battle screen before every Nth decision of the wrapped policy
+class SampledRenderPolicy : public BattlePolicy {
+private:
+    BattlePolicy& policy;
+    long long every;
+    long long decisions = 0;
+
+public:
+    SampledRenderPolicy(BattlePolicy& policy, long long every) : policy(policy), every(every) {}
     
-    // Display monster status
-    cout << "=== " << monster.getName() << " ===\n"
-         << "Type: " << elementNames[monster.getType()] << "\n"
-         << "Level: " << monster.getNiveau() << "\n"
-         << "HP: " << monster.getPV() << "/" << monster.getPVMax() << "\n"
-         << "Attack: " << monster.getPA() << "\n";
+    HeroAction choose(const Hero& player, const Creature& monster, ItemId& item) override {
+        if (every > 0 && decisions++ % every == 0) showBattle(player, monster);
+        return policy.choose(player, monster, item);
+    }
+};
+
+struct AutoConfig {
+    int targetLevel = 0;        // 0 = until the hero falls
+    long long maxBattles = 0;   // 0 = no limit
+    string policy = "scripted"; // or "mcts"
+    float healBelow = 0.3f;
+    int specialAt = 3;
+    float blockSuccessRate = 0.5f;
+    long long renderEvery = 0;  // battle screen every N hero turns, 0 = never
+    bool plain = false;
+    MctsConfig mcts;
+    string name = "Auto Hero";
+    string recordPath;
+    string historyPath;
+    uint64_t seed = 0;
+};
+
+// Fast-forward grinding: the game's campaign (random monster, level 1 + defeated / 3)
+// played by a policy with no input and no pauses, until the hero falls or reaches the
+// target level; then the game's final statistics
+int runAuto(const AutoConfig& config) {
+    CountingSink counter;
+    BattleContext ctx = {&counter, scriptedBlock, config.blockSuccessRate, Rng(config.seed)};
+    Hero player(config.name);
+    player.setContext(ctx);
+    giveStartingItems(player);
     
-    auto monsterEffects = monster.getActiveEffects();
-    if (!monsterEffects.empty()) {
-        cout << "Status Effects:\n";
-        for (const auto& effect : monsterEffects) {
-            cout << "  - " << effect << "\n";
+    unique_ptr<BattlePolicy> chosen;
+    if (config.policy == "mcts") {
+        chosen = make_unique<MctsPolicy>(config.mcts);
+    } else if (config.policy == "scripted") {
+        auto scripted = make_unique<ScriptedPolicy>();
+        scripted->healBelow = config.healBelow;
+        scripted->specialAt = config.specialAt;
+        chosen = move(scripted);
+    } else {
+        cerr << "Unknown policy " << config.policy << " (scripted or mcts)\n";
+        return 1;
+    }
+    
+    BattleRecorder recorder;
+    if (!config.recordPath.empty() && !recorder.start(config.recordPath, player, 0, nullptr)) {
+        cerr << "Cannot write battle log " << config.recordPath << "\n";
+        return 1;
+    }
+    RecordingPolicy recordingPolicy(*chosen, recorder);
+    BattlePolicy& acting = recorder.recording() ? static_cast<BattlePolicy&>(recordingPolicy) : *chosen;
+    SampledRenderPolicy policy(acting, config.renderEvery);
+    
+    FrameRenderer renderer(STDOUT_FILENO);
+    if (config.renderEvery > 0 && isatty(STDOUT_FILENO) && !config.plain) {
+        screen = &renderer;
+        screen->begin();
+    }
+    
+    int monstersDefeated = 0;
+    long long battles = 0, escapes = 0, turns = 0;
+    auto start = chrono::steady_clock::now();
+    while (player.estVivant() && (config.targetLevel <= 0 || player.getNiveau() < config.targetLevel) &&
+           (config.maxBattles <= 0 || battles < config.maxBattles)) {
+        int monsterIndex = ctx.rng.below(content.monsters.size());
+        int monsterLevel = 1 + (monstersDefeated / 3);
+        Creature monster(content.monsters[monsterIndex], monsterLevel);
+        monster.setContext(ctx);
+        if (recorder.recording()) recorder.battle(monster);
+        
+        BattleResult result = runBattle(player, monster, policy);
+        battles++;
+        turns += result.turns;
+        if (result.heroWon) {
+            claimVictory(player, monster);
+            monstersDefeated++;
+        } else if (result.escaped) {
+            escapes++;
         }
+        if (recorder.recording() && battles % 1024 == 0) recorder.flush();
+    }
+    recorder.stop();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (screen) {
+        screen->end();
+        screen = nullptr;
     }
     
-    cout << "\n" << string(50, '=') << "\n";
+    writeFinalStatistics(cout, player, monstersDefeated);
+    recordRun(config.historyPath, player, monstersDefeated, RunMode::AUTO);
+    cout << (player.estVivant() ? "Reached level " + to_string(player.getNiveau()) : string("The hero has fallen"))
+         << " after " << battles << " battles (" << escapes << " escapes, " << turns << " turns) in "
+         << fixed << setprecision(3) << seconds << "s, " << setprecision(0) << battles / max(seconds, 1e-9)
+         << " battles/s\n";
+    return 0;
 }
 
-void clearScreen() {
-    cout << string(100, '\n');
+// Command-line options: "--name value" or a bare "--name"
+map<string, string> parseOptions(int argc, char* argv[]) {
+    map<string, string> options;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) continue;
+        string value;
+        if (i + 1 < argc && string(argv[i + 1]).rfind("--", 0) != 0) {
+            value = argv[++i];
+        }
+        options[arg.substr(2)] = value;
+    }
+    return options;
 }
 
-void pause(int milliseconds) {
-    this_thread::sleep_for(chrono::milliseconds(milliseconds));
+// A malformed number ("--seed abc", "--sim 10x") is a usage error, not an exception out of main
+[[noreturn]] void invalidOption(const string& name) {
+    cerr << "invalid value for --" << name << "\n";
+    exit(1);
 }
 
-void displayGameTitle() {
-    cout << R"(
- █████        ██████   █████  ████████ ████████ ██      ███████ 
-██   ██       ██   ██ ██   ██    ██       ██    ██      ██      
-███████ █████ ██████  ███████    ██  🦊   ██    ██      █████   
-██   ██       ██   ██ ██   ██    ██       ██    ██      ██      
-██   ██       ██████  ██   ██    ██       ██    ███████ ███████ 
-    )" << "\n";
+long long optionInt(const map<string, string>& options, const string& name, long long fallback) {
+    auto it = options.find(name);
+    if (it == options.end() || it->second.empty()) return fallback;
+    const char* text = it->second.c_str();
+    char* end;
+    errno = 0;
+    long long value = strtoll(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE) invalidOption(name);
+    return value;
 }
 
-void displayTutorial() {
-    cout << "\n=== GAME TUTORIAL ===\n"
-         << "1. COMBAT BASICS:\n"
-         << "   - Attack to build combo points\n"
-         << "   - Use special moves when you have 3+ combo points\n"
-         << "   - Block with correct math answers to reduce damage\n"
-         << "   - Use items to heal or gain temporary buffs\n\n"
-         << "2. ELEMENT SYSTEM:\n"
-         << "   - Fire beats Ice\n"
-         << "   2 Ice > Poison\n"
-         << "   - Fire > Undead\n"
-         << "   D Poison is weak vs Undead\n\n"
-         << "3. STATUS EFFECTS:\n"
-         << "   - Burn: Reduces attack power\n"
-         << "   - Frozen: Reduces defense\n"
-         << "   - Poison: Reduces both attack and defense\n"
-         << "   - Curse: Severely reduces both stats\n\n"
-         << "4. ITEMS:\n"
-         << "   - Health Potion: Instant healing\n"
-         << "   - Healing Salve: Healing over time\n"
-         << "   - Warrior's Elixir: Temporary attack boost\n"
-         << "   - Stone Skin Potion: Temporary defense boost\n"
-         << "   - Battle Flask: Temporary attack and defense boost\n\n"
-         << "Press Enter to continue...";
-    cin.get();
+float optionFloat(const map<string, string>& options, const string& name, float fallback) {
+    auto it = options.find(name);
+    if (it == options.end() || it->second.empty()) return fallback;
+    const char* text = it->second.c_str();
+    char* end;
+    errno = 0;
+    float value = strtof(text, &end);
+    if (end == text || *end != '\0' || errno == ERANGE || !isfinite(value)) invalidOption(name);
+    return value;
+}
+
+string optionString(const map<string, string>& options, const string& name, const string& fallback) {
+    auto it = options.find(name);
+    return (it == options.end() || it->second.empty()) ? fallback : it->second;
 }
 
-int main() {
-    srand(time(nullptr));
+int main(int argc, char* argv[]) {
+    auto options = parseOptions(argc, argv);
+    uint64_t seed = optionInt(options, "seed", time(nullptr));
+    consoleContext.rng.reseed(seed);
+    cacheChecks = options.count("check-cache") > 0;
+    
+    // Headless runs sample the turn phases so timing them stays cheap
+    if (options.count("stats")) {
+        bool headless = options.count("sim") || options.count("balance") || options.count("replay") || options.count("waves") ||
+                        options.count("auto") || options.count("stress") || options.count("tune");
+        statsEnabled = true;
+        statsSampleEvery = max<long long>(1, optionInt(options, "stats", headless ? 1024 : 1));
+        startStatsReporter();
+        atexit([] { writeStats(cerr); });
+    }
+    
+    if (options.count("content")) {
+        string error;
+        if (!loadContentFile(optionString(options, "content", ""), content, error)) {
+            cerr << "Content pack: " << error << "\n";
+            return 1;
+        }
+    }
+    
+    if (options.count("sim")) {
+        return runSimulation(optionInt(options, "sim", 100000), seed, optionString(options, "record", ""));
+    }
+    
+    if (options.count("mcts")) {
+        MctsConfig config;
+        config.iterations = optionInt(options, "rollouts", config.iterations);
+        config.thinkMs = optionInt(options, "think-ms", config.thinkMs);
+        config.threads = optionInt(options, "threads", config.threads);
+        config.seed = seed;
+        return runMcts(optionInt(options, "mcts", 100), seed, config);
+    }
+    
+    if (options.count("solve")) {
+        SolverConfig config;
+        config.maxLevel = optionInt(options, "solve", config.maxLevel);
+        config.heroLevel = optionInt(options, "hero-level", config.heroLevel);
+        config.threads = optionInt(options, "threads", config.threads);
+        config.hpBuckets = max<long long>(1, optionInt(options, "hp-buckets", config.hpBuckets));
+        config.maxItems = optionInt(options, "items", config.maxItems);
+        config.maxStates = optionInt(options, "max-states", config.maxStates);
+        config.blockSuccessRate = optionFloat(options, "block-rate", config.blockSuccessRate);
+        config.verify = optionInt(options, "verify", config.verify);
+        config.seed = seed;
+        config.tablePath = optionString(options, "table", "");
+        return runSolver(config, cout);
+    }
+    
+    if (options.count("auto")) {
+        AutoConfig config;
+        config.targetLevel = optionInt(options, "auto", config.targetLevel);
+        config.maxBattles = optionInt(options, "battles", config.maxBattles);
+        config.policy = optionString(options, "policy", config.policy);
+        config.healBelow = optionFloat(options, "heal-below", config.healBelow);
+        config.specialAt = optionInt(options, "special-at", config.specialAt);
+        config.blockSuccessRate = optionFloat(options, "block-rate", config.blockSuccessRate);
+        config.renderEvery = optionInt(options, "render-every", config.renderEvery);
+        config.plain = options.count("plain");
+        config.mcts.iterations = optionInt(options, "rollouts", config.mcts.iterations);
+        config.mcts.thinkMs = optionInt(options, "think-ms", config.mcts.thinkMs);
+        config.mcts.threads = optionInt(options, "threads", config.mcts.threads);
+        config.mcts.seed = seed;
+        config.name = optionString(options, "name", config.name);
+        config.recordPath = optionString(options, "record", "");
+        config.historyPath = optionString(options, "history", "");
+        config.seed = seed;
+        return runAuto(config);
+    }
+    
+    if (options.count("stress")) {
+        StressConfig config;
+        config.turns = optionInt(options, "stress", config.turns);
+        config.caseTurns = max<long long>(1, optionInt(options, "case-turns", config.caseTurns));
+        config.threads = optionInt(options, "threads", config.threads);
+        config.blockSuccessRate = optionFloat(options, "block-rate", config.blockSuccessRate);
+        config.replayCase = optionInt(options, "stress-case", config.replayCase);
+        config.seed = seed;
+        return runStress(config);
+    }
+    
+    if (options.count("waves")) {
+        WaveConfig config;
+        config.waves = optionInt(options, "waves", config.waves);
+        config.firstWave = optionInt(options, "wave-size", config.firstWave);
+        config.growth = optionInt(options, "growth", config.growth);
+        config.allies = optionInt(options, "allies", config.allies);
+        config.healBelow = optionFloat(options, "heal-below", config.healBelow);
+        config.seed = seed;
+        return runWaves(config);
+    }
+    
+    if (options.count("replay")) {
+        return runReplay(optionString(options, "replay", ""), options.count("show"));
+    }
+    
+    if (options.count("bench")) {
+        bool json = optionString(options, "format", "text") == "json";
+        string path = optionString(options, "out", "");
+        if (path.empty()) return runBenchmarks(optionInt(options, "bench", 10000000), json, cout);
+        ofstream file(path);
+        return runBenchmarks(optionInt(options, "bench", 10000000), json, file);
+    }
+    
+    if (options.count("server")) {
+        return runServer(optionString(options, "server", "4242"), optionString(options, "host", "127.0.0.1"),
+                         seed, optionInt(options, "turn-delay", 1000), optionString(options, "save", ""),
+                         optionString(options, "history", ""));
+    }
+    
+    if (options.count("leaderboard")) {
+        LeaderboardConfig config;
+        config.path = optionString(options, "history", "");
+        if (config.path.empty()) {
+            cerr << "--leaderboard needs --history file\n";
+            return 1;
+        }
+        config.count = max<long long>(1, optionInt(options, "leaderboard", config.count));
+        string by = optionString(options, "by", historyKeyNames[size_t(config.by)]);
+        size_t key = 0;
+        while (key < size_t(HistoryKey::PLAYER) && by != historyKeyNames[key]) key++;
+        if (key == size_t(HistoryKey::PLAYER)) {
+            cerr << "--by takes monsters, level or blocks\n";
+            return 1;
+        }
+        config.by = HistoryKey(key);
+        config.player = optionString(options, "player", "");
+        config.reindex = options.count("reindex");
+        return runLeaderboard(config);
+    }
+    
+    if (options.count("batch")) {
+        return runBatchComparison(optionInt(options, "batch", 4096), seed);
+    }
+    
+    if (options.count("balance")) {
+        BalanceConfig config;
+        config.battlesPerCell = optionInt(options, "balance", config.battlesPerCell);
+        config.maxLevel = optionInt(options, "levels", config.maxLevel);
+        config.heroLevel = optionInt(options, "hero-level", config.heroLevel);
+        config.threads = optionInt(options, "threads", config.threads);
+        config.healBelow = optionFloat(options, "heal-below", config.healBelow);
+        config.specialAt = optionInt(options, "special-at", config.specialAt);
+        config.blockSuccessRate = optionFloat(options, "block-rate", config.blockSuccessRate);
+        config.seed = seed;
+        config.json = optionString(options, "format", "csv") == "json";
+        config.batchKernel = optionString(options, "kernel", "object") == "batch";
+        if (config.batchKernel && (config.healBelow > 0.0f || config.specialAt < 3)) {
+            cerr << "--kernel batch needs --heal-below 0 and --special-at 3 or more\n";
+            return 1;
+        }
+        string error;
+        if (config.batchKernel && !BatchBattles::supportsContent(error)) {
+            cerr << "--kernel batch supports at most " << BatchBattles::MAX_MOVES << " special moves per side: " << error << "\n";
+            return 1;
+        }
+        
+        string path = optionString(options, "out", "");
+        if (path.empty()) return runBalance(config, cout);
+        ofstream file(path);
+        return runBalance(config, file);
+    }
+    
+    if (options.count("tune")) {
+        TunerConfig config;
+        config.generations = optionInt(options, "tune", config.generations);
+        config.population = optionInt(options, "population", config.population);
+        config.battlesPerCell = max<long long>(1, optionInt(options, "battles", config.battlesPerCell));
+        config.levels = max<long long>(1, optionInt(options, "levels", config.levels));
+        config.threads = optionInt(options, "threads", config.threads);
+        config.extraItems = optionInt(options, "extra-items", config.extraItems);
+        config.winFirst = optionFloat(options, "win-first", config.winFirst);
+        config.winLast = optionFloat(options, "win-last", config.winLast);
+        config.turnsFirst = optionFloat(options, "turns-first", config.turnsFirst);
+        config.turnsLast = optionFloat(options, "turns-last", config.turnsLast);
+        config.turnsWeight = optionFloat(options, "turns-weight", config.turnsWeight);
+        config.mutation = optionFloat(options, "mutation", config.mutation);
+        config.blockSuccessRate = optionFloat(options, "block-rate", config.blockSuccessRate);
+        config.seed = seed;
+        
+        string path = optionString(options, "out", "");
+        if (path.empty()) return runTuner(config, cout);
+        ofstream file(path);
+        return runTuner(config, file);
+    }
+    
     clearScreen();
     displayGameTitle();
     
     string playerName;
     cout << "\nEnter your hero's name: ";
-    getline(cin, playerName);
+    cout.flush();
+    consoleInput.readLine(playerName);
     
     Hero player(playerName);
+    int monstersDefeated = 0;
     
-    // Give starting items
-    player.addItem({"Health Potion", "Instantly restores 15 HP", 0, 15.0f, 0.0f, 0.0f, 8});
-    player.addItem({"Healing Salve", "Heals 6 HP per turn for 4 turns", 4, 6.0f, 0.0f, 0.0f, 8});
-    player.addXP(300);
+    // Resume a saved profile, possibly mid-battle
+    string savePath = optionString(options, "save", "");
+    unique_ptr<Creature> resumedMonster;
+    MappedSnapshots saved;
+    const PlayerSnapshot* profile = savePath.empty() || !saved.open(savePath) ? nullptr : saved.find(playerName);
+    if (profile) {
+        resumedMonster = restoreSnapshot(*profile, player, monstersDefeated);
+        cout << "Welcome back, " << player.getName() << "!\n";
+    } else {
+        // Give starting items
+        giveStartingItems(player);
+    }
     
-    int monstersDefeated = 0;
+    // Record the run for replays and bug reports
+    BattleRecorder recorder;
+    string recordPath = optionString(options, "record", "");
+    if (!recordPath.empty() && !recorder.start(recordPath, player, monstersDefeated, resumedMonster.get())) {
+        cerr << "Cannot write battle log " << recordPath << "\n";
+        return 1;
+    }
     
     displayTutorial();
     
+    FrameRenderer renderer(STDOUT_FILENO);
+    if (isatty(STDOUT_FILENO) && !options.count("plain")) {
+        screen = &renderer;
+        screen->begin();
+    }
+    
     while (player.estVivant()) {
         clearScreen();
         
         // Select and scale monster based on progress
-        int monsterIndex = rand() % monsterTemplates.size();
+        int monsterIndex = resumedMonster ? 0 : consoleContext.rng.below(content.monsters.size());
         int monsterLevel = 1 + (monstersDefeated / 3);
-        Creature monster(monsterTemplates[monsterIndex], monsterLevel);
+        Creature monster = resumedMonster ? *resumedMonster : Creature(content.monsters[monsterIndex], monsterLevel);
         
         cout << "A level " << monster.getNiveau() << " " 
-             << elementNames[monster.getType()] << " " 
-             << monster.getName() << " appears!\n\n";
+             << content.elementName(monster.getType()) << " " 
+             << monster.getName() << (resumedMonster ? " is still here!\n\n" : " appears!\n\n");
+        resumedMonster.reset();
+        recorder.battle(monster);
+        countStat(Counter::BATTLES);
         
         // Battle loop
         bool playerTurn = true;
         bool battleContinues = true;
         
         while (battleContinues && monster.estVivant() && player.estVivant()) {
-            displayBattle(player, monster);
+            showBattle(player, monster);
             
             if (playerTurn) {
-                cout << "\nYour turn! Choose action:\n"
-                     << "1. Attack (Build combo)\n"
-                     << "2. Special Move (Requires 3+ combo points)\n"
-                     << "3. Block Stance\n"
-                     << "4. Use Item\n"
-                     << "5. Try to Run\n"
-                     << "Choice: ";
+                if (!savePath.empty()) {
+                    PlayerSnapshot snapshot = takeSnapshot(player, monstersDefeated, &monster);
+                    storeProfile(savePath, player.getName(), &snapshot);
+                }
+                recorder.flush();
+                countStat(Counter::TURNS);
+                cout << battleMenu;
                 
-                int choice;
-                cin >> choice;
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                int choice = readChoice();
+                if (choice < 0) {  // input closed
+                    if (screen) screen->end();
+                    return 0;
+                }
                 
                 clearScreen();
                 
                 switch(choice) {
-                    case 1: {
-                        float damage = player.attaque(monster);
-                        cout << "You attack!\n";
-                        monster.subitDegat(damage);
-                        player.setBlocking(false);
-                        break;
-                    }
-                    case 2: {
-                        string result = player.performHeroSpecialMove(monster);
-                        cout << "Special Move: " << result << "!\n";
-                        player.setBlocking(false);
-                        break;
-                    }
-                    case 3: {
-                        cout << "You take a defensive stance!\n";
-                        player.setBlocking(true);
+                    case 1:
+                    case 2:
+                    case 3:
+                    case 5:
+                        recorder.choice(HeroAction(choice));
+                        battleContinues = heroTurn(player, monster, HeroAction(choice));
                         break;
-                    }
                     case 4: {
-                        auto inventory = player.getInventoryList();
-                        if (inventory.empty()) {
+                        auto available = player.getAvailableItems();
+                        if (available.empty()) {
                             cout << "No items in inventory!\n";
+                            recorder.skippedTurn();
+                            player.setBlocking(false);
                         } else {
-                            cout << "Choose item to use (1-" << inventory.size() << "): ";
-                            int itemChoice;
-                            cin >> itemChoice;
-                            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                            if (itemChoice > 0 && itemChoice <= inventory.size()) {
-                                player.useItem(itemChoice - 1);
+                            cout << "Choose item to use (1-" << available.size() << "): ";
+                            int itemChoice = readChoice();
+                            if (itemChoice > 0 && itemChoice <= int(available.size())) {
+                                recorder.choice(HeroAction::ITEM, available[itemChoice - 1]);
+                                heroTurn(player, monster, HeroAction::ITEM, available[itemChoice - 1]);
                             } else {
                                 cout << "Invalid item choice!\n";
+                                recorder.skippedTurn();
+                                player.setBlocking(false);
                             }
                         }
-                        player.setBlocking(false);
-                        break;
-                    }
-                    case 5: {
-                        if (rand() % 4 == 0) {
-                            cout << "You successfully ran away!\n";
-                            battleContinues = false;
-                        } else {
-                            cout << "Couldn't escape!\n";
-                            float damage = monster.attaque(player);
-                            cout << "\n" << monster.getName() << " attacks from behind!\n";
-                            player.subitDegat(damage*1.3);
-                        }
-                        player.setBlocking(false);
                         break;
                     }
                     default:
                         cout << "Invalid choice! Turn skipped.\n";
+                        recorder.skippedTurn();
                         player.setBlocking(false);
                 }
                 
                 pause(1000);
             } else {
-                // Monster's turn
-                if (rand() % 4 == 0) { // 25% chance for special move
-                    string moveName = monster.performSpecialMove(player);
-                    cout << "\n" << monster.getName() << " uses " << moveName << "!\n";
-                } else {
-                    float damage = monster.attaque(player);
-                    cout << "\n" << monster.getName() << " attacks!\n";
-                    player.subitDegat(damage);
-                }
-                
-                // Update status effects and active items
-                player.updateStatusEffects();
-                player.updateActiveItems();
-                monster.updateStatusEffects();
-                
+                monsterTurn(player, monster);
                 pause(1000);
             }
             
@@ -730,28 +7211,24 @@ int main() {
         }
         
         if (!monster.estVivant() && battleContinues) {
-            cout << "\nVictory! You defeated the " << monster.getName() << "!\n";
-            
-            // Calculate XP with bonus for elemental monsters
-            float xpGained = 30 + (monster.getNiveau() * 5);
-            if (monster.getType() != MonsterType::NORMAL) {
-                xpGained *= 1.2f;
-            }
-            player.addXP(xpGained);
+            claimVictory(player, monster);
             monstersDefeated++;
-            
-            // Random item drop (50% chance)
-            if (rand() % 2 == 0) {
-                Item droppedItem = itemTemplates[rand() % itemTemplates.size()];
-                droppedItem.quantity = 1;
-                player.addItem(droppedItem);
+            if (!savePath.empty()) {
+                PlayerSnapshot snapshot = takeSnapshot(player, monstersDefeated, nullptr);
+                storeProfile(savePath, player.getName(), &snapshot);
             }
             
             cout << "\nPress Enter to continue...";
-            cin.get();
+            waitForEnter();
         }
     }
     
+    if (screen) {
+        screen->end();
+        screen = nullptr;
+    }
+    if (!savePath.empty()) storeProfile(savePath, player.getName(), nullptr);  // the run is over
+    recordRun(optionString(options, "history", ""), player, monstersDefeated, RunMode::PLAYED);
     clearScreen();
     cout << R"(
  ██████   █████  ███    ███ ███████      ██████  ██    ██ ███████ ██████                     ██████  
@@ -761,10 +7238,6 @@ int main() {
  ██████  ██   ██ ██      ██ ███████      ██████    ████   ███████ ██   ██                    ██████  
     )" << "\n\n";
     
-    cout << "Final Statistics:\n"
-         << "Monsters Defeated: " << monstersDefeated << "\n"
-         << "Final Level: " << player.getNiveau() << "\n"
-         << "Successful Blocks: " << player.getSuccessfulBlocks() << "\n\n";
-    
+    writeFinalStatistics(cout, player, monstersDefeated);
     return 0;
 }